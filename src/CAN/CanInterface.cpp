@@ -7,6 +7,8 @@
 
 #include "CanInterface.h"
 #include "CanMessageQueue.h"
+#include "MovementReorderBuffer.h"
+#include "CanTrafficProfiler.h"
 
 #include <CanSettings.h>
 #include <CanMessageFormats.h>
@@ -14,6 +16,7 @@
 #include <AppNotifyIndices.h>
 #include <Platform/Platform.h>
 #include <Platform/TaskPriorities.h>
+#include <Platform/Tasks.h>
 #include <Movement/StepTimer.h>
 #include <RTOSIface/RTOSIface.h>
 #include <InputMonitors/InputMonitor.h>
@@ -40,11 +43,16 @@ constexpr uint32_t CanUserAreaDataOffset = 512 - sizeof(CanUserAreaData);
 constexpr uint32_t CanUserAreaDataOffset = 256 - sizeof(CanUserAreaData);
 #endif
 
+// Boards with drivers need more message buffers than sensor-only boards because movement messages are queued ahead of when they are executed.
+// If there is plenty of RAM left at the end of Platform::Init then we allocate more than the minimum number of buffers, keeping enough RAM in reserve for the objects created after that.
 #if SAMC21
-constexpr unsigned int NumCanBuffers = 20;		// SAMC21-based boards have at most one driver, so allocate fewer message buffers to save RAM
+constexpr unsigned int MinCanBuffers = (SUPPORT_DRIVERS) ? 20 : 12;		// SAMC21-based boards have at most one driver, so allocate fewer message buffers to save RAM
+constexpr size_t CanBufferRamReserve = 6 * 1024;
 #else
-constexpr unsigned int NumCanBuffers = 40;
+constexpr unsigned int MinCanBuffers = (SUPPORT_DRIVERS) ? 40 : 24;
+constexpr size_t CanBufferRamReserve = 32 * 1024;
 #endif
+constexpr unsigned int MaxCanBuffers = (MinCanBuffers * 3)/2;
 
 static CanDevice *can0dev = nullptr;
 static CanUserAreaData canConfigData;
@@ -58,6 +66,13 @@ static CanAddress currentMasterAddress =
 
 static unsigned int txTimeouts = 0;
 static uint32_t lastCancelledId = 0;
+static unsigned int numCanBuffers = 0;
+static unsigned int receiveBufferWaits = 0;			// the number of times the receiver task had to wait for a buffer
+static uint32_t maxReceiveBufferWaitTicks = 0;
+static uint32_t totalReceiveBufferWaitTicks = 0;
+static unsigned int numMessagesProcessed = 0;		// the number of received messages that the receiver task processed
+static uint32_t maxProcessingTicks = 0;
+static uint32_t totalProcessingTicks = 0;
 static bool enabled = false;
 
 constexpr CanDevice::Config Can0Config =
@@ -136,8 +151,54 @@ uint8_t expectedSeq = 0xFF;
 //DEBUG
 //static int32_t accumulatedMotion = 0;
 
+// Priority lanes for commands, so that a burst of less urgent commands such as LED strip updates doesn't delay more urgent ones
+enum class CommandLane : uint8_t
+{
+	driverState = 0,			// driver enable/disable and torque mode
+	setpoint,					// heater, fan and GPIO output setpoints and the temperature reports used by heaters
+	configuration,				// everything else
+	led,						// LED strip configuration and updates
+	numLanes
+};
+
+static constexpr const char *_ecv_array CommandLaneNames[] = { "driver state", "setpoints", "configuration", "LEDs" };
+static_assert(ARRAY_SIZE(CommandLaneNames) == (size_t)CommandLane::numLanes);
+
+static CommandLane GetCommandLane(CanMessageType msgType) noexcept
+{
+	switch (msgType)
+	{
+	case CanMessageType::setDriverStates:
+	case CanMessageType::m569p4:
+		return CommandLane::driverState;
+
+	case CanMessageType::setHeaterTemperature:
+	case CanMessageType::heaterFeedForward:
+	case CanMessageType::setFanSpeed:
+	case CanMessageType::writeGpio:
+	case CanMessageType::sensorTemperaturesReport:
+		return CommandLane::setpoint;
+
+	case CanMessageType::writeLedStrip:
+	case CanMessageType::m950Led:
+		return CommandLane::led;
+
+	default:
+		return CommandLane::configuration;
+	}
+}
+
 static CanMessageQueue PendingMoves;
-static CanMessageQueue PendingCommands;
+static constexpr const char *_ecv_array MoveLaneNames[] = { "moves" };
+static CanMessageQueue PendingCommands((size_t)CommandLane::numLanes);
+
+#if SUPPORT_DRIVERS
+static MovementReorderBuffer MoveReorderBuffer(PendingMoves);		// puts movement messages back in sequence before they are added to PendingMoves
+static CanMessageBuffer *volatile spareMoveBuffer = nullptr;		// a buffer that the Move task has finished with, kept for the receiver task to re-use
+static volatile bool moveResyncRequested = false;					// set by other tasks to ask the receiver task to resync MoveReorderBuffer
+static volatile bool receiverWaitingForBuffer = false;				// true while the receiver task is blocked waiting for the buffer pool
+static unsigned int moveBuffersRecycled = 0;
+#endif
 
 static Mutex txFifoMutex;
 
@@ -164,6 +225,21 @@ namespace CanInterface
 	CanMessageBuffer *ProcessReceivedMessage(CanMessageBuffer *buf) noexcept;
 }
 
+// Process a received message and record how long it took
+static CanMessageBuffer *ProcessAndTimeReceivedMessage(CanMessageBuffer *buf) noexcept
+{
+	const uint32_t startTime = StepTimer::GetTimerTicks();
+	buf = CanInterface::ProcessReceivedMessage(buf);
+	const uint32_t ticks = StepTimer::GetTimerTicks() - startTime;
+	totalProcessingTicks += ticks;
+	if (ticks > maxProcessingTicks)
+	{
+		maxProcessingTicks = ticks;
+	}
+	++numMessagesProcessed;
+	return buf;
+}
+
 // Initialise this module and the CAN hardware
 void CanInterface::Init(CanAddress defaultBoardAddress, bool useAlternatePins, bool full) noexcept
 {
@@ -221,6 +297,11 @@ void CanInterface::Init(CanAddress defaultBoardAddress, bool useAlternatePins, b
 								0, whichPort,
 #endif
 								Can0Config, can0Memory, timing, nullptr);
+#if !SAME70 && !RP2040
+	CanTrafficProfiler::Init(can0dev->GetTimeStampPeriod());
+#else
+	CanTrafficProfiler::Init(0);
+#endif
 
 #ifdef SAMMYC21
 	pinMode(CanStandbyPin, OUTPUT_LOW);							// take the CAN drivers out of standby
@@ -268,7 +349,9 @@ void CanInterface::Init(CanAddress defaultBoardAddress, bool useAlternatePins, b
 
 	if (full)
 	{
-		CanMessageBuffer::Init(NumCanBuffers);
+		const ptrdiff_t spareRam = Tasks::GetNeverUsedRam() - (ptrdiff_t)CanBufferRamReserve;
+		numCanBuffers = MinCanBuffers + ((spareRam <= 0) ? 0 : min<unsigned int>(spareRam/sizeof(CanMessageBuffer), MaxCanBuffers - MinCanBuffers));
+		CanMessageBuffer::Init(numCanBuffers);
 
 		// Create the clock sync
 		canClockTask = new Task<CanClockTaskStackWords>;
@@ -325,6 +408,7 @@ bool CanInterface::Send(CanMessageBuffer *buf) noexcept
 		lastCancelledId = cancelledId;
 		++txTimeouts;
 	}
+	CanTrafficProfiler::RecordSent(buf, cancelledId != 0);
 	return true;
 }
 
@@ -341,12 +425,89 @@ bool CanInterface::SendAndFree(CanMessageBuffer *buf) noexcept
 	return ok;
 }
 
-// Return a move message, if there is one. Caller must free the message buffer.
+// Return a move message, if there is one. Caller must release the message buffer by calling FreeCanMove.
 CanMessageBuffer * CanInterface::GetCanMove(uint32_t timeout) noexcept
 {
 	return PendingMoves.GetMessage(timeout);
 }
 
+#if SUPPORT_DRIVERS
+
+// Release a buffer returned by GetCanMove.
+// Every move message that we queue costs the receiver task a buffer, so rather than return the buffer to the pool only for the receiver task to allocate it again,
+// we give it straight back to the receiver task unless it already has a spare. This saves two pool operations per move and leaves the pool for other messages.
+// If the receiver task is waiting for the pool then we must free the buffer to the pool instead, because that is what wakes it up.
+void CanInterface::FreeCanMove(CanMessageBuffer *buf) noexcept
+{
+	{
+		AtomicCriticalSectionLocker lock;
+		if (spareMoveBuffer == nullptr && !receiverWaitingForBuffer)
+		{
+			spareMoveBuffer = buf;
+			return;
+		}
+	}
+	CanMessageBuffer::Free(buf);
+}
+
+// Ask the receiver task to forget the movement message sequence, because movement has been stopped. It does this before it processes the next message.
+void CanInterface::ResyncMoves() noexcept
+{
+	moveResyncRequested = true;
+}
+
+#endif
+
+// Get a buffer for the receiver task, using the spare move buffer if there is one. If the pool is empty then record how long we had to wait.
+static CanMessageBuffer *AllocateReceiveBuffer() noexcept
+{
+	CanMessageBuffer *buf;
+#if SUPPORT_DRIVERS
+	{
+		AtomicCriticalSectionLocker lock;
+		buf = spareMoveBuffer;
+		spareMoveBuffer = nullptr;
+	}
+	if (buf != nullptr)
+	{
+		++moveBuffersRecycled;
+		return buf;
+	}
+#endif
+
+	buf = CanMessageBuffer::Allocate();
+	if (buf == nullptr)
+	{
+#if SUPPORT_DRIVERS
+		// Tell FreeCanMove to free buffers to the pool while we wait. A buffer may have been made spare since we checked, so check again.
+		{
+			AtomicCriticalSectionLocker lock;
+			buf = spareMoveBuffer;
+			spareMoveBuffer = nullptr;
+			receiverWaitingForBuffer = (buf == nullptr);
+		}
+		if (buf != nullptr)
+		{
+			++moveBuffersRecycled;
+			return buf;
+		}
+#endif
+		const uint32_t startTime = StepTimer::GetTimerTicks();
+		buf = CanMessageBuffer::BlockingAllocate();
+#if SUPPORT_DRIVERS
+		receiverWaitingForBuffer = false;
+#endif
+		const uint32_t waitTicks = StepTimer::GetTimerTicks() - startTime;
+		++receiveBufferWaits;
+		totalReceiveBufferWaitTicks += waitTicks;
+		if (waitTicks > maxReceiveBufferWaitTicks)
+		{
+			maxReceiveBufferWaitTicks = waitTicks;
+		}
+	}
+	return buf;
+}
+
 CanMessageBuffer *CanInterface::GetCanCommand(uint32_t timeout) noexcept
 {
 	return PendingCommands.GetMessage(timeout);
@@ -480,9 +641,8 @@ CanMessageBuffer *CanInterface::ProcessReceivedMessage(CanMessageBuffer *buf) no
 			//DEBUG
 			//accumulatedMotion +=buf->msg.moveLinear.perDrive[0].steps;
 			//END
-			PendingMoves.AddMessage(buf);
 			Platform::OnProcessingCanMessage();
-			return nullptr;
+			return MoveReorderBuffer.AddMessage(buf, buf->msg.moveLinear.seq, buf->msg.moveLinear.whenToExecute);
 
 		case CanMessageType::movementLinearShaped:
 			// Check for duplicate and out-of-sequence message
@@ -599,9 +759,8 @@ CanMessageBuffer *CanInterface::ProcessReceivedMessage(CanMessageBuffer *buf) no
 			//DEBUG
 			//accumulatedMotion +=buf->msg.moveLinear.perDrive[0].steps;
 			//END
-			PendingMoves.AddMessage(buf);
 			Platform::OnProcessingCanMessage();
-			return nullptr;
+			return MoveReorderBuffer.AddMessage(buf, buf->msg.moveLinearShaped.seq, buf->msg.moveLinearShaped.whenToExecute);
 
 		case CanMessageType::stopMovement:
 			moveInstance->StopDrivers(buf->msg.stopMovement.whichDrives);
@@ -697,7 +856,7 @@ CanMessageBuffer *CanInterface::ProcessReceivedMessage(CanMessageBuffer *buf) no
 			if (buf->id.Dst() == GetCanAddress() && buf->id.IsRequest())
 			{
 				isProgrammed = true;					// record that we've had a communication from the master since we started up
-				PendingCommands.AddMessage(buf);		// it's addressed to us, so queue it for processing
+				PendingCommands.AddMessage(buf, (size_t)GetCommandLane(buf->id.MsgType()));	// it's addressed to us, so queue it for processing
 				return nullptr;
 			}
 			break;
@@ -705,7 +864,7 @@ CanMessageBuffer *CanInterface::ProcessReceivedMessage(CanMessageBuffer *buf) no
 	}
 	else if (buf->id.Dst() == CanId::BroadcastAddress && buf->id.MsgType() == CanMessageType::sensorTemperaturesReport && buf->id.IsRequest())
 	{
-		PendingCommands.AddMessage(buf);				// it's a broadcast message that we are interested in, so queue it for processing
+		PendingCommands.AddMessage(buf, (size_t)CommandLane::setpoint);	// it's a broadcast message that we are interested in, so queue it for processing
 		return nullptr;
 	}
 
@@ -740,18 +899,59 @@ void CanInterface::Diagnostics(const StringRef& reply) noexcept
 	}
 
 #if SUPPORT_DRIVERS
-	reply.lcatf("dup %u, oos %u/%u/%u/%u, bm %u, wbm %" PRIu32 ", rxMotionDelay %" PRIu32,
-					duplicateMotionMessages, oosMessages1Ahead, oosMessages2Ahead, oosMessages2Behind, oosMessagesOther, badMoveCommands, worstBadMove, maxMotionProcessingDelay);
-	duplicateMotionMessages = oosMessages1Ahead = oosMessages2Ahead = oosMessages2Behind = oosMessagesOther = badMoveCommands = 0;
+	reply.lcatf("dup %u, oos %u/%u/%u/%u, bm %u, wbm %" PRIu32 ", rxMotionDelay %" PRIu32 ", recycled %u",
+					duplicateMotionMessages, oosMessages1Ahead, oosMessages2Ahead, oosMessages2Behind, oosMessagesOther, badMoveCommands, worstBadMove, maxMotionProcessingDelay,
+						moveBuffersRecycled);
+	duplicateMotionMessages = oosMessages1Ahead = oosMessages2Ahead = oosMessages2Behind = oosMessagesOther = badMoveCommands = moveBuffersRecycled = 0;
 	worstBadMove = maxMotionProcessingDelay = 0;
 	if (minAdvance <= maxAdvance)
 	{
 		reply.catf( ", adv %" PRIi32 "/%" PRIi32, minAdvance, maxAdvance);
 	}
 	ResetAdvance();
+	MoveReorderBuffer.AppendDiagnostics(reply);
 #endif
 }
 
+// Report the buffer pool, receive and move queue statistics. The traffic profile is reported separately by CanTrafficProfiler.
+void CanInterface::TrafficDiagnostics(const StringRef& reply) noexcept
+{
+	// Report which subsystems are holding buffers. The receiver task always holds one once it has started, so we count that with the others.
+	const unsigned int numFree = CanMessageBuffer::GetFreeBuffers();
+	const unsigned int inMoveQueue = PendingMoves.GetDepth();
+	const unsigned int inCommandQueue = PendingCommands.GetDepth();
+#if SUPPORT_DRIVERS
+	const unsigned int inReorderBuffer = MoveReorderBuffer.GetNumHeld();
+	const unsigned int spare = (spareMoveBuffer != nullptr) ? 1 : 0;
+#else
+	constexpr unsigned int inReorderBuffer = 0, spare = 0;
+#endif
+	const unsigned int held = inMoveQueue + inCommandQueue + inReorderBuffer + spare + numFree;
+	reply.lcatf("CAN buffers %u, free %u, held by move queue %u, command queue %u, reorder %u, spare %u, other %u",
+					numCanBuffers, numFree, inMoveQueue, inCommandQueue, inReorderBuffer, spare, (held < numCanBuffers) ? numCanBuffers - held : 0);
+	reply.lcatf("CAN receive: processing time avg %.1fus max %.1fus, buffer waits %u",
+					(double)((numMessagesProcessed == 0) ? 0.0 : ((float)totalProcessingTicks * (1'000'000.0/(float)StepTimer::StepClockRate))/(float)numMessagesProcessed),
+					(double)((float)maxProcessingTicks * (1'000'000.0/(float)StepTimer::StepClockRate)), receiveBufferWaits);
+	numMessagesProcessed = 0;
+	totalProcessingTicks = maxProcessingTicks = 0;
+	if (receiveBufferWaits != 0)
+	{
+		reply.catf(", average %.2fms, max %.2fms",
+					(double)((float)totalReceiveBufferWaitTicks * StepTimer::StepClocksToMillis/(float)receiveBufferWaits),
+					(double)((float)maxReceiveBufferWaitTicks * StepTimer::StepClocksToMillis));
+	}
+	receiveBufferWaits = 0;
+	totalReceiveBufferWaitTicks = maxReceiveBufferWaitTicks = 0;
+
+	PendingMoves.AppendDiagnostics(reply, "Move queue", MoveLaneNames);
+}
+
+// Report the command queue statistics. These have their own diagnostics part because there is a line for each lane that was used.
+void CanInterface::CommandQueueDiagnostics(const StringRef& reply) noexcept
+{
+	PendingCommands.AppendDiagnostics(reply, "Command queue", CommandLaneNames);
+}
+
 // Send an announcement message if we need to, returning true if we sent one. On return the buffer is available to use again.
 bool CanInterface::SendAnnounce(CanMessageBuffer *buf) noexcept
 {
@@ -884,6 +1084,7 @@ extern "C" [[noreturn]] void CanClockLoop(void *) noexcept
 								CanDevice::RxBufferNumber::buffer0,
 #endif
 									TaskBase::TimeoutUnlimited, &buf);
+		CanTrafficProfiler::RecordReceived(&buf);
 		if (buf.id.MsgType() == CanMessageType::timeSync
 #if defined(ATEIO) || defined(ATECM)
 			&& (buf.id.Src() == CanId::ATEMasterAddress))			// ATE boards only respond to the ATE master, because a main board under test may also transmit when it starts up
@@ -911,14 +1112,28 @@ extern "C" [[noreturn]] void CanReceiverLoop(void *) noexcept
 			// Get a buffer
 			if (buf == nullptr)
 			{
-				buf = CanMessageBuffer::BlockingAllocate();
+				buf = AllocateReceiveBuffer();
 			}
 
-			if (can0dev->ReceiveMessage(CanDevice::RxBufferNumber::fifo0, TaskBase::TimeoutUnlimited, buf))
+#if SUPPORT_DRIVERS
+			// If we are holding movement messages that arrived out of sequence then we must wake up in time to release them
+			const uint32_t timeout = MoveReorderBuffer.CheckDeadlines();
+#else
+			constexpr uint32_t timeout = TaskBase::TimeoutUnlimited;
+#endif
+			if (can0dev->ReceiveMessage(CanDevice::RxBufferNumber::fifo0, timeout, buf))
 			{
-				buf = CanInterface::ProcessReceivedMessage(buf);
+#if SUPPORT_DRIVERS
+				if (moveResyncRequested)
+				{
+					moveResyncRequested = false;
+					MoveReorderBuffer.Resync();
+				}
+#endif
+				CanTrafficProfiler::RecordReceived(buf);
+				buf = ProcessAndTimeReceivedMessage(buf);
 			}
-			else
+			else if (timeout == TaskBase::TimeoutUnlimited)
 			{
 #ifdef DEBUG
 				debugPrintf("CAN read err\n");
@@ -936,17 +1151,98 @@ constexpr size_t DebugBufferSize = 512;
 static_assert((DebugBufferSize & (DebugBufferSize - 1)) == 0);		// DebugBufferSize must be a power of 2
 volatile bool debugBufferBeingWritten = false;
 
+// To stop one task flooding the buffer and the bus, each task that calls debugPrintf may send a burst of lines but after that is limited to a steady rate.
+// A line that exceeds the limit is discarded whole, so the lines that do get through are complete. We decide per line rather than per call because
+// the formatter doesn't always pass us a null terminator, and one call may write several lines.
+// We don't lock the table because debugPrintf may be called from an ISR. Occasionally a message may be counted against the wrong task, which doesn't matter.
+constexpr size_t MaxDebugSources = 8;								// if more tasks than this call debugPrintf then the extra ones share the last entry
+constexpr unsigned int DebugMessageBurst = 10;
+constexpr uint32_t DebugMessageIntervalMillis = 50;				// each task may send one line per interval on average after its burst
+constexpr unsigned int MaxDebugFramesPerWakeup = 2;				// the most debug text frames we send at once...
+constexpr uint32_t DebugFrameIntervalMillis = 10;					// ...and how long we wait before sending more
+
+struct DebugSource
+{
+	TaskHandle task;
+	uint32_t whenLastRefilled;
+	unsigned int tokens;
+};
+
+static DebugSource debugSources[MaxDebugSources];
+static size_t numDebugSources = 0;
+static bool debugMessageDiscarding = false;						// true if we are discarding the rest of the current line
+static unsigned int debugMessagesSuppressed = 0;					// lines discarded by the rate limit since we last sent a notice about them
+static unsigned int debugMessagesTruncated = 0;					// lines cut short because the buffer was full since we last sent a notice about them
+
+// Decide whether the calling task may send another line of debug text
+static bool AdmitDebugMessage() noexcept
+{
+	const TaskHandle caller = TaskBase::GetCallerTaskHandle();
+	const uint32_t now = millis();
+	size_t i = 0;
+	while (i < numDebugSources && debugSources[i].task != caller)
+	{
+		++i;
+	}
+	DebugSource *src;
+	if (i < numDebugSources)
+	{
+		src = &debugSources[i];
+		const uint32_t newTokens = (now - src->whenLastRefilled)/DebugMessageIntervalMillis;
+		if (newTokens != 0)
+		{
+			src->tokens = min<unsigned int>(src->tokens + newTokens, DebugMessageBurst);
+			src->whenLastRefilled = (src->tokens == DebugMessageBurst) ? now : src->whenLastRefilled + newTokens * DebugMessageIntervalMillis;
+		}
+	}
+	else
+	{
+		src = &debugSources[min<size_t>(numDebugSources, MaxDebugSources - 1)];
+		if (numDebugSources < MaxDebugSources)
+		{
+			++numDebugSources;
+			src->task = caller;
+			src->whenLastRefilled = now;
+			src->tokens = DebugMessageBurst;
+		}
+	}
+
+	if (src->tokens == 0)
+	{
+		++debugMessagesSuppressed;
+		return false;
+	}
+	--src->tokens;
+	return true;
+}
+
+// Store a character of debug text. A newline or a null character marks the end of a line, and we decide whether to keep a line when we see its first character.
+// We always return true, because we want the rest of a line to be formatted so that we see where it ends even if we are discarding it.
 bool CanInterface::DebugPutc(char c) noexcept
 {
-	if (c != 0)
+	if (c == 0)
 	{
-		const bool b = debugBuffer.PutItem(c);
-		debugBufferBeingWritten = b;
-		return b;
+		debugBufferBeingWritten = false;
+		WakeAsyncSender();
+		return true;
 	}
 
-	debugBufferBeingWritten = false;
-	WakeAsyncSender();
+	if (!debugBufferBeingWritten)
+	{
+		// This is the first character of a new line
+		debugBufferBeingWritten = true;
+		debugMessageDiscarding = !AdmitDebugMessage();
+	}
+	if (!debugMessageDiscarding && !debugBuffer.PutItem(c))
+	{
+		++debugMessagesTruncated;
+		debugMessageDiscarding = true;
+	}
+	if (c == '\n')
+	{
+		debugBufferBeingWritten = false;
+		WakeAsyncSender();
+	}
 	return true;
 }
 
@@ -976,10 +1272,20 @@ extern "C" [[noreturn]] void CanAsyncSenderLoop(void *) noexcept
 			CanInterface::SendAsync(&buf);					// this doesn't free the buffer, so we can re-use it
 		}
 
+		uint32_t waitTime = timeToWait;
 #if !USE_SERIAL_DEBUG
+		// Send some debug text, leaving the rest for later so that we don't occupy the bus for long
 		size_t numChars;
+		unsigned int framesSent = 0;
 		while (!debugBufferBeingWritten && (numChars = debugBuffer.ItemsPresent()) != 0)
 		{
+			if (framesSent == MaxDebugFramesPerWakeup)
+			{
+				waitTime = min<uint32_t>(waitTime, DebugFrameIntervalMillis);
+				break;
+			}
+			++framesSent;
+
 			auto debugMsg = buf.SetupStatusMessage<CanMessageDebugText>(CanInterface::GetCanAddress(), currentMasterAddress);
 			size_t numToSend = min<size_t>(numChars, ARRAY_SIZE(debugMsg->text));
 			debugBuffer.GetBlock(debugMsg->text, numToSend);
@@ -994,9 +1300,20 @@ extern "C" [[noreturn]] void CanAsyncSenderLoop(void *) noexcept
 			buf.dataLength = numToSend;
 			CanInterface::Send(&buf);
 		}
+
+		// If we discarded any debug text then say so once the buffer has been emptied
+		if (!debugBufferBeingWritten && debugBuffer.ItemsPresent() == 0 && (debugMessagesSuppressed | debugMessagesTruncated) != 0)
+		{
+			const unsigned int suppressed = debugMessagesSuppressed, truncated = debugMessagesTruncated;
+			debugMessagesSuppressed = debugMessagesTruncated = 0;
+			auto debugMsg = buf.SetupStatusMessage<CanMessageDebugText>(CanInterface::GetCanAddress(), currentMasterAddress);
+			SafeSnprintf(debugMsg->text, ARRAY_SIZE(debugMsg->text), "[debug text lost: %u lines rate limited, %u truncated]", suppressed, truncated);
+			buf.dataLength = strlen(debugMsg->text) + 1;
+			CanInterface::Send(&buf);
+		}
 #endif
 
-		TaskBase::TakeIndexed(NotifyIndices::CanAsyncSender, timeToWait);	// wait until we are woken up because a message is available, or we time out
+		TaskBase::TakeIndexed(NotifyIndices::CanAsyncSender, waitTime);		// wait until we are woken up because a message is available, or we time out
 	}
 }
 
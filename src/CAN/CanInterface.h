@@ -20,12 +20,18 @@ namespace CanInterface
 	void Init(CanAddress defaultBoardAddress, bool useAlternatePins, bool full) noexcept;
 	void Shutdown() noexcept;
 	void Diagnostics(const StringRef& reply) noexcept;
+	void TrafficDiagnostics(const StringRef& reply) noexcept;
+	void CommandQueueDiagnostics(const StringRef& reply) noexcept;
 
 	CanAddress GetCanAddress() noexcept;
 	CanAddress GetCurrentMasterAddress() noexcept;
 	GCodeResult ChangeAddressAndDataRate(const CanMessageSetAddressAndNormalTiming& msg, const StringRef& reply) noexcept;
 	bool GetCanMessage(CanMessageBuffer *buf) noexcept;
 	CanMessageBuffer *GetCanMove(uint32_t timeout) noexcept;
+#if SUPPORT_DRIVERS
+	void FreeCanMove(CanMessageBuffer *buf) noexcept;
+	void ResyncMoves() noexcept;
+#endif
 	bool Send(CanMessageBuffer *buf) noexcept;
 	bool SendAsync(CanMessageBuffer *buf) noexcept;
 	bool SendAndFree(CanMessageBuffer *buf) noexcept;
@@ -7,24 +7,45 @@
 
 #include "CanMessageQueue.h"
 #include <AppNotifyIndices.h>
+#include <Movement/StepTimer.h>
+#include <cstring>
 
-CanMessageQueue::CanMessageQueue() noexcept : pendingMessages(nullptr), taskWaitingToGet(nullptr) { }
+CanMessageQueue::CanMessageQueue(size_t p_numLanes) noexcept : numLanes(min<size_t>(p_numLanes, MaxLanes)), taskWaitingToGet(nullptr)
+{
+	memset(lanes, 0, sizeof(lanes));
+}
+
+// Get the time in the units we use to measure latency. Only the low 16 bits are stored in the message buffer.
+inline uint16_t CanMessageQueue::GetTimeNow() noexcept
+{
+	return (uint16_t)(StepTimer::GetTimerTicks() >> LatencyTimeShift);
+}
 
-void CanMessageQueue::AddMessage(CanMessageBuffer *buf) noexcept
+void CanMessageQueue::AddMessage(CanMessageBuffer *buf, size_t lane) noexcept
 {
 	buf->next = nullptr;
+
+	// We have finished with the receive time stamp by now, so we use that field to hold the time at which the message was queued
+	buf->timeStamp = GetTimeNow();
 	{
 		TaskCriticalSectionLocker lock;
 
-		if (pendingMessages == nullptr)
+		Lane& ln = lanes[min<size_t>(lane, numLanes - 1)];
+		if (ln.pendingMessages == nullptr)
 		{
-			pendingMessages = buf;
+			ln.pendingMessages = buf;
 		}
 		else
 		{
-			lastPendingMessage->next = buf;
+			ln.lastPendingMessage->next = buf;
+		}
+		ln.lastPendingMessage = buf;
+		++ln.depthHistogram[GetBucket(ln.depth)];
+		++ln.depth;
+		if (ln.depth > ln.maxDepth)
+		{
+			ln.maxDepth = ln.depth;
 		}
-		lastPendingMessage = buf;
 
 		TaskBase * const waitingTask = taskWaitingToGet;
 		if (waitingTask != nullptr)
@@ -35,6 +56,16 @@ void CanMessageQueue::AddMessage(CanMessageBuffer *buf) noexcept
 	}
 }
 
+unsigned int CanMessageQueue::GetDepth() const noexcept
+{
+	unsigned int depth = 0;
+	for (size_t i = 0; i < numLanes; ++i)
+	{
+		depth += lanes[i].depth;
+	}
+	return depth;
+}
+
 // Fetch a message from the queue, optionally waiting if necessary
 CanMessageBuffer *CanMessageQueue::GetMessage(uint32_t timeout) noexcept
 {
@@ -43,16 +74,28 @@ CanMessageBuffer *CanMessageQueue::GetMessage(uint32_t timeout) noexcept
 		{
 			TaskCriticalSectionLocker lock;
 
-			CanMessageBuffer * const buf = pendingMessages;
-			if (buf != nullptr)
+			for (size_t i = 0; i < numLanes; ++i)
 			{
-				pendingMessages = buf->next;
-				return buf;
+				Lane& ln = lanes[i];
+				CanMessageBuffer * const buf = ln.pendingMessages;
+				if (buf != nullptr)
+				{
+					ln.pendingMessages = buf->next;
+					--ln.depth;
+					++ln.numFetched;
+					const uint16_t latency = GetTimeNow() - buf->timeStamp;
+					++ln.latencyHistogram[GetBucket(latency)];
+					if (latency > ln.maxLatency)
+					{
+						ln.maxLatency = latency;
+					}
+					return buf;
+				}
 			}
 
 			if (timeout == 0)
 			{
-				return buf;
+				return nullptr;
 			}
 
 			TaskBase::ClearCurrentTaskNotifyCount(NotifyIndices::CanMessageQueue);
@@ -66,4 +109,63 @@ CanMessageBuffer *CanMessageQueue::GetMessage(uint32_t timeout) noexcept
 	}
 }
 
+void CanMessageQueue::AppendDiagnostics(const StringRef& reply, const char *_ecv_array queueName, const char *_ecv_array const laneNames[]) noexcept
+{
+	constexpr float TimeUnitsToMicroseconds = (float)(1u << LatencyTimeShift) * 1.0e6/(float)StepTimer::StepClockRate;
+	bool headerPrinted = false;
+	for (size_t i = 0; i < numLanes; ++i)
+	{
+		Lane& ln = lanes[i];
+		uint32_t depthHistogram[NumHistogramBuckets], latencyHistogram[NumHistogramBuckets];
+		unsigned int maxDepth, numFetched;
+		uint16_t maxLatency;
+		{
+			TaskCriticalSectionLocker lock;
+			memcpy(depthHistogram, ln.depthHistogram, sizeof(depthHistogram));
+			memcpy(latencyHistogram, ln.latencyHistogram, sizeof(latencyHistogram));
+			maxDepth = ln.maxDepth;
+			numFetched = ln.numFetched;
+			maxLatency = ln.maxLatency;
+			memset(ln.depthHistogram, 0, sizeof(ln.depthHistogram));
+			memset(ln.latencyHistogram, 0, sizeof(ln.latencyHistogram));
+			ln.maxDepth = ln.depth;
+			ln.numFetched = 0;
+			ln.maxLatency = 0;
+		}
+
+		// Skip lanes that have not been used, but not a lane that has messages waiting and none fetched, because that means it is stuck
+		if (numFetched == 0 && maxDepth == 0)
+		{
+			continue;
+		}
+
+		if (!headerPrinted)
+		{
+			reply.lcatf("%s: depth histogram <1 <2 <4 <8 <16 <32 <64 >=64, latency histogram (us)", queueName);
+			for (size_t j = 0; j < NumHistogramBuckets - 1; ++j)
+			{
+				reply.catf(" <%u", (unsigned int)lrintf((float)(1u << j) * TimeUnitsToMicroseconds));
+			}
+			reply.catf(" >=%u", (unsigned int)lrintf((float)(1u << (NumHistogramBuckets - 2)) * TimeUnitsToMicroseconds));
+			headerPrinted = true;
+		}
+
+		reply.lcatf(" %s: %u fetched, max depth %u, max latency %uus, depth", laneNames[i], numFetched, maxDepth, (unsigned int)lrintf((float)maxLatency * TimeUnitsToMicroseconds));
+		for (uint32_t count : depthHistogram)
+		{
+			reply.catf(" %" PRIu32, count);
+		}
+		reply.cat(", latency");
+		for (uint32_t count : latencyHistogram)
+		{
+			reply.catf(" %" PRIu32, count);
+		}
+	}
+
+	if (!headerPrinted)
+	{
+		reply.lcatf("%s: no messages", queueName);
+	}
+}
+
 // End
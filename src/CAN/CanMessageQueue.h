@@ -8,19 +8,49 @@
 #ifndef SRC_CAN_CANMESSAGEQUEUE_H_
 #define SRC_CAN_CANMESSAGEQUEUE_H_
 
+#include <RepRapFirmware.h>
 #include "CanMessageBuffer.h"
 #include <RTOSIface/RTOSIface.h>
 
+// Queue of CAN messages waiting to be processed by another task.
+// The queue may be divided into priority lanes. Messages are fetched from the lowest numbered non-empty lane, and in order of arrival within each lane.
+// For each lane we keep histograms of the queue depth when a message is added and of the time from when it is added until it is fetched.
 class CanMessageQueue
 {
 public:
-	CanMessageQueue() noexcept;
-	void AddMessage(CanMessageBuffer *buf) noexcept;
+	static constexpr size_t MaxLanes = 4;
+
+	explicit CanMessageQueue(size_t p_numLanes = 1) noexcept;
+	void AddMessage(CanMessageBuffer *buf, size_t lane = 0) noexcept;
 	CanMessageBuffer *GetMessage(uint32_t timeout) noexcept;
 
+	// Return the number of messages in all lanes
+	unsigned int GetDepth() const noexcept;
+
+	// Report the statistics and clear them. laneNames must have one entry per lane. Lanes that have not been used since the last report are left out.
+	void AppendDiagnostics(const StringRef& reply, const char *_ecv_array queueName, const char *_ecv_array const laneNames[]) noexcept;
+
 private:
-	CanMessageBuffer * volatile pendingMessages;
-	CanMessageBuffer * volatile lastPendingMessage;		// only valid when pendingMessages != nullptr
+	static constexpr size_t NumHistogramBuckets = 8;
+	static constexpr unsigned int LatencyTimeShift = 6;		// we record the time that a message was queued in units of (1 << LatencyTimeShift) step clocks
+
+	struct Lane
+	{
+		CanMessageBuffer * volatile pendingMessages;
+		CanMessageBuffer * volatile lastPendingMessage;		// only valid when pendingMessages != nullptr
+		unsigned int depth;									// the number of messages in this lane
+		unsigned int maxDepth;
+		unsigned int numFetched;
+		uint16_t maxLatency;								// in units of (1 << LatencyTimeShift) step clocks
+		uint32_t depthHistogram[NumHistogramBuckets];		// bucket n counts messages that were added when the depth was less than 2^n, or at least 2^(n-1) for the last bucket
+		uint32_t latencyHistogram[NumHistogramBuckets];		// bucket n counts messages that were fetched less than 2^n time units after being added, or at least 2^(n-1) for the last bucket
+	};
+
+	static size_t GetBucket(uint32_t value) noexcept { return min<size_t>((value == 0) ? 0 : 32 - __builtin_clz(value), NumHistogramBuckets - 1); }
+	static uint16_t GetTimeNow() noexcept;
+
+	Lane lanes[MaxLanes];
+	size_t numLanes;
 	TaskBase * volatile taskWaitingToGet;
 };
 
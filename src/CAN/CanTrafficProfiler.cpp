@@ -0,0 +1,269 @@
+/*
+ * CanTrafficProfiler.cpp
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#include "CanTrafficProfiler.h"
+#include <CanMessageBuffer.h>
+#include <Movement/StepTimer.h>
+#include <RTOSIface/RTOSIface.h>
+#include <utility>
+
+// Counts of the traffic for one message type
+struct MessageTypeCounts
+{
+	uint32_t rxFrames;
+	uint32_t rxBytes;
+	uint32_t txFrames;
+	uint32_t txBytes;
+	uint16_t txCancelled;										// frames that timed out waiting to be sent and were cancelled
+	uint16_t msgType;
+};
+
+// We don't have enough RAM for an entry for every message type, so we allocate entries in the order that the types are seen and count any further types together
+constexpr size_t MaxMessageTypes = 16;
+static MessageTypeCounts typeCounts[MaxMessageTypes + 1];		// the extra entry is for message types that we have no entry for
+
+// So that the report fits in one diagnostics reply, we report only the message types with the most traffic and count the others together
+constexpr size_t MaxMessageTypesReported = 8;
+static size_t numMessageTypes = 0;
+
+// We estimate the bus load by adding up the bits in the frames that we see during each time slot. We keep enough slots to cover a sliding window of one second.
+// We assume that bit rate switching is not used and that the data field contains the worst case number of stuff bits, so we may overestimate the time taken by each frame.
+constexpr uint32_t SlotMillis = 100;
+constexpr size_t NumCompleteSlots = 10;
+constexpr size_t NumSlots = NumCompleteSlots + 1;				// the complete slots plus the slot that we are adding to
+constexpr uint32_t FrameOverheadBits = 80;						// the bits in a CAN-FD frame with an extended ID, excluding the data field, plus the interframe space
+constexpr uint32_t BitsPerDataByte = 10;						// 8 bits plus worst case stuff bits
+constexpr uint16_t DefaultBitPeriod = (64 * StepTimer::StepClockRate)/1000000;	// bit period at 1Mbps, used if we can't get it from the CAN device
+
+struct TimeSlot
+{
+	uint32_t bits;
+	uint32_t frames;
+};
+
+static TimeSlot slots[NumSlots];
+static uint32_t currentSlotNumber = 0;							// the value of millis()/SlotMillis for the slot we are adding to
+static uint32_t peakSlotBits = 0;								// the most bits in any complete slot since we last reported
+static uint32_t bitsSinceReport = 0;
+static uint32_t whenLastReported = 0;
+static uint16_t bitPeriod = DefaultBitPeriod;
+
+static bool streaming = false;
+static uint32_t whenLastStreamed = 0;
+
+// Return the length of the data field of the frame, which is the data length rounded up to a valid CAN-FD data length
+static uint32_t PaddedDataLength(size_t dataLength) noexcept
+{
+	return (dataLength <= 8) ? dataLength
+			: (dataLength <= 24) ? (dataLength + 3) & ~3u
+				: (dataLength + 15) & ~15u;
+}
+
+// Move the current slot on to the one for the current time. Must be called with the scheduler disabled.
+static void AdvanceSlots(uint32_t slotNumber) noexcept
+{
+	if (slotNumber - currentSlotNumber >= NumSlots)
+	{
+		// We haven't seen any traffic for long enough that all the slots are out of date
+		peakSlotBits = max<uint32_t>(peakSlotBits, slots[currentSlotNumber % NumSlots].bits);
+		for (TimeSlot& s : slots)
+		{
+			s.bits = s.frames = 0;
+		}
+		currentSlotNumber = slotNumber;
+		return;
+	}
+
+	while (currentSlotNumber != slotNumber)
+	{
+		peakSlotBits = max<uint32_t>(peakSlotBits, slots[currentSlotNumber % NumSlots].bits);
+		++currentSlotNumber;
+		TimeSlot& s = slots[currentSlotNumber % NumSlots];
+		s.bits = s.frames = 0;
+	}
+}
+
+// Return the entry for the specified message type, allocating a new one if possible. Must be called with the scheduler disabled.
+static MessageTypeCounts& GetCounts(CanMessageType msgType) noexcept
+{
+	for (size_t i = 0; i < numMessageTypes; ++i)
+	{
+		if (typeCounts[i].msgType == (uint16_t)msgType)
+		{
+			return typeCounts[i];
+		}
+	}
+
+	if (numMessageTypes < MaxMessageTypes)
+	{
+		MessageTypeCounts& counts = typeCounts[numMessageTypes++];
+		memset(&counts, 0, sizeof(counts));
+		counts.msgType = (uint16_t)msgType;
+		return counts;
+	}
+	return typeCounts[MaxMessageTypes];
+}
+
+// Add a frame to the bus load estimate. Must be called with the scheduler disabled.
+static void RecordBits(size_t dataLength) noexcept
+{
+	const uint32_t bits = FrameOverheadBits + PaddedDataLength(dataLength) * BitsPerDataByte;
+	AdvanceSlots(millis()/SlotMillis);
+	TimeSlot& s = slots[currentSlotNumber % NumSlots];
+	s.bits += bits;
+	++s.frames;
+	bitsSinceReport += bits;
+}
+
+// Convert a number of bits to a percentage of the time in the specified number of milliseconds
+static float BitsToLoadPercent(uint32_t bits, uint32_t interval) noexcept
+{
+	return (interval == 0) ? 0.0
+			: ((float)bits * (float)bitPeriod * (100.0/64.0))/((float)interval * (float)(StepTimer::StepClockRate/1000));
+}
+
+// Get the bits and frames in the complete slots, which cover the last second. Must be called with the scheduler disabled.
+static void GetWindowTotals(uint32_t& bits, uint32_t& frames) noexcept
+{
+	AdvanceSlots(millis()/SlotMillis);
+	bits = frames = 0;
+	for (size_t i = 1; i <= NumCompleteSlots; ++i)
+	{
+		const TimeSlot& s = slots[(currentSlotNumber - i) % NumSlots];
+		bits += s.bits;
+		frames += s.frames;
+	}
+}
+
+void CanTrafficProfiler::Init(uint16_t p_bitPeriod) noexcept
+{
+	bitPeriod = (p_bitPeriod == 0) ? DefaultBitPeriod : p_bitPeriod;
+	whenLastReported = millis();
+	currentSlotNumber = whenLastReported/SlotMillis;
+}
+
+void CanTrafficProfiler::RecordReceived(const CanMessageBuffer *buf) noexcept
+{
+	TaskCriticalSectionLocker lock;
+
+	MessageTypeCounts& counts = GetCounts(buf->id.MsgType());
+	++counts.rxFrames;
+	counts.rxBytes += buf->dataLength;
+	RecordBits(buf->dataLength);
+}
+
+void CanTrafficProfiler::RecordSent(const CanMessageBuffer *buf, bool cancelled) noexcept
+{
+	TaskCriticalSectionLocker lock;
+
+	MessageTypeCounts& counts = GetCounts(buf->id.MsgType());
+	++counts.txFrames;
+	counts.txBytes += buf->dataLength;
+	if (cancelled)
+	{
+		++counts.txCancelled;
+	}
+	RecordBits(buf->dataLength);
+}
+
+void CanTrafficProfiler::Diagnostics(const StringRef& reply) noexcept
+{
+	// Take a copy of the counts so that we don't hold up the other tasks while we format them
+	MessageTypeCounts copiedCounts[MaxMessageTypes + 1];
+	size_t numCopied;
+	uint32_t windowBits, windowFrames, peakBits, totalBits, interval;
+	{
+		TaskCriticalSectionLocker lock;
+
+		GetWindowTotals(windowBits, windowFrames);
+		numCopied = numMessageTypes;
+		memcpy(copiedCounts, typeCounts, numCopied * sizeof(MessageTypeCounts));
+		copiedCounts[numCopied] = typeCounts[MaxMessageTypes];
+		peakBits = peakSlotBits;
+		totalBits = bitsSinceReport;
+		const uint32_t now = millis();
+		interval = now - whenLastReported;
+		whenLastReported = now;
+		numMessageTypes = 0;
+		memset(&typeCounts[MaxMessageTypes], 0, sizeof(MessageTypeCounts));
+		peakSlotBits = 0;
+		bitsSinceReport = 0;
+	}
+
+	// Move the message types with the most bytes to the front and add the rest to the entry for other types
+	const size_t numReported = min<size_t>(numCopied, MaxMessageTypesReported);
+	for (size_t i = 0; i < numReported; ++i)
+	{
+		size_t busiest = i;
+		for (size_t j = i + 1; j < numCopied; ++j)
+		{
+			if (copiedCounts[j].rxBytes + copiedCounts[j].txBytes > copiedCounts[busiest].rxBytes + copiedCounts[busiest].txBytes)
+			{
+				busiest = j;
+			}
+		}
+		std::swap(copiedCounts[i], copiedCounts[busiest]);
+	}
+
+	MessageTypeCounts& otherCounts = copiedCounts[numCopied];
+	for (size_t i = numReported; i < numCopied; ++i)
+	{
+		otherCounts.rxFrames += copiedCounts[i].rxFrames;
+		otherCounts.rxBytes += copiedCounts[i].rxBytes;
+		otherCounts.txFrames += copiedCounts[i].txFrames;
+		otherCounts.txBytes += copiedCounts[i].txBytes;
+		otherCounts.txCancelled += copiedCounts[i].txCancelled;
+	}
+
+	reply.lcatf("CAN load: average %.1f%%, last 1s %.1f%% (%" PRIu32 " frames), peak %" PRIu32 "ms %.1f%%",
+					(double)BitsToLoadPercent(totalBits, interval), (double)BitsToLoadPercent(windowBits, NumCompleteSlots * SlotMillis), windowFrames,
+						SlotMillis, (double)BitsToLoadPercent(peakBits, SlotMillis));
+	reply.lcat("CAN traffic type:rx frames/bytes:tx frames/bytes[:cancelled]");
+	for (size_t i = 0; i <= numReported; ++i)
+	{
+		const MessageTypeCounts& counts = (i == numReported) ? otherCounts : copiedCounts[i];
+		if (i == numReported)
+		{
+			if (counts.rxFrames + counts.txFrames == 0)
+			{
+				break;
+			}
+			reply.cat(" other");
+		}
+		else
+		{
+			reply.catf(" %u", counts.msgType);
+		}
+		reply.catf(":%" PRIu32 "/%" PRIu32 ":%" PRIu32 "/%" PRIu32, counts.rxFrames, counts.rxBytes, counts.txFrames, counts.txBytes);
+		if (counts.txCancelled != 0)
+		{
+			reply.catf(":%u", counts.txCancelled);
+		}
+	}
+}
+
+bool CanTrafficProfiler::ToggleStreaming() noexcept
+{
+	streaming = !streaming;
+	whenLastStreamed = millis();
+	return streaming;
+}
+
+void CanTrafficProfiler::Spin() noexcept
+{
+	if (streaming && millis() - whenLastStreamed >= NumCompleteSlots * SlotMillis)
+	{
+		whenLastStreamed = millis();
+		uint32_t windowBits, windowFrames;
+		{
+			TaskCriticalSectionLocker lock;
+			GetWindowTotals(windowBits, windowFrames);
+		}
+		debugPrintf("CAN load %.1f%%, %" PRIu32 " frames/s\n", (double)BitsToLoadPercent(windowBits, NumCompleteSlots * SlotMillis), windowFrames);
+	}
+}
+
+// End
@@ -0,0 +1,35 @@
+/*
+ * CanTrafficProfiler.h
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#ifndef SRC_CAN_CANTRAFFICPROFILER_H_
+#define SRC_CAN_CANTRAFFICPROFILER_H_
+
+#include <RepRapFirmware.h>
+
+class CanMessageBuffer;
+
+// Module to count the CAN frames and bytes that we send and receive, broken down by message type, and to estimate the bus load that they represent.
+// We only see the frames that we send and the frames that pass our receive filters, so the load figures are a lower bound on the total bus load.
+// The counts are cleared when they are reported by M122. Optionally a summary can be sent to the main board once per second as debug text.
+namespace CanTrafficProfiler
+{
+	// Set the duration of one bit at the nominal bit rate, in units of 1/64 step clock. This is the same as the CAN timestamp period.
+	void Init(uint16_t p_bitPeriod) noexcept;
+
+	void RecordReceived(const CanMessageBuffer *buf) noexcept;
+	void RecordSent(const CanMessageBuffer *buf, bool cancelled) noexcept;
+
+	// Report the statistics and clear them. Only the busiest message types are listed individually.
+	void Diagnostics(const StringRef& reply) noexcept;
+
+	// Turn the once-per-second summary on or off, returning true if it is now on
+	bool ToggleStreaming() noexcept;
+
+	// Send the once-per-second summary if it is turned on and due. Called by the main task.
+	void Spin() noexcept;
+}
+
+#endif /* SRC_CAN_CANTRAFFICPROFILER_H_ */
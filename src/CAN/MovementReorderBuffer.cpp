@@ -0,0 +1,196 @@
+/*
+ * MovementReorderBuffer.cpp
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#include "MovementReorderBuffer.h"
+#include <CanMessageBuffer.h>
+
+MovementReorderBuffer::MovementReorderBuffer(CanMessageQueue& p_queue) noexcept
+	: queue(p_queue), numHeld(0), whenLastAdded(0), nextSeq(NoSeq),
+	  numReordered(0), numSkipped(0), numLate(0), numDropped(0), numResyncs(0), maxHeld(0)
+{
+	for (uint32_t& s : skippedSeqs)
+	{
+		s = 0;
+	}
+}
+
+CanMessageBuffer *MovementReorderBuffer::AddMessage(CanMessageBuffer *buf, uint8_t seq, uint32_t whenToExecute) noexcept
+{
+	// If the main board has been reset while we weren't receiving movement messages then its sequence numbers have restarted, so start again
+	const uint32_t now = millis();
+	if (nextSeq != NoSeq && now - whenLastAdded > ResyncTimeoutMillis)
+	{
+		Resync();
+	}
+	whenLastAdded = now;
+
+	if (nextSeq == NoSeq)
+	{
+		nextSeq = seq;
+	}
+
+	const uint8_t ahead = (seq - nextSeq) & SeqMask;
+	if (ahead == 0)
+	{
+		// This is the message we were expecting, so pass it on followed by any held messages that are now in sequence
+		Deliver(buf);
+		AdvanceSeq();
+		ReleaseInSequence();
+		return nullptr;
+	}
+
+	if (ahead <= WindowSize)
+	{
+		// The message has arrived early so hold it, unless we are already holding a message with this sequence number
+		for (size_t i = 0; i < numHeld; ++i)
+		{
+			if (held[i].seq == seq)
+			{
+				++numDropped;
+				return buf;
+			}
+		}
+
+		// Release the message a little before it is due to be executed, but don't hold it for too long because the missing message has probably been lost
+		const uint32_t ticksNow = StepTimer::GetTimerTicks();
+		const uint32_t executeDeadline = whenToExecute - DeadlineMargin;
+		HeldMessage& hm = held[numHeld++];
+		hm.buf = buf;
+		hm.seq = seq;
+		hm.deadline = ((int32_t)(executeDeadline - ticksNow) < (int32_t)MaxHoldTime) ? executeDeadline : ticksNow + MaxHoldTime;
+		if (numHeld > maxHeld)
+		{
+			maxHeld = numHeld;
+		}
+		return nullptr;
+	}
+
+	if (ahead > NumSeqs/2)
+	{
+		// The message is behind the one we are expecting
+		if (IsSkipped(seq))
+		{
+			ClearSkipped(seq);
+			++numLate;
+			Deliver(buf);
+			return nullptr;
+		}
+		++numDropped;
+		return buf;
+	}
+
+	// The message is too far ahead for us to hold it, so we must have lost several messages. Give up waiting for them.
+	SkipTo(seq);
+	Deliver(buf);
+	AdvanceSeq();
+	ReleaseInSequence();
+	return nullptr;
+}
+
+uint32_t MovementReorderBuffer::CheckDeadlines() noexcept
+{
+	while (numHeld != 0)
+	{
+		// Find the held message with the earliest deadline
+		size_t earliest = 0;
+		for (size_t i = 1; i < numHeld; ++i)
+		{
+			if ((int32_t)(held[i].deadline - held[earliest].deadline) < 0)
+			{
+				earliest = i;
+			}
+		}
+
+		const int32_t timeLeft = (int32_t)(held[earliest].deadline - StepTimer::GetTimerTicks());
+		if (timeLeft > 0)
+		{
+			return max<uint32_t>(lrintf(ceilf((float)timeLeft * StepTimer::StepClocksToMillis)), 1);
+		}
+
+		// We have waited too long for the missing messages, so pass on all held messages up to and including the expired one
+		SkipTo(held[earliest].seq);
+		ReleaseInSequence();
+	}
+	return TaskBase::TimeoutUnlimited;
+}
+
+void MovementReorderBuffer::Resync() noexcept
+{
+	while (numHeld != 0)
+	{
+		CanMessageBuffer::Free(held[--numHeld].buf);
+	}
+	for (uint32_t& s : skippedSeqs)
+	{
+		s = 0;
+	}
+	nextSeq = NoSeq;
+	++numResyncs;
+}
+
+void MovementReorderBuffer::AppendDiagnostics(const StringRef& reply) noexcept
+{
+	reply.lcatf("Move reorder: reordered %u, skipped %u, late %u, dropped %u, resyncs %u, max held %u, held now %u",
+					numReordered, numSkipped, numLate, numDropped, numResyncs, maxHeld, numHeld);
+	numReordered = numSkipped = numLate = numDropped = numResyncs = 0;
+	maxHeld = numHeld;
+}
+
+// Advance the expected sequence number.
+// Sequence numbers more than half the sequence space behind the expected one are treated as ahead of it, so forget that we skipped the one that just moved out of range.
+void MovementReorderBuffer::AdvanceSeq() noexcept
+{
+	nextSeq = (nextSeq + 1) & SeqMask;
+	ClearSkipped((nextSeq + NumSeqs/2) & SeqMask);
+}
+
+// Pass on held messages while the next one in sequence is available
+void MovementReorderBuffer::ReleaseInSequence() noexcept
+{
+	size_t i = 0;
+	while (i < numHeld)
+	{
+		if (held[i].seq == nextSeq)
+		{
+			Deliver(held[i].buf);
+			++numReordered;
+			held[i] = held[--numHeld];
+			AdvanceSeq();
+			i = 0;									// start again because the next message may be earlier in the array
+		}
+		else
+		{
+			++i;
+		}
+	}
+}
+
+// Give up waiting for messages before the specified sequence number. Held messages in that range are passed on in sequence.
+void MovementReorderBuffer::SkipTo(uint8_t seq) noexcept
+{
+	while (nextSeq != seq)
+	{
+		size_t i = 0;
+		while (i < numHeld && held[i].seq != nextSeq)
+		{
+			++i;
+		}
+		if (i < numHeld)
+		{
+			Deliver(held[i].buf);
+			++numReordered;
+			held[i] = held[--numHeld];
+		}
+		else
+		{
+			SetSkipped(nextSeq);
+			++numSkipped;
+		}
+		AdvanceSeq();
+	}
+}
+
+// End
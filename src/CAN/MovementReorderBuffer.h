@@ -0,0 +1,82 @@
+/*
+ * MovementReorderBuffer.h
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#ifndef SRC_CAN_MOVEMENTREORDERBUFFER_H_
+#define SRC_CAN_MOVEMENTREORDERBUFFER_H_
+
+#include <RepRapFirmware.h>
+#include "CanMessageQueue.h"
+#include <Movement/StepTimer.h>
+
+// Class to put movement messages back into sequence number order before they are queued for the Move task.
+// A bug in the CAN hardware occasionally delivers messages out of order. When a message arrives ahead of the one we are expecting, we hold it until the missing message arrives
+// or until its deadline, whichever is sooner. If the deadline passes then we give up waiting and release the held messages, remembering which sequence numbers we skipped.
+// A message that arrives after we skipped it is passed on late, because losing its steps would be worse than executing it out of order.
+// Any other message that arrives behind the expected sequence number is a duplicate, so we drop it.
+// If no movement messages arrive for a while, or movement is stopped, we forget the expected sequence number. This is so that we don't drop the messages
+// that a restarted main board sends, and don't hold on to the messages that were in flight when the main board stopped.
+// All the functions in this class must be called from the CAN receiver task.
+class MovementReorderBuffer
+{
+public:
+	explicit MovementReorderBuffer(CanMessageQueue& p_queue) noexcept;
+
+	// Process a movement message that has the specified sequence number and must be queued by the specified step clock time.
+	// Return the buffer if it is free for re-use, else nullptr.
+	CanMessageBuffer *AddMessage(CanMessageBuffer *buf, uint8_t seq, uint32_t whenToExecute) noexcept;
+
+	// Release any held messages whose deadlines have passed. Return the number of milliseconds until the next deadline, or TaskBase::TimeoutUnlimited if we are not holding any messages.
+	uint32_t CheckDeadlines() noexcept;
+
+	// Forget the expected sequence number and any skipped sequence numbers, and discard any held messages
+	void Resync() noexcept;
+
+	size_t GetNumHeld() const noexcept { return numHeld; }
+
+	void AppendDiagnostics(const StringRef& reply) noexcept;
+
+private:
+	static constexpr size_t WindowSize = 4;									// the maximum number of sequence numbers ahead of the expected one that we hold
+	static constexpr uint8_t SeqMask = 0x7F;								// the sequence number mask, same as in CanMessageMovementLinear and CanMessageMovementLinearShaped
+	static constexpr size_t NumSeqs = SeqMask + 1;
+	static constexpr uint8_t NoSeq = 0xFF;									// value of nextSeq when we haven't received any movement messages yet
+	static constexpr uint32_t DeadlineMargin = StepTimer::StepClockRate/500;	// we release a held message this long before it is due to be executed
+	static constexpr uint32_t MaxHoldTime = StepTimer::StepClockRate/100;	// the maximum time we hold a message for
+	static constexpr uint32_t ResyncTimeoutMillis = 2000;					// if we receive no movement messages for this long then we resync on the next one
+
+	struct HeldMessage
+	{
+		CanMessageBuffer *buf;
+		uint32_t deadline;
+		uint8_t seq;
+	};
+
+	void Deliver(CanMessageBuffer *buf) noexcept { queue.AddMessage(buf); }
+	void AdvanceSeq() noexcept;
+	void ReleaseInSequence() noexcept;
+	void SkipTo(uint8_t seq) noexcept;
+
+	bool IsSkipped(uint8_t seq) const noexcept { return (skippedSeqs[seq >> 5] & (1ul << (seq & 31))) != 0; }
+	void SetSkipped(uint8_t seq) noexcept { skippedSeqs[seq >> 5] |= (1ul << (seq & 31)); }
+	void ClearSkipped(uint8_t seq) noexcept { skippedSeqs[seq >> 5] &= ~(1ul << (seq & 31)); }
+
+	CanMessageQueue& queue;
+	HeldMessage held[WindowSize];
+	size_t numHeld;
+	uint32_t skippedSeqs[NumSeqs/32];										// bitmap of sequence numbers that we gave up waiting for
+	uint32_t whenLastAdded;													// the value of millis() when we last received a movement message
+	uint8_t nextSeq;														// the sequence number of the next message to pass on
+
+	// Statistics, cleared when we report them
+	unsigned int numReordered;												// messages that we held until the messages before them arrived
+	unsigned int numSkipped;												// sequence numbers that we gave up waiting for
+	unsigned int numLate;													// messages that arrived after we gave up waiting for them
+	unsigned int numDropped;												// duplicate messages
+	unsigned int numResyncs;
+	size_t maxHeld;
+};
+
+#endif /* SRC_CAN_MOVEMENTREORDERBUFFER_H_ */
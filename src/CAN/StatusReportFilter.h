@@ -0,0 +1,38 @@
+/*
+ * StatusReportFilter.h
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#ifndef SRC_CAN_STATUSREPORTFILTER_H_
+#define SRC_CAN_STATUSREPORTFILTER_H_
+
+#include <RepRapFirmware.h>
+
+// Class to record the values of one item in a periodic status broadcast (a sensor, heater or fan) when they were last sent, so that we can send only the items that have changed.
+// The status messages have a bitmap of the items they contain, so the main board updates only the items that are present.
+// Periodically we send a full snapshot of all items, so that the main board doesn't consider the data for unchanged items to be stale.
+class StatusReportFilter
+{
+public:
+	// Return true if the item must be included in this broadcast, and if so record the values being sent.
+	// 'value' is compared with the last value sent using the deadband, 'exact' must match exactly, e.g. an error code or mode.
+	bool NeedsReport(float value, float deadband, uint32_t exact, bool fullSnapshot) noexcept
+	{
+		if (fullSnapshot || !reported || exact != lastExact || fabsf(value - lastValue) >= deadband)
+		{
+			lastValue = value;
+			lastExact = exact;
+			reported = true;
+			return true;
+		}
+		return false;
+	}
+
+private:
+	float lastValue;
+	uint32_t lastExact;
+	bool reported = false;
+};
+
+#endif /* SRC_CAN_STATUSREPORTFILTER_H_ */
@@ -0,0 +1,81 @@
+/*
+ * BiquadFilter.h
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#ifndef SRC_CLOSEDLOOP_BIQUADFILTER_H_
+#define SRC_CLOSEDLOOP_BIQUADFILTER_H_
+
+#include "RepRapFirmware.h"
+
+// Class to implement a second order IIR (biquad) filter in transposed direct form II.
+// The coefficients are calculated from the centre or cutoff frequency and Q using the formulae in Robert Bristow-Johnson's Audio EQ Cookbook.
+class BiquadFilter
+{
+public:
+	enum class Type : uint8_t { none = 0, lowPass, notch };
+
+	BiquadFilter() noexcept { Configure(Type::none, 0.0, 0.0, 1.0); }
+
+	void Reset() noexcept { z1 = z2 = 0.0; }
+
+	// Set up the filter and reset it. The frequencies are in Hz. Return false if the frequency is not below the Nyquist frequency.
+	bool Configure(Type p_type, float p_frequency, float p_q, float sampleRate) noexcept
+	{
+		Reset();
+		type = p_type;
+		frequency = p_frequency;
+		q = p_q;
+		if (type == Type::none)
+		{
+			b0 = 1.0;
+			b1 = b2 = a1 = a2 = 0.0;
+			return true;
+		}
+		if (frequency <= 0.0 || frequency >= 0.5 * sampleRate || q <= 0.0)
+		{
+			return false;
+		}
+
+		const float w0 = TwoPi * frequency/sampleRate;
+		const float cosW0 = cosf(w0);
+		const float alpha = sinf(w0)/(2.0 * q);
+		const float recipA0 = 1.0/(1.0 + alpha);
+		if (type == Type::lowPass)
+		{
+			b0 = b2 = 0.5 * (1.0 - cosW0) * recipA0;
+			b1 = (1.0 - cosW0) * recipA0;
+		}
+		else
+		{
+			b0 = b2 = recipA0;
+			b1 = -2.0 * cosW0 * recipA0;
+		}
+		a1 = -2.0 * cosW0 * recipA0;
+		a2 = (1.0 - alpha) * recipA0;
+		return true;
+	}
+
+	// Filter one sample
+	float Process(float input) noexcept
+	{
+		const float output = b0 * input + z1;
+		z1 = b1 * input - a1 * output + z2;
+		z2 = b2 * input - a2 * output;
+		return output;
+	}
+
+	Type GetType() const noexcept { return type; }
+	float GetFrequency() const noexcept { return frequency; }
+	float GetQ() const noexcept { return q; }
+
+private:
+	float b0, b1, b2, a1, a2;					// coefficients normalised so that a0 = 1
+	float z1, z2;								// state
+	float frequency;
+	float q;
+	Type type;
+};
+
+#endif /* SRC_CLOSEDLOOP_BIQUADFILTER_H_ */
@@ -44,6 +44,7 @@ using std::numeric_limits;
 # include <ClosedLoop/DerivativeAveragingFilter.h>
 
 # include <math.h>
+# include <cstring>
 # include <Platform/Platform.h>
 # include <Movement/Move.h>
 # include <General/Bitmap.h>
@@ -98,6 +99,33 @@ static inline uint32_t TickPeriodToFreq(StepTimer::Ticks tickPeriod) noexcept
 	return StepTimer::StepClockRate/tickPeriod;
 }
 
+// Variables that are stored as 32 bits in uncompressed samples. In compressed samples these take up to 5 bytes each, and the rest take up to 3 bytes each.
+constexpr uint16_t CL_RECORD_32BIT_VARIABLES = CL_RECORD_RAW_ENCODER_READING | CL_RECORD_CURRENT_MOTOR_STEPS | CL_RECORD_TARGET_MOTOR_STEPS | CL_RECORD_CURRENT_ERROR;
+constexpr size_t MaxCompressedTimestampLength = 5;
+constexpr float CompressedStepsScaling = 1024.0;			// positions and errors in compressed samples are in units of 1/1024 full step, the resolution of the motor phase
+
+// Return the minimum and maximum lengths of a compressed sample with the specified filter
+static size_t MinCompressedSampleLength(uint16_t filter) noexcept
+{
+	return 1 + Bitmap<uint16_t>::MakeFromRaw(filter & ~CL_RECORD_COMPRESSED).CountSetBits();
+}
+
+static size_t MaxCompressedSampleLength(uint16_t filter) noexcept
+{
+	return MaxCompressedTimestampLength
+			+ 5 * Bitmap<uint16_t>::MakeFromRaw(filter & CL_RECORD_32BIT_VARIABLES).CountSetBits()
+			+ 3 * Bitmap<uint16_t>::MakeFromRaw(filter & ~(CL_RECORD_32BIT_VARIABLES | CL_RECORD_COMPRESSED)).CountSetBits();
+}
+
+// Convert a value to float16 and return it as an integer that increases monotonically with the value, so that small changes give small deltas
+static inline int32_t Float16ToOrderedInt(float val) noexcept
+{
+	const float16_t f16 = (float16_t)val;
+	uint16_t bits;
+	memcpy(&bits, &f16, sizeof(bits));
+	return (bits & 0x8000) ? -(int32_t)(bits & 0x7FFF) : (int32_t)bits;
+}
+
 // Table of pointers to closed loop instances
 ClosedLoop *ClosedLoop::closedLoopInstances[NumDrivers] = { 0 };
 
@@ -164,6 +192,11 @@ static void GenerateTmcClock()
 {
 	GenerateTmcClock();															// generate the clock for the TMC2160A
 
+	// Enable the CPU cycle counter, which we use to benchmark parts of the control loop
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
 	for (size_t i = 0; i < NumDrivers; ++i)
 	{
 		closedLoopInstances[i] = new ClosedLoop();
@@ -183,8 +216,8 @@ void ClosedLoop::InitInstance() noexcept
 	ResetMonitoringVariables();
 
 	PIDITerm = 0.0;
-	errorDerivativeFilter.Reset();
-	speedFilter.Reset();
+	ResetDerivativeEstimators();
+	BuildGainScheduleTable();
 
 	UpdateStandstillCurrent();
 
@@ -221,9 +254,18 @@ GCodeResult ClosedLoop::InstanceProcessM569Point1(CanMessageGenericParser& parse
 	float tempKv = Kv;
 	float tempKa = Ka;
 	uint16_t tempStepsPerRev = 200;
-	size_t numThresholds = 2;
+	size_t numThresholds = 3;
 	float tempErrorThresholds[numThresholds];
 	float tempTorquePerAmp;
+	float tempObserverMemoryFactor;
+	float tempLookAhead;
+	size_t numScheduleSpeeds = MaxGainSchedulePoints, numScheduleKpFactors = MaxGainSchedulePoints, numScheduleKdFactors = MaxGainSchedulePoints;
+	float tempScheduleSpeeds[MaxGainSchedulePoints], tempScheduleKpFactors[MaxGainSchedulePoints], tempScheduleKdFactors[MaxGainSchedulePoints];
+	float tempAccelerationGainFactor;
+	size_t numNotchValues = 2 * MaxNotchFilters, numLowPassValues = 2;
+	float tempNotchValues[2 * MaxNotchFilters], tempLowPassValues[2];
+	size_t numThermalValues = 2;
+	float tempThermalValues[2];
 
 	// Pull changed parameters
 	const bool seenT = parser.GetUintParam('T', tempEncoderType);
@@ -233,9 +275,18 @@ GCodeResult ClosedLoop::InstanceProcessM569Point1(CanMessageGenericParser& parse
 	const bool seenE = parser.GetFloatArrayParam('E', numThresholds, tempErrorThresholds);
 	const bool seenS = parser.GetUintParam('S', tempStepsPerRev);
 	const bool seenQ = parser.GetFloatParam('Q', tempTorquePerAmp);
+	const bool seenF = parser.GetFloatParam('F', tempObserverMemoryFactor);
+	const bool seenL = parser.GetFloatParam('L', tempLookAhead);
+	const bool seenH = parser.GetFloatArrayParam('H', numScheduleSpeeds, tempScheduleSpeeds);
+	const bool seenJ = parser.GetFloatArrayParam('J', numScheduleKpFactors, tempScheduleKpFactors);
+	const bool seenK = parser.GetFloatArrayParam('K', numScheduleKdFactors, tempScheduleKdFactors);
+	const bool seenU = parser.GetFloatParam('U', tempAccelerationGainFactor);
+	const bool seenN = parser.GetFloatArrayParam('N', numNotchValues, tempNotchValues);
+	const bool seenW = parser.GetFloatArrayParam('W', numLowPassValues, tempLowPassValues);
+	const bool seenB = parser.GetFloatArrayParam('B', numThermalValues, tempThermalValues);
 
 	// Report back if no parameters to change
-	if (!(seenT || seenC || seenPid || seenE || seenQ))
+	if (!(seenT || seenC || seenPid || seenE || seenQ || seenF || seenL || seenH || seenJ || seenK || seenU || seenN || seenW || seenB))
 	{
 		if (encoder == nullptr)
 		{
@@ -247,7 +298,51 @@ GCodeResult ClosedLoop::InstanceProcessM569Point1(CanMessageGenericParser& parse
 			encoder->AppendStatus(reply);
 			reply.lcatf("PID parameters P=%.1f I=%.3f D=%.3f V=%.1f A=%.1f, torque constant %.2fNm/A",
 						(double)Kp, (double)Ki, (double)Kd, (double)Kv, (double)Ka, (double)torquePerAmp);
-			reply.lcatf("Warning/error threshold %.2f/%.2f", (double)errorThresholds[0], (double)errorThresholds[1]);
+			reply.lcatf("Warning/error threshold %.2f/%.2f, detection time %.1fms",
+						(double)errorThresholds[0], (double)errorThresholds[1], (double)(stallDetectionTime * 1000.0));
+			if (useObserver)
+			{
+				reply.lcatf("Speed estimation by observer with memory factor %.3f", (double)positionObserver.GetMemoryFactor());
+			}
+			else
+			{
+				reply.lcat("Speed estimation by averaging filter");
+			}
+			if (usePeriodSpeed)
+			{
+				reply.cat(", period measurement at low speed");
+			}
+			if (feedForwardLookAhead >= 0.0)
+			{
+				reply.lcatf("Feedforward look-ahead %.2fms plus control latency", (double)(feedForwardLookAhead * StepTimer::StepClocksToMillis));
+			}
+			if (numGainSchedulePoints != 0)
+			{
+				reply.lcat("Gain schedule speed/P factor/D factor");
+				for (size_t i = 0; i < numGainSchedulePoints; ++i)
+				{
+					reply.catf(" %.1f/%.2f/%.2f", (double)gainScheduleSpeeds[i], (double)gainScheduleKpFactors[i], (double)gainScheduleKdFactors[i]);
+				}
+			}
+			if (accelerationGainFactor != 1.0)
+			{
+				reply.lcatf("P and D factor when accelerating %.2f", (double)accelerationGainFactor);
+			}
+			if (numControlSignalFilters != 0)
+			{
+				reply.lcat("Control signal filters:");
+				for (size_t i = 0; i < numControlSignalFilters; ++i)
+				{
+					const BiquadFilter& f = controlSignalFilters[i];
+					reply.catf(" %s %.1fHz Q=%.2f", (f.GetType() == BiquadFilter::Type::notch) ? "notch" : "low-pass", (double)f.GetFrequency(), (double)f.GetQ());
+				}
+				reply.catf(", loop frequency %.0fHz", (double)controlSignalFilterSampleRate);
+			}
+			if (thermalLimitingEnabled)
+			{
+				reply.lcatf("Thermal limiting: continuous motor current %.0f%%, time constant %.0fs",
+							(double)(motorThermalModel.GetContinuousCurrentFraction() * 100.0), (double)motorThermalTimeConstant);
+			}
 		}
 		return GCodeResult::ok;
 	}
@@ -270,7 +365,7 @@ GCodeResult ClosedLoop::InstanceProcessM569Point1(CanMessageGenericParser& parse
 		reply.copy("Invalid T value. Valid values are 2 and 3");
 		return GCodeResult::error;
 	}
-	if (seenE && (tempErrorThresholds[0] < 0 || tempErrorThresholds[1] < 0))
+	if (seenE && (numThresholds < 2 || tempErrorThresholds[0] < 0 || tempErrorThresholds[1] < 0 || (numThresholds == 3 && tempErrorThresholds[2] < 0)))
 	{
 		reply.copy("Error threshold value must nor be less than zero");
 		return GCodeResult::error;
@@ -285,6 +380,128 @@ GCodeResult ClosedLoop::InstanceProcessM569Point1(CanMessageGenericParser& parse
 		reply.copy("Torque per amp must be positive");
 		return GCodeResult::error;
 	}
+	if (seenF && (tempObserverMemoryFactor < 0.0 || tempObserverMemoryFactor >= 1.0))
+	{
+		reply.copy("Observer memory factor must be at least 0 and less than 1");
+		return GCodeResult::error;
+	}
+
+	// H0 on its own disables gain scheduling. Otherwise J and K must have one value for each speed in H, or be omitted to leave that gain unchanged.
+	const bool clearSchedule = seenH && numScheduleSpeeds == 1 && tempScheduleSpeeds[0] <= 0.0;
+	if ((seenJ || seenK) && !seenH)
+	{
+		reply.copy("M569.1 J and K parameters not permitted without H parameter");
+		return GCodeResult::error;
+	}
+	if (seenH && !clearSchedule)
+	{
+		if ((seenJ && numScheduleKpFactors != numScheduleSpeeds) || (seenK && numScheduleKdFactors != numScheduleSpeeds))
+		{
+			reply.copy("H, J and K parameters must have the same number of values");
+			return GCodeResult::error;
+		}
+		for (size_t i = 0; i < numScheduleSpeeds; ++i)
+		{
+			if (tempScheduleSpeeds[i] < 0.0 || (i != 0 && tempScheduleSpeeds[i] <= tempScheduleSpeeds[i - 1]))
+			{
+				reply.copy("Gain schedule speeds must be in increasing order and not negative");
+				return GCodeResult::error;
+			}
+			if (!seenJ) { tempScheduleKpFactors[i] = 1.0; }
+			if (!seenK) { tempScheduleKdFactors[i] = 1.0; }
+			if (tempScheduleKpFactors[i] < 0.0 || tempScheduleKdFactors[i] < 0.0)
+			{
+				reply.copy("Gain schedule factors must not be negative");
+				return GCodeResult::error;
+			}
+		}
+	}
+	if (seenU && tempAccelerationGainFactor < 0.0)
+	{
+		reply.copy("Acceleration gain factor must not be negative");
+		return GCodeResult::error;
+	}
+
+	// N is a list of notch frequency:Q pairs, W is the low-pass cutoff frequency optionally followed by Q. N0 and W0 remove the filters.
+	const bool clearNotches = seenN && numNotchValues == 1 && tempNotchValues[0] <= 0.0;
+	const bool clearLowPass = seenW && tempLowPassValues[0] <= 0.0;
+	if (seenN && !clearNotches && (numNotchValues & 1) != 0)
+	{
+		reply.copy("N parameter must be pairs of frequency and Q");
+		return GCodeResult::error;
+	}
+	if (seenW && numLowPassValues == 1)
+	{
+		tempLowPassValues[1] = DefaultLowPassFilterQ;
+	}
+	BiquadFilter newFilters[MaxControlSignalFilters];
+	size_t numNewFilters = 0;
+	float sampleRate = controlSignalFilterSampleRate;
+	if (seenN || seenW)
+	{
+		if (averageCallInterval <= 0.0)
+		{
+			reply.copy("Control loop frequency not known yet");
+			return GCodeResult::error;
+		}
+		sampleRate = (float)StepTimer::StepClockRate/averageCallInterval;
+
+		// Recalculate all the filters because the control loop frequency may have changed
+		for (size_t i = 0; i < numControlSignalFilters; ++i)
+		{
+			const BiquadFilter& f = controlSignalFilters[i];
+			if ((f.GetType() == BiquadFilter::Type::notch) ? !seenN : !seenW)
+			{
+				newFilters[numNewFilters++].Configure(f.GetType(), f.GetFrequency(), f.GetQ(), sampleRate);
+			}
+		}
+		if (seenN && !clearNotches)
+		{
+			for (size_t i = 0; i < numNotchValues; i += 2)
+			{
+				if (!newFilters[numNewFilters++].Configure(BiquadFilter::Type::notch, tempNotchValues[i], tempNotchValues[i + 1], sampleRate))
+				{
+					reply.printf("Notch frequency must be positive and below %.0fHz, and Q must be positive", (double)(0.5 * sampleRate));
+					return GCodeResult::error;
+				}
+			}
+		}
+		if (seenW && !clearLowPass)
+		{
+			if (!newFilters[numNewFilters++].Configure(BiquadFilter::Type::lowPass, tempLowPassValues[0], tempLowPassValues[1], sampleRate))
+			{
+				reply.printf("Low-pass frequency must be below %.0fHz and Q must be positive", (double)(0.5 * sampleRate));
+				return GCodeResult::error;
+			}
+		}
+
+		// Keep the notch filters ahead of the low-pass filter
+		if (numNewFilters > 1 && newFilters[0].GetType() == BiquadFilter::Type::lowPass)
+		{
+			const BiquadFilter lowPass = newFilters[0];
+			for (size_t i = 1; i < numNewFilters; ++i)
+			{
+				newFilters[i - 1] = newFilters[i];
+			}
+			newFilters[numNewFilters - 1] = lowPass;
+		}
+	}
+
+	// B is the continuous motor current as a percentage of the configured current, optionally followed by the motor thermal time constant in seconds.
+	// B0 or B100 disables thermal limiting.
+	const bool disableThermalLimiting = seenB && (tempThermalValues[0] <= 0.0 || tempThermalValues[0] >= 100.0);
+	if (seenB && !disableThermalLimiting)
+	{
+		if (numThermalValues == 1)
+		{
+			tempThermalValues[1] = motorThermalTimeConstant;
+		}
+		else if (tempThermalValues[1] <= 0.0)
+		{
+			reply.copy("Motor thermal time constant must be positive");
+			return GCodeResult::error;
+		}
+	}
 
 	// Set the new params
 	TaskCriticalSectionLocker lock;			// don't allow the closed loop task to see an inconsistent combination of these values
@@ -297,14 +514,49 @@ GCodeResult ClosedLoop::InstanceProcessM569Point1(CanMessageGenericParser& parse
 		Kv = tempKv;
 		Ka = tempKa;
 		PIDITerm = 0.0;
-		errorDerivativeFilter.Reset();
-		speedFilter.Reset();
+		ResetDerivativeEstimators();
+	}
+
+	if (seenH)
+	{
+		numGainSchedulePoints = (clearSchedule) ? 0 : numScheduleSpeeds;
+		for (size_t i = 0; i < numGainSchedulePoints; ++i)
+		{
+			gainScheduleSpeeds[i] = tempScheduleSpeeds[i];
+			gainScheduleKpFactors[i] = tempScheduleKpFactors[i];
+			gainScheduleKdFactors[i] = tempScheduleKdFactors[i];
+		}
+	}
+
+	if (seenU)
+	{
+		accelerationGainFactor = tempAccelerationGainFactor;
+	}
+
+	if (seenPid || seenH)
+	{
+		BuildGainScheduleTable();
+	}
+
+	if (seenN || seenW)
+	{
+		for (size_t i = 0; i < numNewFilters; ++i)
+		{
+			controlSignalFilters[i] = newFilters[i];
+		}
+		numControlSignalFilters = numNewFilters;
+		controlSignalFilterSampleRate = sampleRate;
 	}
 
 	if (seenE)
 	{
 		errorThresholds[0] = tempErrorThresholds[0];
 		errorThresholds[1] = tempErrorThresholds[1];
+		if (numThresholds == 3)
+		{
+			stallDetectionTime = tempErrorThresholds[2] * MillisToSeconds;			// the optional third value is the detection time in milliseconds
+		}
+		stallEnergy = preStallEnergy = 0.0;
 	}
 
 	if (seenQ)
@@ -312,10 +564,48 @@ GCodeResult ClosedLoop::InstanceProcessM569Point1(CanMessageGenericParser& parse
 		torquePerAmp = tempTorquePerAmp;
 	}
 
+	if (seenB)
+	{
+		if (disableThermalLimiting)
+		{
+			thermalLimitingEnabled = false;
+		}
+		else
+		{
+			motorThermalTimeConstant = tempThermalValues[1];
+			motorThermalModel.Configure(motorThermalTimeConstant, tempThermalValues[0] * 0.01);
+			if (!thermalLimitingEnabled)
+			{
+				motorThermalModel.Reset();
+				driverThermalModel.Reset();
+				thermalLimitingEnabled = true;
+			}
+		}
+		thermalCurrentLimit = minThermalCurrentLimit = 1.0;
+	}
+
+	if (seenL)
+	{
+		// L is in milliseconds. A negative value disables look-ahead.
+		feedForwardLookAhead = (tempLookAhead < 0.0) ? -1.0 : tempLookAhead * (float)StepTimer::StepClockRate * MillisToSeconds;
+	}
+
+	if (seenF)
+	{
+		// F0 selects the derivative averaging filters, any other value selects the observer with that memory factor
+		useObserver = (tempObserverMemoryFactor > 0.0);
+		if (useObserver)
+		{
+			positionObserver.SetMemoryFactor(tempObserverMemoryFactor);
+		}
+		ResetDerivativeEstimators();
+	}
+
 	if (seenT)
 	{
 		SetClosedLoopEnabled(ClosedLoopMode::open, reply);
 		DeleteObject(encoder);
+		sensorlessEstimator.Reset();
 
 		switch (tempEncoderType)
 		{
@@ -344,6 +634,10 @@ GCodeResult ClosedLoop::InstanceProcessM569Point1(CanMessageGenericParser& parse
 			break;
 		}
 
+		// Relative encoders give few counts per control loop iteration at low speed, so measure the time between counts too
+		usePeriodSpeed = (encoder != nullptr && encoder->GetType() == EncoderType::rotaryQuadrature);
+		periodSpeedEstimator.Reset();
+
 		if (encoder != nullptr)
 		{
 			tuningError = encoder->MinimalTuningNeeded();
@@ -351,6 +645,7 @@ GCodeResult ClosedLoop::InstanceProcessM569Point1(CanMessageGenericParser& parse
 			if (rslt == GCodeResult::ok)
 			{
 				encoder->LoadLUT(tuningError);
+				LoadCoggingTable();
 			}
 			return rslt;
 		}
@@ -445,6 +740,13 @@ GCodeResult ClosedLoop::InstanceProcessM569Point5(const CanMessageStartClosedLoo
 
 	if (CollectingData())
 	{
+		// A request for zero samples stops continuous data collection
+		if (samplingMode == RecordingMode::Continuous && msg.numSamples == 0)
+		{
+			samplingMode = RecordingMode::SendingData;
+			dataTransmissionTask->Give(NotifyIndices::ClosedLoopDataTransmission);
+			return GCodeResult::ok;
+		}
 		reply.copy("Driver is already collecting data");
 		return GCodeResult::error;
 	}
@@ -454,6 +756,10 @@ GCodeResult ClosedLoop::InstanceProcessM569Point5(const CanMessageStartClosedLoo
 	{
 		requestedMode = (uint8_t)RecordingMode::OnNextMove;		// when recording a tuning move we ignore the mode and start 5ms before it
 	}
+	else if (msg.mode == 2)
+	{
+		requestedMode = (uint8_t)RecordingMode::Continuous;		// A2 collects data until a request for zero samples is received
+	}
 	else
 	{
 		requestedMode = msg.mode + 1;							// the A parameter is out of step with the enumeration by 1
@@ -470,17 +776,36 @@ GCodeResult ClosedLoop::InstanceProcessM569Point5(const CanMessageStartClosedLoo
 		return GCodeResult::error;
 	}
 
+	if ((msg.filter & CL_RECORD_COMPRESSED) && MaxCompressedSampleLength(msg.filter) > sizeof(CanMessageClosedLoopData::data))
+	{
+		reply.copy("Too many variables selected for compressed recording");
+		return GCodeResult::error;
+	}
+
 	{
 		TaskCriticalSectionLocker lock;
 
 		// Set up the recording vars
 		filterRequested = msg.filter;
-		sampleBuffer.Init(ClosedLoopSampleLength(filterRequested));
+		if (filterRequested & CL_RECORD_COMPRESSED)
+		{
+			sampleBuffer.InitCompressed(MinCompressedSampleLength(filterRequested), MaxCompressedSampleLength(filterRequested));
+		}
+		else
+		{
+			sampleBuffer.Init(ClosedLoopSampleLength(filterRequested));
+		}
 		sampleBufferOverflowed = false;
 		samplesRequested = msg.numSamples;
 		samplesCollected = samplesSent = 0;
+		totalSamplesCollected = totalDroppedSamples = 0;
+		sampleGapsWritten = sampleGapsRead = 0;
+		pendingDroppedSamples = 0;
+		streamingWindowSumOfErrorSquares = streamingWindowMaxCurrentFraction = 0.0;
+		streamingWindowNumSamples = streamingNumWindows = 0;
+		lastWindowRmsError = lastWindowMaxCurrentFraction = worstWindowRmsError = worstWindowMaxCurrentFraction = 0.0;
 		dataCollectionIntervalTicks = (msg.rate == 0) ? 1 : StepTimer::StepClockRate/msg.rate;
-		dataCollectionStartTicks = whenNextSampleDue = StepTimer::GetTimerTicks();
+		dataCollectionStartTicks = whenNextSampleDue = whenLastSampleTaken = streamingWindowStartTicks = StepTimer::GetTimerTicks();
 		samplingMode = (RecordingMode)requestedMode;				// do this one last, it triggers data collection
 
 		StartTuning(msg.movement);
@@ -523,7 +848,9 @@ GCodeResult ClosedLoop::InstanceProcessM569Point6(CanMessageGenericParser& parse
 		}
 
 		// If we were checking the calibration, report the result
-		return (basicTuningDataReady) ? ProcessBasicTuningResult(reply) : ProcessCalibrationResult(reply);
+		return (basicTuningDataReady) ? ProcessBasicTuningResult(reply)
+				: (coggingCalibrationState != CoggingCalibrationState::notReady) ? ProcessCoggingCalibrationResult(reply)
+					: ProcessCalibrationResult(reply);
 	}
 
 	switch (desiredTuning)
@@ -543,6 +870,7 @@ GCodeResult ClosedLoop::InstanceProcessM569Point6(CanMessageGenericParser& parse
 	case 2:
 	case 3:
 	case 4:
+	case 7:
 		if (!encoder->UsesCalibration())
 		{
 			reply.copy("calibration is not applicable to the configured encoder type");
@@ -558,6 +886,25 @@ GCodeResult ClosedLoop::InstanceProcessM569Point6(CanMessageGenericParser& parse
 		}
 		break;
 
+	case 5:
+	case 6:
+		if (desiredTuning == 6)
+		{
+			// Tuning move 6 just clears the cogging table
+			coggingCompensationEnabled = false;
+			NonVolatileMemory mem(NvmPage::closedLoop);
+			mem.SetClosedLoopCoggingTableNotValid();
+			mem.EnsureWritten();
+			reply.copy("Cogging compensation cleared");
+			return GCodeResult::ok;
+		}
+		if (currentMode != ClosedLoopMode::closed || tuningError != 0)
+		{
+			reply.copy("cogging calibration requires the driver to be tuned and in closed loop mode");
+			return GCodeResult::error;
+		}
+		break;
+
 	case 64:
 		break;
 	}
@@ -597,6 +944,10 @@ void ClosedLoop::UpdateStandstillCurrent() noexcept
 {
 #if SINGLE_DRIVER
 	holdCurrentFraction = SmartDrivers::GetStandstillCurrentPercent(0) * 0.01;
+
+	// The driver's thermal budget depends on how the configured current compares with the current it can sustain
+	const float configuredCurrent = SmartDrivers::GetCurrent(0);
+	driverThermalModel.Configure(DriverThermalTimeConstant, (configuredCurrent > 0.0) ? DriverContinuousCurrent/configuredCurrent : 1.0);
 #else
 # error Multi driver code not implemented
 #endif
@@ -627,8 +978,7 @@ GCodeResult ClosedLoop::ProcessBasicTuningResult(const StringRef& reply) noexcep
 	}
 
 	PIDITerm = 0.0;
-	errorDerivativeFilter.Reset();
-	speedFilter.Reset();
+	ResetDerivativeEstimators();
 	SetTargetToCurrentPosition();
 	tuningError &= ~TuningError::TuningOrCalibrationInProgress;
 
@@ -720,8 +1070,7 @@ GCodeResult ClosedLoop::ProcessCalibrationResult(const StringRef& reply) noexcep
 	}
 
 	PIDITerm = 0.0;
-	errorDerivativeFilter.Reset();
-	speedFilter.Reset();
+	ResetDerivativeEstimators();
 	SetTargetToCurrentPosition();
 
 	const float hyst = encoder->GetMeasuredHysteresis();
@@ -762,11 +1111,13 @@ void ClosedLoop::StartTuning(uint8_t tuningMode) noexcept
 	if (tuningMode != 0)
 	{
 		whenLastTuningStepTaken = StepTimer::GetTimerTicks() + stepTicksBeforeTuning;	// delay the start to allow brake release and motor current buildup
+		calibrationPasses = (tuningMode == 7) ? MultiPassCalibrationPasses : 1;
 		tuning = (tuningMode == 1) ? BASIC_TUNING_MANOEUVRE
-					: (tuningMode == 2) ? ENCODER_CALIBRATION_MANOEUVRE
+					: (tuningMode == 2 || tuningMode == 7) ? ENCODER_CALIBRATION_MANOEUVRE
 						: (tuningMode == 3) ? ENCODER_CALIBRATION_CHECK
-							: (tuningMode == 64) ? STEP_MANOEUVRE
-								: 0;
+							: (tuningMode == 5) ? COGGING_CALIBRATION_MANOEUVRE
+								: (tuningMode == 64) ? STEP_MANOEUVRE
+									: 0;
 	}
 }
 
@@ -789,6 +1140,94 @@ void ClosedLoop::ReadyToCalibrate(bool store) noexcept
 	}
 }
 
+// Call this when the cogging calibration manoeuvre has finished collecting data
+void ClosedLoop::FinishedCoggingCalibration(bool succeeded) noexcept
+{
+	coggingCalibrationState = (succeeded) ? CoggingCalibrationState::dataReady : CoggingCalibrationState::failed;
+}
+
+// This is called when the cogging calibration manoeuvre has finished. We build the table from the data collected and save it to NVM.
+// Averaging the forward and reverse passes cancels out friction, and subtracting the mean cancels out any constant load such as gravity.
+GCodeResult ClosedLoop::ProcessCoggingCalibrationResult(const StringRef& reply) noexcept
+{
+	reply.printf("Driver %u.0 cogging calibration ", CanInterface::GetCanAddress());
+	if (coggingCalibrationState != CoggingCalibrationState::dataReady)
+	{
+		coggingCalibrationState = CoggingCalibrationState::notReady;
+		LoadCoggingTable();
+		reply.cat("failed, the position error was too high");
+		return GCodeResult::error;
+	}
+	coggingCalibrationState = CoggingCalibrationState::notReady;
+
+	float newTable[CoggingTableSize];
+	float sumOfValues = 0.0, sumOfFrictions = 0.0;
+	for (size_t i = 0; i < CoggingTableSize; ++i)
+	{
+		if (coggingCounts[0][i] == 0 || coggingCounts[1][i] == 0)
+		{
+			LoadCoggingTable();
+			reply.cat("failed, the motor did not cover a complete electrical cycle");
+			return GCodeResult::error;
+		}
+		const float forwards = coggingSums[0][i]/(float)coggingCounts[0][i];
+		const float backwards = coggingSums[1][i]/(float)coggingCounts[1][i];
+		newTable[i] = (forwards + backwards) * 0.5;
+		sumOfValues += newTable[i];
+		sumOfFrictions += (forwards - backwards) * 0.5;
+	}
+
+	const float mean = sumOfValues/(float)CoggingTableSize;
+	const float maxNvmValue = 127.0/CoggingNvmScaling;
+	int8_t nvmTable[CoggingTableSize];
+	float minValue = 0.0, maxValue = 0.0;
+	for (size_t i = 0; i < CoggingTableSize; ++i)
+	{
+		const float val = constrain<float>(newTable[i] - mean, -maxNvmValue, maxNvmValue);
+		nvmTable[i] = (int8_t)lrintf(val * CoggingNvmScaling);
+		minValue = min<float>(minValue, val);
+		maxValue = max<float>(maxValue, val);
+	}
+
+	NonVolatileMemory mem(NvmPage::closedLoop);
+	mem.SetClosedLoopCoggingTable(nvmTable);
+	mem.EnsureWritten();
+	LoadCoggingTable();
+
+	PIDITerm = 0.0;
+	SetTargetToCurrentPosition();
+	reply.catf("succeeded, peak-to-peak compensation %.1f%% of current, friction %.1f%% of current",
+				(double)((maxValue - minValue) * (100.0/256.0)), (double)(sumOfFrictions * (100.0/256.0)/(float)CoggingTableSize));
+	return GCodeResult::ok;
+}
+
+// Load the cogging table from NVM and enable cogging compensation if it is valid
+void ClosedLoop::LoadCoggingTable() noexcept
+{
+	NonVolatileMemory mem(NvmPage::closedLoop);
+	const int8_t *const nvmTable = mem.GetClosedLoopCoggingTable();
+	if (nvmTable != nullptr)
+	{
+		for (size_t i = 0; i < CoggingTableSize; ++i)
+		{
+			coggingTable[i] = (float)nvmTable[i] * (1.0/CoggingNvmScaling);
+		}
+	}
+	coggingCompensationEnabled = (nvmTable != nullptr);
+}
+
+// Get the cogging compensation for the specified phase position, interpolating linearly between table entries.
+// Each table entry is the average over its range of phases, so we treat it as applying to the centre of that range.
+float ClosedLoop::GetCoggingCompensation(uint32_t phase) const noexcept
+{
+	const uint32_t adjustedPhase = (phase + 4096u - CoggingPhasesPerEntry/2) % 4096u;
+	const size_t index = adjustedPhase/CoggingPhasesPerEntry;
+	const float fraction = (float)(adjustedPhase % CoggingPhasesPerEntry) * (1.0/(float)CoggingPhasesPerEntry);
+	const float lower = coggingTable[index];
+	const float upper = coggingTable[(index + 1) % CoggingTableSize];
+	return lower + (upper - lower) * fraction;
+}
+
 // This is called by tuning to execute a step
 void ClosedLoop::AdjustTargetMotorSteps(float amount) noexcept
 {
@@ -806,10 +1245,12 @@ void ClosedLoop::InstanceControlLoop() noexcept
 	maxControlLoopCallInterval = max<StepTimer::Ticks>(maxControlLoopCallInterval, timeElapsed);
 
 	// Read the current state of the drive. Do this even if we are not in closed loop mode.
-	if (encoder != nullptr && !encoder->TakeReading())
+	if (encoder != nullptr && !TakeEncoderReading())
 	{
 		// Calculate and store the current error in full steps
+		uint32_t stageStartCycles = DWT->CYCCNT;
 		hasMovementCommand = moveInstance->GetCurrentMotion(0, loopCallTime, currentMode != ClosedLoopMode::open, mParams);
+		uint32_t motionCycles = DWT->CYCCNT - stageStartCycles;
 		if (hasMovementCommand)
 		{
 			if (inTorqueMode)
@@ -823,16 +1264,52 @@ void ClosedLoop::InstanceControlLoop() noexcept
 			}
 		}
 
+		// Get the speed and acceleration for the feedforward terms. If look-ahead is enabled, sample the trajectory at the time when the currents we are about to set will be taking effect.
+		feedForwardParams = mParams;
+		if (hasMovementCommand && feedForwardLookAhead >= 0.0)
+		{
+			stageStartCycles = DWT->CYCCNT;
+			(void)moveInstance->GetFutureSpeedAndAcceleration(0, loopCallTime + (StepTimer::Ticks)lrintf(averageControlLatency + feedForwardLookAhead), feedForwardParams);
+			motionCycles += DWT->CYCCNT - stageStartCycles;
+		}
+
 		const float targetEncoderReading = rintf(mParams.position * encoder->GetCountsPerStep());
 		currentPositionError = (float)(targetEncoderReading - encoder->GetCurrentCount()) * encoder->GetStepsPerCount();
-		errorDerivativeFilter.ProcessReading(currentPositionError, loopCallTime);
-		speedFilter.ProcessReading(encoder->GetCurrentCount() * encoder->GetStepsPerCount(), loopCallTime);
+		profiler.Record(LoopProfiler::Stage::motion, motionCycles);
+
+		stageStartCycles = DWT->CYCCNT;
+		if (usingSensorlessEstimate)
+		{
+			// The encoder has recovered. The derivative estimators have a gap in their data so start them again.
+			usingSensorlessEstimate = false;
+			ResetDerivativeEstimators();
+		}
+		sensorlessEstimator.ProcessReading(mParams.position, encoder->GetCurrentCount() * encoder->GetStepsPerCount(), encoder->GetCurrentPhasePosition(), timeElapsed);
+		if (useObserver)
+		{
+			positionObserver.ProcessReading(encoder->GetCurrentCount() * encoder->GetStepsPerCount(), loopCallTime);
+		}
+		else
+		{
+			errorDerivativeFilter.ProcessReading(currentPositionError, loopCallTime);
+			speedFilter.ProcessReading(encoder->GetCurrentCount() * encoder->GetStepsPerCount(), loopCallTime);
+		}
+		if (usePeriodSpeed)
+		{
+			periodSpeedEstimator.ProcessReading(encoder->GetCurrentCount(), loopCallTime);
+		}
+		profiler.Record(LoopProfiler::Stage::estimation, DWT->CYCCNT - stageStartCycles);
 
 		float currentFraction = 0.0;
 		if (currentMode != ClosedLoopMode::open)
 		{
 			if (tuning != 0)														// if we need to tune, do it
 			{
+				if (tuning & COGGING_CALIBRATION_MANOEUVRE)
+				{
+					currentFraction = ControlMotorCurrents(timeElapsed);			// this manoeuvre runs under closed loop control
+				}
+
 				// Limit the rate at which we command tuning steps. We need to do signed comparison because initially, whenLastTuningStepTaken is in the future.
 				const int32_t timeSinceLastTuningStep = (int32_t)(loopCallTime - whenLastTuningStepTaken);
 				if (timeSinceLastTuningStep >= (int32_t)stepTicksPerTuningStep)
@@ -852,41 +1329,22 @@ void ClosedLoop::InstanceControlLoop() noexcept
 				if (inTorqueMode)
 				{
 					stall = preStall = false;
+					stallEnergy = preStallEnergy = 0.0;
 				}
 				else
 				{
-					// Look for a stall or pre-stall
-					const float positionErr = fabsf(currentPositionError);
-					if (stall)
-					{
-						// Reset the stall flag when the position error falls to below half the tolerance, to avoid generating too many stall events
-						//TODO do we need a minimum delay before resetting too?
-						if (errorThresholds[1] <= 0 || positionErr < errorThresholds[1]/2)
-						{
-							stall = false;
-						}
-					}
-					else
-					{
-						stall = errorThresholds[1] > 0 && positionErr > errorThresholds[1];
-						if (stall)
-						{
-							Platform::NewDriverFault();
-						}
-						else
-						{
-							preStall = errorThresholds[0] > 0 && positionErr > errorThresholds[0];
-						}
-					}
+					UpdateStallDetection(currentFraction, timeElapsed, loopCallTime);
 				}
 			}
 		}
 
 		// Collect a sample, if we need to
-		if (samplingMode == RecordingMode::Immediate && (int32_t)(loopCallTime - whenNextSampleDue) >= 0)
+		if (TakingSamples() && (int32_t)(loopCallTime - whenNextSampleDue) >= 0)
 		{
 			// It's time to take a sample
+			const uint32_t sampleStartCycles = DWT->CYCCNT;
 			CollectSample();
+			profiler.Record(LoopProfiler::Stage::sampling, DWT->CYCCNT - sampleStartCycles);
 			whenNextSampleDue += dataCollectionIntervalTicks;
 		}
 
@@ -906,12 +1364,32 @@ void ClosedLoop::InstanceControlLoop() noexcept
 		periodSumOfCurrentFractions += currentFraction;
 		++periodNumSamples;
 
+		if (samplingMode == RecordingMode::Continuous)
+		{
+			UpdateStreamingStatistics(currentPositionError, currentFraction, loopCallTime);
+		}
+	}
+	else if (encoder != nullptr)
+	{
+		++numEncoderErrors;
+		if (currentMode != ClosedLoopMode::open && tuning == 0 && tuningError == 0 && sensorlessEstimator.IsValid())
+		{
+			ControlSensorless(loopCallTime, timeElapsed);
+		}
 	}
 
 	// Record how long this has taken to run
 	const StepTimer::Ticks loopRuntime = StepTimer::GetTimerTicks() - loopCallTime;
 	minControlLoopRuntime = min<StepTimer::Ticks>(minControlLoopRuntime, loopRuntime);
 	maxControlLoopRuntime = max<StepTimer::Ticks>(maxControlLoopRuntime, loopRuntime);
+
+	// The currents we set are held until the next iteration, so on average they take effect half a call interval after we finish.
+	// Ignore long intervals, e.g. the first one after switching to closed loop mode.
+	if (timeElapsed < MaxLatencyCallInterval)
+	{
+		averageControlLatency += ((float)loopRuntime + 0.5 * (float)timeElapsed - averageControlLatency) * (1.0/16.0);
+		averageCallInterval += ((float)timeElapsed - averageCallInterval) * (1.0/16.0);
+	}
 }
 
 // Send data from the buffer to the main board over CAN
@@ -920,10 +1398,11 @@ void ClosedLoop::InstanceControlLoop() noexcept
 	while (true)
 	{
 		const RecordingMode locMode = samplingMode;										// to capture the volatile variable
-		if (locMode == RecordingMode::Immediate || locMode == RecordingMode::SendingData)
+		if (locMode == RecordingMode::Immediate || locMode == RecordingMode::SendingData || locMode == RecordingMode::Continuous)
 		{
 			// Started a new data collection
 			samplesSent = 0;
+			uint16_t sequenceNumber = 0;												// differs from samplesSent if samples were dropped during continuous collection
 
 			// Loop until everything has been read. Stop when either we have sent the requested number of samples, or the state is SendingData and we have sent all the data in the buffer.
 			// Note, this may mean that the last packet contains no data and has the "last" flag set.
@@ -935,31 +1414,52 @@ void ClosedLoop::InstanceControlLoop() noexcept
 				CanMessageClosedLoopData& msg = *(buf.SetupStatusMessage<CanMessageClosedLoopData>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress()));
 
 				// Populate the control fields
-				msg.firstSampleNumber = samplesSent;
+				msg.firstSampleNumber = sequenceNumber;
 				msg.filter = filterRequested;
 				msg.zero = msg.zero2 = 0;
 
 				unsigned int numSamplesInMessage = 0;
 				size_t dataIndex = 0;
+				bool followsGap = false;
 				do
 				{
-					while (samplesSent == samplesCollected && samplingMode == RecordingMode::Immediate)
+					while (samplesSent == samplesCollected && TakingSamples())
 					{
 						TaskBase::TakeIndexed(NotifyIndices::ClosedLoopDataTransmission);			// wait for data to be available
 					}
 
-					if (samplesSent < samplesCollected)
+					if (samplesSent != samplesCollected)
 					{
+						// If samples were dropped before this one then it must start a new message, so that the main board can tell from the sample numbers which ones are missing
+						if (sampleGapsRead != sampleGapsWritten && sampleGaps[sampleGapsRead & (MaxSampleGaps - 1)].samplesBefore == samplesSent)
+						{
+							if (numSamplesInMessage != 0)
+							{
+								finished = false;
+								break;
+							}
+							sequenceNumber += sampleGaps[sampleGapsRead & (MaxSampleGaps - 1)].numDropped;
+							++sampleGapsRead;
+							msg.firstSampleNumber = sequenceNumber;
+							followsGap = true;
+						}
+
+						if (dataIndex + sampleBuffer.GetNextSampleLength() > ARRAY_SIZE(msg.data))
+						{
+							finished = false;						// compressed samples vary in length and this one doesn't fit, so send it in the next message
+							break;
+						}
 						dataIndex += sampleBuffer.GetSample(msg.data + dataIndex);
 						++samplesSent;								// update this one first to avoid a race condition
+						++sequenceNumber;
 						++numSamplesInMessage;
 					}
-					finished = (samplingMode != RecordingMode::Immediate && samplesSent == samplesCollected);
+					finished = (!TakingSamples() && samplesSent == samplesCollected);
 				} while (!finished && dataIndex + sampleBuffer.GetBytesPerSample() <= ARRAY_SIZE(msg.data));
 
 				msg.numSamples = numSamplesInMessage;
 				msg.lastPacket = finished;
-				msg.overflowed = sampleBufferOverflowed;
+				msg.overflowed = sampleBufferOverflowed || followsGap;
 				msg.badSample = sampleBuffer.HadBadSample();
 
 				// Send the CAN message
@@ -978,34 +1478,43 @@ void ClosedLoop::InstanceControlLoop() noexcept
 // Store a sample in the buffer
 void ClosedLoop::CollectSample() noexcept
 {
-	if (sampleBuffer.IsFull())
+	// After dropping samples in continuous mode, we can only store another one when there is room to record the gap
+	if (sampleBuffer.IsFull() || (pendingDroppedSamples != 0 && (uint8_t)(sampleGapsWritten - sampleGapsRead) == MaxSampleGaps))
 	{
-		sampleBufferOverflowed = true;							// the buffer is full so tell the sending task about it
-		samplingMode = RecordingMode::SendingData;				// stop collecting data
+		if (samplingMode == RecordingMode::Continuous)
+		{
+			++pendingDroppedSamples;							// drop this sample and keep going
+			++totalDroppedSamples;
+		}
+		else
+		{
+			sampleBufferOverflowed = true;						// the buffer is full so tell the sending task about it
+			samplingMode = RecordingMode::SendingData;			// stop collecting data
+		}
 	}
 	else
 	{
-		sampleBuffer.PutF32(TickPeriodToMillis(StepTimer::GetTimerTicks() - dataCollectionStartTicks));		// always collect this
-
-		if (filterRequested & CL_RECORD_RAW_ENCODER_READING) 	{ sampleBuffer.PutI32(encoder->GetCurrentCount()); }
-		if (filterRequested & CL_RECORD_CURRENT_MOTOR_STEPS) 	{ sampleBuffer.PutF32((float)encoder->GetCurrentCount() * encoder->GetStepsPerCount()); }
-		if (filterRequested & CL_RECORD_TARGET_MOTOR_STEPS)  	{ sampleBuffer.PutF32(mParams.position); }
-		if (filterRequested & CL_RECORD_CURRENT_ERROR) 			{ sampleBuffer.PutF32(currentPositionError); }
-		if (filterRequested & CL_RECORD_PID_CONTROL_SIGNAL)  	{ sampleBuffer.PutF16(PIDControlSignal); }
-		if (filterRequested & CL_RECORD_PID_P_TERM)  			{ sampleBuffer.PutF16(PIDPTerm); }
-		if (filterRequested & CL_RECORD_PID_I_TERM)  			{ sampleBuffer.PutF16(PIDITerm); }
-		if (filterRequested & CL_RECORD_PID_D_TERM)  			{ sampleBuffer.PutF16(PIDDTerm); }
-		if (filterRequested & CL_RECORD_PID_V_TERM)  			{ sampleBuffer.PutF16(PIDVTerm); }
-		if (filterRequested & CL_RECORD_PID_A_TERM)  			{ sampleBuffer.PutF16(PIDATerm); }
-		if (filterRequested & CL_RECORD_CURRENT_STEP_PHASE)  	{ sampleBuffer.PutU16(encoder->GetCurrentPhasePosition()); }
-		if (filterRequested & CL_RECORD_DESIRED_STEP_PHASE)  	{ sampleBuffer.PutU16(desiredStepPhase); }
-		if (filterRequested & CL_RECORD_PHASE_SHIFT)  			{ sampleBuffer.PutU16(0); }
-		if (filterRequested & CL_RECORD_COIL_A_CURRENT) 		{ sampleBuffer.PutI16(coilA); }
-		if (filterRequested & CL_RECORD_COIL_B_CURRENT) 		{ sampleBuffer.PutI16(coilB); }
-
-		sampleBuffer.FinishSample();
+		if (pendingDroppedSamples != 0)
+		{
+			SampleGap& gap = sampleGaps[sampleGapsWritten & (MaxSampleGaps - 1)];
+			gap.samplesBefore = samplesCollected;
+			gap.numDropped = pendingDroppedSamples;
+			++sampleGapsWritten;								// the sending task won't look at this until samplesCollected has been incremented
+			pendingDroppedSamples = 0;
+		}
+
+		if (filterRequested & CL_RECORD_COMPRESSED)
+		{
+			StoreCompressedSample();
+		}
+		else
+		{
+			StoreSample();
+		}
+
 		++samplesCollected;
-		if (samplesCollected == samplesRequested)
+		++totalSamplesCollected;
+		if (samplingMode != RecordingMode::Continuous && samplesCollected == samplesRequested)
 		{
 			samplingMode = RecordingMode::SendingData;			// stop collecting data
 		}
@@ -1014,9 +1523,278 @@ void ClosedLoop::CollectSample() noexcept
 	dataTransmissionTask->Give(NotifyIndices::ClosedLoopDataTransmission);
 }
 
+// Store an uncompressed sample in the buffer. There must be room for it.
+void ClosedLoop::StoreSample() noexcept
+{
+	whenLastSampleTaken = StepTimer::GetTimerTicks();
+	sampleBuffer.PutF32(TickPeriodToMillis(whenLastSampleTaken - dataCollectionStartTicks));		// always collect this
+
+	if (filterRequested & CL_RECORD_RAW_ENCODER_READING) 	{ sampleBuffer.PutI32(encoder->GetCurrentCount()); }
+	if (filterRequested & CL_RECORD_CURRENT_MOTOR_STEPS) 	{ sampleBuffer.PutF32((float)encoder->GetCurrentCount() * encoder->GetStepsPerCount()); }
+	if (filterRequested & CL_RECORD_TARGET_MOTOR_STEPS)  	{ sampleBuffer.PutF32(mParams.position); }
+	if (filterRequested & CL_RECORD_CURRENT_ERROR) 			{ sampleBuffer.PutF32(currentPositionError); }
+	if (filterRequested & CL_RECORD_PID_CONTROL_SIGNAL)  	{ sampleBuffer.PutF16(PIDControlSignal); }
+	if (filterRequested & CL_RECORD_PID_P_TERM)  			{ sampleBuffer.PutF16(PIDPTerm); }
+	if (filterRequested & CL_RECORD_PID_I_TERM)  			{ sampleBuffer.PutF16(PIDITerm); }
+	if (filterRequested & CL_RECORD_PID_D_TERM)  			{ sampleBuffer.PutF16(PIDDTerm); }
+	if (filterRequested & CL_RECORD_PID_V_TERM)  			{ sampleBuffer.PutF16(PIDVTerm); }
+	if (filterRequested & CL_RECORD_PID_A_TERM)  			{ sampleBuffer.PutF16(PIDATerm); }
+	if (filterRequested & CL_RECORD_CURRENT_STEP_PHASE)  	{ sampleBuffer.PutU16(encoder->GetCurrentPhasePosition()); }
+	if (filterRequested & CL_RECORD_DESIRED_STEP_PHASE)  	{ sampleBuffer.PutU16(desiredStepPhase); }
+	if (filterRequested & CL_RECORD_PHASE_SHIFT)  			{ sampleBuffer.PutU16(0); }
+	if (filterRequested & CL_RECORD_COIL_A_CURRENT) 		{ sampleBuffer.PutI16(coilA); }
+	if (filterRequested & CL_RECORD_COIL_B_CURRENT) 		{ sampleBuffer.PutI16(coilB); }
+
+	sampleBuffer.FinishSample();
+}
+
+// Store a compressed sample in the buffer. There must be room for it.
+// Each variable is stored as the difference from its value in the previous sample, as a zigzag-encoded varint (see SampleBuffer::PutDelta).
+// The first sample is relative to zero, so the main board must decode the samples in order.
+// The timestamp is in step clocks since data collection started. Positions and errors are in units of 1/1024 full step.
+// Values that are float16 in uncompressed samples are sent as float16 bit patterns, converted from sign-magnitude to two's complement.
+void ClosedLoop::StoreCompressedSample() noexcept
+{
+	whenLastSampleTaken = StepTimer::GetTimerTicks();
+	sampleBuffer.PutDelta((int32_t)(whenLastSampleTaken - dataCollectionStartTicks));
+
+	if (filterRequested & CL_RECORD_RAW_ENCODER_READING) 	{ sampleBuffer.PutDelta(encoder->GetCurrentCount()); }
+	if (filterRequested & CL_RECORD_CURRENT_MOTOR_STEPS) 	{ sampleBuffer.PutDelta((int32_t)llrintf((float)encoder->GetCurrentCount() * encoder->GetStepsPerCount() * CompressedStepsScaling)); }
+	if (filterRequested & CL_RECORD_TARGET_MOTOR_STEPS)  	{ sampleBuffer.PutDelta((int32_t)llrintf(mParams.position * CompressedStepsScaling)); }
+	if (filterRequested & CL_RECORD_CURRENT_ERROR) 			{ sampleBuffer.PutDelta((int32_t)llrintf(currentPositionError * CompressedStepsScaling)); }
+	if (filterRequested & CL_RECORD_PID_CONTROL_SIGNAL)  	{ sampleBuffer.PutDelta(Float16ToOrderedInt(PIDControlSignal)); }
+	if (filterRequested & CL_RECORD_PID_P_TERM)  			{ sampleBuffer.PutDelta(Float16ToOrderedInt(PIDPTerm)); }
+	if (filterRequested & CL_RECORD_PID_I_TERM)  			{ sampleBuffer.PutDelta(Float16ToOrderedInt(PIDITerm)); }
+	if (filterRequested & CL_RECORD_PID_D_TERM)  			{ sampleBuffer.PutDelta(Float16ToOrderedInt(PIDDTerm)); }
+	if (filterRequested & CL_RECORD_PID_V_TERM)  			{ sampleBuffer.PutDelta(Float16ToOrderedInt(PIDVTerm)); }
+	if (filterRequested & CL_RECORD_PID_A_TERM)  			{ sampleBuffer.PutDelta(Float16ToOrderedInt(PIDATerm)); }
+	if (filterRequested & CL_RECORD_CURRENT_STEP_PHASE)  	{ sampleBuffer.PutDelta(encoder->GetCurrentPhasePosition()); }
+	if (filterRequested & CL_RECORD_DESIRED_STEP_PHASE)  	{ sampleBuffer.PutDelta(desiredStepPhase); }
+	if (filterRequested & CL_RECORD_PHASE_SHIFT)  			{ sampleBuffer.PutDelta(0); }
+	if (filterRequested & CL_RECORD_COIL_A_CURRENT) 		{ sampleBuffer.PutDelta(coilA); }
+	if (filterRequested & CL_RECORD_COIL_B_CURRENT) 		{ sampleBuffer.PutDelta(coilB); }
+
+	sampleBuffer.FinishSample();
+}
+
+// Accumulate the position error and current statistics over fixed windows during continuous data collection.
+// Called from the control loop with task scheduling locked.
+void ClosedLoop::UpdateStreamingStatistics(float positionError, float currentFraction, StepTimer::Ticks now) noexcept
+{
+	streamingWindowSumOfErrorSquares += fsquare(positionError);
+	if (currentFraction > streamingWindowMaxCurrentFraction)
+	{
+		streamingWindowMaxCurrentFraction = currentFraction;
+	}
+	++streamingWindowNumSamples;
+
+	if (now - streamingWindowStartTicks >= StreamingWindowTicks)
+	{
+		lastWindowRmsError = fastSqrtf(streamingWindowSumOfErrorSquares/streamingWindowNumSamples);
+		lastWindowMaxCurrentFraction = streamingWindowMaxCurrentFraction;
+		worstWindowRmsError = max<float>(worstWindowRmsError, lastWindowRmsError);
+		worstWindowMaxCurrentFraction = max<float>(worstWindowMaxCurrentFraction, lastWindowMaxCurrentFraction);
+		++streamingNumWindows;
+
+		streamingWindowStartTicks = now;
+		streamingWindowSumOfErrorSquares = streamingWindowMaxCurrentFraction = 0.0;
+		streamingWindowNumSamples = 0;
+	}
+}
+
+// Interpolate a gain schedule factor at the specified speed in full steps/sec. The schedule must not be empty.
+static float InterpolateGainScheduleFactor(float speed, const float *speeds, const float *factors, size_t numPoints) noexcept
+{
+	if (speed <= speeds[0])
+	{
+		return factors[0];
+	}
+	for (size_t i = 1; i < numPoints; ++i)
+	{
+		if (speed <= speeds[i])
+		{
+			return factors[i - 1] + (factors[i] - factors[i - 1]) * (speed - speeds[i - 1])/(speeds[i] - speeds[i - 1]);
+		}
+	}
+	return factors[numPoints - 1];
+}
+
+// Build the tables of P and D gains at equally-spaced speeds from Kp, Kd and the gain schedule. Call this when any of them changes.
+void ClosedLoop::BuildGainScheduleTable() noexcept
+{
+	const float maxSpeed = (numGainSchedulePoints == 0) ? 0.0 : gainScheduleSpeeds[numGainSchedulePoints - 1];
+	for (size_t i = 0; i < GainScheduleTableSize; ++i)
+	{
+		if (maxSpeed > 0.0)
+		{
+			const float speed = maxSpeed * (float)i/(float)(GainScheduleTableSize - 1);
+			scheduledKp[i] = Kp * InterpolateGainScheduleFactor(speed, gainScheduleSpeeds, gainScheduleKpFactors, numGainSchedulePoints);
+			scheduledKd[i] = Kd * InterpolateGainScheduleFactor(speed, gainScheduleSpeeds, gainScheduleKdFactors, numGainSchedulePoints);
+		}
+		else
+		{
+			// No schedule, or a schedule with a single point at zero speed
+			scheduledKp[i] = (numGainSchedulePoints == 0) ? Kp : Kp * gainScheduleKpFactors[0];
+			scheduledKd[i] = (numGainSchedulePoints == 0) ? Kd : Kd * gainScheduleKdFactors[0];
+		}
+	}
+
+	// Convert the maximum speed from full steps/sec to full steps per step clock
+	gainScheduleIndexPerSpeed = (maxSpeed > 0.0) ? (float)(GainScheduleTableSize - 1) * (float)StepTimer::StepClockRate/maxSpeed : 0.0;
+	currentKp = scheduledKp[0];
+	currentKd = scheduledKd[0];
+}
+
+// Set currentKp and currentKd from the commanded speed and acceleration. This takes the same time whether or not gain scheduling is in use.
+inline void ClosedLoop::UpdateScheduledGains() noexcept
+{
+	const float tablePosition = min<float>(fabsf(feedForwardParams.speed) * gainScheduleIndexPerSpeed, (float)(GainScheduleTableSize - 1));
+	const size_t index = min<size_t>((size_t)tablePosition, GainScheduleTableSize - 2);
+	const float fraction = tablePosition - (float)index;
+	const float factor = (feedForwardParams.acceleration == 0.0) ? 1.0 : accelerationGainFactor;
+	currentKp = (scheduledKp[index] + (scheduledKp[index + 1] - scheduledKp[index]) * fraction) * factor;
+	currentKd = (scheduledKd[index] + (scheduledKd[index + 1] - scheduledKd[index]) * fraction) * factor;
+}
+
+// Update the stall and pre-stall flags. Rather than reacting to the position error crossing a threshold, we integrate the amount by which it exceeds the threshold over time.
+// The rate of integration is proportional to the error divided by the threshold, and is weighted by the motor current so that an error that we are applying full current to correct
+// counts for more than one that we are not. So a large error while the motor is at full current is detected quickly, and a brief excursion during a fast acceleration is ignored.
+// A stall is classified as a collision if the motor current is close to maximum and the motor has nearly stopped although the commanded speed is not small.
+void ClosedLoop::UpdateStallDetection(float currentFraction, StepTimer::Ticks timeElapsed, StepTimer::Ticks loopCallTime) noexcept
+{
+	const float positionErr = fabsf(currentPositionError);
+	const float dt = (float)timeElapsed * (1.0/(float)StepTimer::StepClockRate);
+	const float currentWeight = 0.5 + 0.5 * min<float>(currentFraction, 1.0);
+
+	// Integrate the excess errors
+	if (errorThresholds[1] > 0 && positionErr > errorThresholds[1])
+	{
+		stallEnergy += (positionErr/errorThresholds[1]) * currentWeight * dt;
+	}
+	else
+	{
+		stallEnergy = max<float>(stallEnergy - dt, 0.0);
+	}
+	if (errorThresholds[0] > 0 && positionErr > errorThresholds[0])
+	{
+		preStallEnergy += (positionErr/errorThresholds[0]) * currentWeight * dt;
+	}
+	else
+	{
+		preStallEnergy = max<float>(preStallEnergy - dt, 0.0);
+	}
+	maxStallEnergy = max<float>(maxStallEnergy, stallEnergy);
+
+	if (stall)
+	{
+		// Reset the stall flag when the position error falls to below half the tolerance and the integrated excess error has decayed, to avoid generating too many stall events
+		if (errorThresholds[1] <= 0 || (positionErr < errorThresholds[1]/2 && stallEnergy == 0.0))
+		{
+			stall = false;
+		}
+	}
+	else if (errorThresholds[1] > 0 && positionErr > errorThresholds[1] && stallEnergy >= stallDetectionTime)
+	{
+		stall = true;
+		preStall = false;
+
+		// Decide whether this is a collision
+		const float commandedSpeed = fabsf(mParams.speed);
+		const bool collision = currentFraction >= CollisionCurrentFraction
+								&& commandedSpeed * StepTimer::StepClockRate >= MinCollisionSpeed
+								&& fabsf(GetMeasuredSpeed()) < CollisionSpeedFraction * commandedSpeed;
+		if (collision)
+		{
+			++numCollisions;
+		}
+		else
+		{
+			++numStalls;
+		}
+
+		// Record the details so that the heater task can send the event. Don't overwrite an event that hasn't been sent yet.
+		if (!stallEventPending)
+		{
+			stallEventTime = StepTimer::ConvertToMasterTime(loopCallTime);
+			stallEventPosition = encoder->GetCurrentCount() * encoder->GetStepsPerCount();
+			stallEventError = currentPositionError;
+			stallEventIsCollision = collision;
+			stallEventPending = true;
+		}
+		Platform::NewDriverFault();
+		return;
+	}
+
+	if (!stall)
+	{
+		preStall = errorThresholds[0] > 0 && positionErr > errorThresholds[0] && preStallEnergy >= stallDetectionTime;
+	}
+}
+
+// Send any pending stall or collision events. Called by the heater task after it has been woken up by a call to NewDriverFault.
+// The event time is the step clock time at which the stall was detected, converted to the main board's time base.
+/*static*/ void ClosedLoop::SendPendingEvents() noexcept
+{
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		ClosedLoop *const instance = closedLoopInstances[driver];
+		if (instance != nullptr && instance->stallEventPending)
+		{
+			RaiseEvent(EventType::driver_stall, (instance->stallEventIsCollision) ? StallEventParamCollision : StallEventParamStall, driver,
+						"%s at %" PRIu32 " pos %.3f err %.3f", (instance->stallEventIsCollision) ? "Collision" : "Stall",
+						instance->stallEventTime, (double)instance->stallEventPosition, (double)instance->stallEventError);
+			instance->stallEventPending = false;
+		}
+	}
+}
+
+/*static*/ void ClosedLoop::RaiseEvent(EventType type, uint16_t param, uint8_t device, const char *format, ...) noexcept
+{
+	va_list vargs;
+	va_start(vargs, format);
+	CanInterface::RaiseEvent(type, param, device, format, vargs);
+	va_end(vargs);
+}
+
+// Control the motor in open loop mode using the sensorless position estimate. Called when we are in closed loop or assisted open loop mode and the encoder reading failed.
+// We drive the field to the commanded position using the configured current, so that the motor behaves like an ordinary stepper motor.
+// If the encoder doesn't recover within MaxSensorlessTicks then we report that position is not maintained, which lets the main board take action.
+void ClosedLoop::ControlSensorless(StepTimer::Ticks loopCallTime, StepTimer::Ticks timeElapsed) noexcept
+{
+	hasMovementCommand = moveInstance->GetCurrentMotion(0, loopCallTime, true, mParams);
+	feedForwardParams = mParams;
+	if (hasMovementCommand && inTorqueMode)
+	{
+		ExitTorqueMode();
+	}
+
+	if (!usingSensorlessEstimate)
+	{
+		usingSensorlessEstimate = true;
+		sensorlessStartTime = loopCallTime;
+		++numSensorlessFallbacks;
+	}
+
+	const StepTimer::Ticks sensorlessTicks = loopCallTime - sensorlessStartTime;
+	if (sensorlessTicks > maxSensorlessTicks)
+	{
+		maxSensorlessTicks = sensorlessTicks;
+	}
+	currentPositionError = mParams.position - sensorlessEstimator.GetEstimatedPosition(mParams.position);
+	preStall = true;
+	if (sensorlessTicks > MaxSensorlessTicks && !stall)
+	{
+		stall = true;
+		Platform::NewDriverFault();
+	}
+
+	SetMotorPhase(sensorlessEstimator.GetFieldPhase(mParams.position), ApplyThermalLimit(1.0, timeElapsed));
+}
+
 // Control the motor phase currents, returning the fraction of maximum current that we commanded
 inline float ClosedLoop::ControlMotorCurrents(StepTimer::Ticks ticksSinceLastCall) noexcept
 {
+	const uint32_t controlStartCycles = DWT->CYCCNT;
 	uint16_t commandedStepPhase;
 	float currentFraction;
 
@@ -1028,7 +1806,7 @@ inline float ClosedLoop::ControlMotorCurrents(StepTimer::Ticks ticksSinceLastCal
 		if (torqueModeDirection)		// reverse movement
 		{
 			commandedStepPhase = (uint16_t)(((3 * 1024u) + measuredStepPhase) % 4096u);
-			if (torqueModeMaxSpeed > 0.0 && speedFilter.GetDerivative() <= 0.0)
+			if (torqueModeMaxSpeed > 0.0 && GetMeasuredSpeed() <= 0.0)
 			{
 				const uint32_t maxPhaseDecrement = (uint32_t)(torqueModeMaxSpeed * (1024 * ticksSinceLastCall)) % 4096;
 				if ((desiredStepPhase - commandedStepPhase) % 4096u > maxPhaseDecrement)
@@ -1040,7 +1818,7 @@ inline float ClosedLoop::ControlMotorCurrents(StepTimer::Ticks ticksSinceLastCal
 		else						// forward movement
 		{
 			commandedStepPhase = (uint16_t)((measuredStepPhase + 1024u) % 4096u);
-			if (torqueModeMaxSpeed > 0.0 && speedFilter.GetDerivative() >= 0.0)
+			if (torqueModeMaxSpeed > 0.0 && GetMeasuredSpeed() >= 0.0)
 			{
 				const uint32_t maxPhaseIncrement = (uint32_t)(torqueModeMaxSpeed * (1024 * ticksSinceLastCall)) % 4096;
 				if ((commandedStepPhase - desiredStepPhase) % 4096u > maxPhaseIncrement)
@@ -1060,7 +1838,7 @@ inline float ClosedLoop::ControlMotorCurrents(StepTimer::Ticks ticksSinceLastCal
 		// It's likely that we will need to add a derivative term to prevent the speed oscillating.
 		if (torqueModeMaxSpeed > 0.0)
 		{
-			const float rawVelocity = speedFilter.GetDerivative();
+			const float rawVelocity = GetMeasuredSpeed();
 			const float speed = (torqueModeDirection) ? -rawVelocity : rawVelocity;
 			const float speedErrorFraction = (speed - torqueModeMaxSpeed)/torqueModeMaxSpeed;
 			const float torqueFactor = constrain<float>(VelocityLimitGainFactor * (1.0 - speedErrorFraction), 0.0, 1.0);
@@ -1076,16 +1854,32 @@ inline float ClosedLoop::ControlMotorCurrents(StepTimer::Ticks ticksSinceLastCal
 	{
 		// Use a PID controller to calculate the required 'torque' - the control signal
 		// We choose to use a PID control signal in the range -256 to +256. This is arbitrary.
-		PIDPTerm = constrain<float>(Kp * currentPositionError, -256.0, 256.0);
-		PIDDTerm = constrain<float>(Kd * errorDerivativeFilter.GetDerivative() * StepTimer::StepClockRate, -256.0, 256.0);	// constrain D so that we can graph it more sensibly after a sudden step input
+		UpdateScheduledGains();
+		PIDPTerm = constrain<float>(currentKp * currentPositionError, -256.0, 256.0);
+		PIDDTerm = constrain<float>(currentKd * GetErrorDerivative() * StepTimer::StepClockRate, -256.0, 256.0);	// constrain D so that we can graph it more sensibly after a sudden step input
 
 		if (currentMode == ClosedLoopMode::closed)
 		{
 			const float timeDelta = (float)ticksSinceLastCall * (1.0/(float)StepTimer::StepClockRate);						// get the time delta in seconds
 			PIDITerm = constrain<float>(PIDITerm + Ki * currentPositionError * timeDelta, -PIDIlimit, PIDIlimit);			// constrain I to prevent it running away
-			PIDVTerm = mParams.speed * Kv * ticksSinceLastCall;
-			PIDATerm = mParams.acceleration * Ka * fsquare(ticksSinceLastCall);
-			PIDControlSignal = constrain<float>(PIDPTerm + PIDITerm + PIDDTerm + PIDVTerm + PIDATerm, -256.0, 256.0);		// clamp the sum between +/- 256
+			PIDVTerm = feedForwardParams.speed * Kv * ticksSinceLastCall;
+			PIDATerm = feedForwardParams.acceleration * Ka * fsquare(ticksSinceLastCall);
+			const uint32_t measuredStepPhase = encoder->GetCurrentPhasePosition();
+			PIDCTerm = (coggingCompensationEnabled) ? GetCoggingCompensation(measuredStepPhase) : 0.0;
+			float controlSignal = PIDPTerm + PIDITerm + PIDDTerm + PIDVTerm + PIDATerm + PIDCTerm;
+			if (numControlSignalFilters != 0)
+			{
+				const uint32_t filterStartCycles = DWT->CYCCNT;
+				for (size_t i = 0; i < numControlSignalFilters; ++i)
+				{
+					controlSignal = controlSignalFilters[i].Process(controlSignal);
+				}
+				const uint32_t filterCycles = DWT->CYCCNT - filterStartCycles;
+				filterMaxCycles = max<uint32_t>(filterMaxCycles, filterCycles);
+				filterTotalCycles += filterCycles;
+				++filterNumCalls;
+			}
+			PIDControlSignal = constrain<float>(controlSignal, -256.0, 256.0);		// clamp the sum between +/- 256
 
 			// Calculate the offset required to produce the torque in the correct direction
 			// i.e. if we are moving in the positive direction, we must apply currents with a positive phase shift
@@ -1096,8 +1890,7 @@ inline float ClosedLoop::ControlMotorCurrents(StepTimer::Ticks ticksSinceLastCal
 			// New algorithm: phase of motor current is always +/- 1 full step relative to current position, but motor current is adjusted according to the PID result
 			// The following assumes that signed arithmetic is 2's complement
 			const float PhaseFeedForwardFactor = 1000.0;
-			const int16_t phaseFeedForward = lrintf(constrain<float>(speedFilter.GetDerivative() * ticksSinceLastCall * PhaseFeedForwardFactor, -256.0, 256.0));
-			const uint32_t measuredStepPhase = encoder->GetCurrentPhasePosition();
+			const int16_t phaseFeedForward = lrintf(constrain<float>(GetMeasuredSpeed() * ticksSinceLastCall * PhaseFeedForwardFactor, -256.0, 256.0));
 			const uint16_t adjustedStepPhase = (uint16_t)((int16_t)measuredStepPhase + phaseFeedForward) % 4096u;
 			commandedStepPhase = (((PIDControlSignal < 0.0) ? (3 * 1024) : 1024) + adjustedStepPhase) % 4096u;
 			currentFraction = fabsf(PIDControlSignal) * (1.0/256.0);
@@ -1107,8 +1900,8 @@ inline float ClosedLoop::ControlMotorCurrents(StepTimer::Ticks ticksSinceLastCal
 			// Driver is in assisted open loop mode
 			// In this mode the I term is not used and the A and V terms are independent of the loop time.
 			constexpr float scalingFactor = 100.0;
-			PIDVTerm = mParams.speed * Kv * scalingFactor;
-			PIDATerm = mParams.acceleration * Ka * fsquare(scalingFactor);
+			PIDVTerm = feedForwardParams.speed * Kv * scalingFactor;
+			PIDATerm = feedForwardParams.acceleration * Ka * fsquare(scalingFactor);
 			PIDControlSignal = min<float>(fabsf(PIDPTerm + PIDDTerm) + fabsf(PIDVTerm) + fabsf(PIDATerm), 256.0);
 
 			const uint16_t stepPhase = (uint16_t)llrintf(mParams.position * 1024.0);
@@ -1116,7 +1909,11 @@ inline float ClosedLoop::ControlMotorCurrents(StepTimer::Ticks ticksSinceLastCal
 			currentFraction = holdCurrentFraction + (1.0 - holdCurrentFraction) * min<float>(PIDControlSignal * (1.0/256.0), 1.0);
 		}
 	}
+	currentFraction = ApplyThermalLimit(currentFraction, ticksSinceLastCall);
+	const uint32_t setPhaseStartCycles = DWT->CYCCNT;
+	profiler.Record(LoopProfiler::Stage::control, setPhaseStartCycles - controlStartCycles);
 	SetMotorPhase(commandedStepPhase, currentFraction);
+	profiler.Record(LoopProfiler::Stage::setPhase, DWT->CYCCNT - setPhaseStartCycles);
 	return currentFraction;
 }
 
@@ -1153,6 +1950,17 @@ void ClosedLoop::InstanceDiagnostics(size_t driver, const StringRef& reply) noex
 		{
 			reply.catf(" (filter: %#x, mode: %u, rate: %u, movement: %u)", filterRequested, samplingMode, (unsigned int)(StepTimer::StepClockRate/dataCollectionIntervalTicks), movementRequested);
 		}
+		if (totalSamplesCollected != 0)
+		{
+			// Report the throughput of the current or most recent data collection
+			const StepTimer::Ticks collectionTicks = whenLastSampleTaken - dataCollectionStartTicks;
+			reply.lcatf("Data collection: %" PRIu32 " samples, %.1f samples/s, %.1f bytes/sample%s, %s",
+						totalSamplesCollected,
+						(collectionTicks == 0) ? 0.0 : (double)((float)(totalSamplesCollected - 1) * (float)StepTimer::StepClockRate/(float)collectionTicks),
+						(double)((float)sampleBuffer.GetBytesStored()/(float)totalSamplesCollected),
+						(sampleBuffer.IsCompressed()) ? " (compressed)" : "",
+						(sampleBufferOverflowed) ? "overflowed" : "no overflow");
+		}
 
 		reply.lcatf("Control loop runtime (us): min=%" PRIu32 ", max=%" PRIu32 ", frequency (Hz): min=%" PRIu32 ", max=%" PRIu32,
 					TickPeriodToMicroseconds(minControlLoopRuntime), TickPeriodToMicroseconds(maxControlLoopRuntime),
@@ -1164,6 +1972,65 @@ void ClosedLoop::InstanceDiagnostics(size_t driver, const StringRef& reply) noex
 	//reply.catf(", event status 0x%08" PRIx32 ", TCC2 CTRLA 0x%08" PRIx32 ", TCC2 EVCTRL 0x%08" PRIx32, EVSYS->CHSTATUS.reg, QuadratureTcc->CTRLA.reg, QuadratureTcc->EVCTRL.reg);
 }
 
+// Report the control loop stage timings and the optional control features. These have their own diagnostics part because there isn't room for them in the main one.
+void ClosedLoop::InstanceControlDiagnostics(size_t driver, const StringRef& reply) noexcept
+{
+	if (currentMode != ClosedLoopMode::open)
+	{
+		reply.lcatf("Closed loop driver %u control:", driver);
+		profiler.AppendSummary(reply);
+		reply.lcatf("Cogging compensation: %s", (coggingCompensationEnabled) ? "enabled" : "disabled");
+		if (numGainSchedulePoints != 0 || accelerationGainFactor != 1.0)
+		{
+			reply.lcatf("Scheduled gains: P=%.1f D=%.3f", (double)currentKp, (double)currentKd);
+		}
+		if (feedForwardLookAhead >= 0.0)
+		{
+			reply.lcatf("Feedforward look-ahead (us): %" PRIu32, TickPeriodToMicroseconds(lrintf(averageControlLatency + feedForwardLookAhead)));
+		}
+		reply.lcatf("Speed estimation by %s%s", (useObserver) ? "observer" : "averaging filter", (usePeriodSpeed) ? ", period measurement at low speed" : "");
+		if (filterNumCalls != 0 && numControlSignalFilters != 0)
+		{
+			reply.lcatf("Control signal filters (cycles): avg=%" PRIu32 ", max=%" PRIu32 ", avg per stage=%" PRIu32,
+						filterTotalCycles/filterNumCalls, filterMaxCycles, filterTotalCycles/(filterNumCalls * numControlSignalFilters));
+		}
+		filterMaxCycles = filterTotalCycles = 0;
+		filterNumCalls = 0;
+	}
+}
+
+// Report the statistics of the monitoring features. These have their own diagnostics part because there isn't room for them in the main one.
+void ClosedLoop::InstanceMonitoringDiagnostics(size_t driver, const StringRef& reply) noexcept
+{
+	if (currentMode != ClosedLoopMode::open)
+	{
+		reply.lcatf("Closed loop driver %u monitoring:", driver);
+		if (streamingNumWindows != 0)
+		{
+			reply.lcatf("Continuous collection: %u windows, RMS error last %.3f worst %.3f, max current fraction last %.2f worst %.2f, %" PRIu32 " samples dropped",
+						streamingNumWindows, (double)lastWindowRmsError, (double)worstWindowRmsError,
+						(double)lastWindowMaxCurrentFraction, (double)worstWindowMaxCurrentFraction, totalDroppedSamples);
+		}
+		reply.lcatf("Stall detection: %u stalls, %u collisions, max integrated error %.1fms",
+					numStalls, numCollisions, (double)(maxStallEnergy * 1000.0));
+		maxStallEnergy = 0.0;
+		if (thermalLimitingEnabled)
+		{
+			reply.lcatf("Thermal budget used: motor %.0f%% (peak %.0f%%), driver %.0f%% (peak %.0f%%), current limit %.0f%% (min %.0f%%)",
+						(double)(motorThermalModel.GetUsage() * 100.0), (double)(motorThermalModel.GetAndClearPeakUsage() * 100.0),
+						(double)(driverThermalModel.GetUsage() * 100.0), (double)(driverThermalModel.GetAndClearPeakUsage() * 100.0),
+						(double)(thermalCurrentLimit * 100.0), (double)(minThermalCurrentLimit * 100.0));
+			minThermalCurrentLimit = thermalCurrentLimit;
+		}
+		reply.lcatf("Sensorless estimate: divergence max %.3f RMS %.3f, lag %.3f steps, %u encoder errors, %u fallbacks, longest %.1fms",
+					(double)sensorlessEstimator.GetMaxDivergence(), (double)sensorlessEstimator.GetRmsDivergence(), (double)sensorlessEstimator.GetLag(),
+					numEncoderErrors, numSensorlessFallbacks, (double)TickPeriodToMillis(maxSensorlessTicks));
+		sensorlessEstimator.ResetStatistics();
+		numEncoderErrors = numSensorlessFallbacks = 0;
+		maxSensorlessTicks = 0;
+	}
+}
+
 /*static*/ void ClosedLoop::Diagnostics(const StringRef& reply) noexcept
 {
 	for (size_t i = 0; i < NumDrivers; ++i)
@@ -1172,6 +2039,39 @@ void ClosedLoop::InstanceDiagnostics(size_t driver, const StringRef& reply) noex
 	}
 }
 
+/*static*/ void ClosedLoop::ControlDiagnostics(const StringRef& reply) noexcept
+{
+	for (size_t i = 0; i < NumDrivers; ++i)
+	{
+		closedLoopInstances[i]->InstanceControlDiagnostics(i, reply);
+	}
+}
+
+/*static*/ void ClosedLoop::MonitoringDiagnostics(const StringRef& reply) noexcept
+{
+	for (size_t i = 0; i < NumDrivers; ++i)
+	{
+		closedLoopInstances[i]->InstanceMonitoringDiagnostics(i, reply);
+	}
+}
+
+// Report the histograms of the control loop stage timings and reset them. They are too long to fit in the M122 report, and reporting them on demand means that rare overruns are not missed.
+/*static*/ void ClosedLoop::ReportAndResetProfiles(const StringRef& reply) noexcept
+{
+	for (size_t i = 0; i < NumDrivers; ++i)
+	{
+		// Take a copy so that we don't hold up the control loop while we format the report
+		LoopProfiler copiedProfile;
+		{
+			TaskCriticalSectionLocker lock;			// don't let the control loop record a time while we are copying and clearing the data
+			copiedProfile = closedLoopInstances[i]->profiler;
+			closedLoopInstances[i]->profiler.Reset();
+		}
+		reply.lcatf("Driver %u ", i);
+		copiedProfile.AppendHistograms(reply);
+	}
+}
+
 StandardDriverStatus ClosedLoop::ReadLiveStatus() const noexcept
 {
 	StandardDriverStatus result;
@@ -1193,10 +2093,10 @@ void ClosedLoop::ResetError() noexcept
 		// Set the target position to the current position
 		const bool err = encoder->TakeReading();
 		(void)err;		//TODO handle error
-		errorDerivativeFilter.Reset();
-		speedFilter.Reset();
+		ResetDerivativeEstimators();
 		SetTargetToCurrentPosition();
 		inTorqueMode = false;
+		stallEnergy = preStallEnergy = 0.0;
 	}
 # else
 #  error Multi driver code not implemented
@@ -1239,8 +2139,7 @@ bool ClosedLoop::SetClosedLoopEnabled(ClosedLoopMode mode, const StringRef &repl
 		}
 
 		PIDITerm = 0.0;
-		errorDerivativeFilter.Reset();
-		speedFilter.Reset();
+		ResetDerivativeEstimators();
 		SetTargetToCurrentPosition();
 
 		// Set the target position to the current position
@@ -1269,8 +2168,7 @@ void ClosedLoop::DriverSwitchedToClosedLoop() noexcept
 	desiredStepPhase = currentPhasePosition;
 	SetMotorPhase(currentPhasePosition, SmartDrivers::GetStandstillCurrentPercent(0) * 0.01);	// set the motor currents to match the initial position using the open loop standstill current
 	PIDITerm = 0.0;													// clear the integral term accumulator
-	errorDerivativeFilter.Reset();
-	speedFilter.Reset();
+	ResetDerivativeEstimators();
 	ResetMonitoringVariables();										// the first loop iteration will have recorded a higher than normal loop call interval, so start again
 }
 
@@ -1322,8 +2220,7 @@ void ClosedLoop::GetStatistics(CanMessageDriversStatus::ClosedLoopStatus& stat)
 // When not called from the closed loop/TMC task, task scheduling should be disabled before calling this.
 void ClosedLoop::ExitTorqueMode() noexcept
 {
-	errorDerivativeFilter.Reset();
-	speedFilter.Reset();
+	ResetDerivativeEstimators();
 	SetTargetToCurrentPosition();
 	inTorqueMode = false;
 }
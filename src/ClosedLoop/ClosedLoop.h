@@ -17,7 +17,14 @@
 # include <Movement/StepTimer.h>
 # include <ClosedLoop/Trigonometry.h>
 # include <Hardware/SharedSpiDevice.h>
+# include <Hardware/NonVolatileMemory.h>
 # include "DerivativeAveragingFilter.h"
+# include "StateObserver.h"
+# include "PeriodSpeedEstimator.h"
+# include "SensorlessEstimator.h"
+# include "BiquadFilter.h"
+# include "ThermalModel.h"
+# include "LoopProfiler.h"
 # include "TuningErrors.h"
 # include "SampleBuffer.h"
 # include "Encoders/Encoder.h"
@@ -26,6 +33,7 @@ constexpr float MaxSafeBacklash = 0.22;					// the maximum backlash in full step
 constexpr float MaxGoodBacklash = 0.15;					// the maximum backlash in full steps that we are happy with - warn if there is more
 constexpr unsigned int LinearEncoderIncreaseFactor = 4;	// this should be a power of 2. Allowed backlash is increased by this amount for linear composite encoders.
 constexpr float VelocityLimitGainFactor = 5.0;			// the gain of the P loop when in torque mode
+constexpr uint16_t CL_RECORD_COMPRESSED = 1u << 15;		// not a recorded variable, this filter bit requests that samples be delta-encoded
 
 class Encoder;
 class SpiEncoder;
@@ -55,6 +63,7 @@ public:
 	static constexpr uint8_t BASIC_TUNING_MANOEUVRE 				= 1u << 0;		// this measures the polarity, check that the CPR looks OK, and for relative encoders sets the zero position
 	static constexpr uint8_t ENCODER_CALIBRATION_MANOEUVRE 			= 1u << 1;		// this calibrates an absolute encoder
 	static constexpr uint8_t ENCODER_CALIBRATION_CHECK				= 1u << 2;		// this checks the calibration
+	static constexpr uint8_t COGGING_CALIBRATION_MANOEUVRE			= 1u << 3;		// this measures the cogging torque under closed loop control and builds the compensation table
 	static constexpr uint8_t STEP_MANOEUVRE 						= 1u << 6;		// this does a sudden step change in the requested position for PID tuning
 
 #if 0	// The remainder are not currently implemented
@@ -73,6 +82,8 @@ public:
 
 	const char *_ecv_array GetModeText() const noexcept;
 	void InstanceDiagnostics(size_t driver, const StringRef& reply) noexcept;
+	void InstanceControlDiagnostics(size_t driver, const StringRef& reply) noexcept;
+	void InstanceMonitoringDiagnostics(size_t driver, const StringRef& reply) noexcept;
 
 	// Methods called by the motion system
 	void InstanceControlLoop() noexcept;
@@ -98,6 +109,10 @@ public:
 	static GCodeResult ProcessM569Point6(const CanMessageGeneric& msg, const StringRef& reply) noexcept;
 	static bool OkayToSetDriverIdle(size_t driver) noexcept;
 	static void Diagnostics(const StringRef& reply) noexcept;
+	static void ControlDiagnostics(const StringRef& reply) noexcept;
+	static void MonitoringDiagnostics(const StringRef& reply) noexcept;
+	static void ReportAndResetProfiles(const StringRef& reply) noexcept;
+	static void SendPendingEvents() noexcept;
 
 	// Functions run by tasks
 	[[noreturn]] void DataTransmissionTaskLoop() noexcept;
@@ -113,10 +128,31 @@ private:
 																	// 1/10 sec delay between enabling the driver and starting tuning, to allow for brake release and current buildup
 	static constexpr StepTimer::Ticks DataCollectionIdleStepTicks = StepTimer::StepClockRate/200;
 																	// start collecting tuning data 5ms before the start of the tuning move
+	static constexpr uint8_t MultiPassCalibrationPasses = 4;		// the number of passes we make when asked to do multi-pass encoder calibration
 	static constexpr float DefaultHoldCurrentFraction = 0.25;		// the minimum fraction of the requested current that we apply when holding position
 	static constexpr float DefaultTorquePerAmp = 1.0;				// the torque per amp of motor current
+	static constexpr size_t MaxGainSchedulePoints = 4;				// the maximum number of speeds in the gain schedule
+	static constexpr size_t GainScheduleTableSize = 17;				// the number of equally-spaced speeds in the interpolation table built from the gain schedule
+	static constexpr size_t MaxNotchFilters = 2;					// the maximum number of notch filters on the control signal
+	static constexpr size_t MaxControlSignalFilters = MaxNotchFilters + 1;	// the notch filters followed by an optional low-pass filter
+	static constexpr float DefaultLowPassFilterQ = 0.7071;			// Butterworth response
+	static constexpr float DefaultStallDetectionTime = 0.005;		// how long the position error must exceed the error threshold at full current for a stall to be reported, in seconds
+	static constexpr float CollisionCurrentFraction = 0.9;			// a stall is only a collision if the current fraction is at least this...
+	static constexpr float CollisionSpeedFraction = 0.25;			// ...and the measured speed is less than this fraction of the commanded speed...
+	static constexpr float MinCollisionSpeed = 5.0;				// ...and the commanded speed is at least this, in full steps per second
+	static constexpr uint16_t StallEventParamStall = 0;				// event parameter for a stall that is not a collision
+	static constexpr uint16_t StallEventParamCollision = 1;			// event parameter for a collision
+	static constexpr StepTimer::Ticks MaxSensorlessTicks = StepTimer::StepClockRate;	// how long we continue in open loop mode when the encoder can't be read before reporting that position is not maintained
+	static constexpr float DefaultMotorThermalTimeConstant = 60.0;	// the default thermal time constant of the motor in seconds
+	static constexpr float DriverThermalTimeConstant = 2.0;			// the thermal time constant of the driver in seconds
+	static constexpr float DriverContinuousCurrent = MaxTmc5160Current * 0.707;	// the current in mA that the driver can sustain continuously
 
 	static constexpr float PIDIlimit = 80.0;
+	static constexpr size_t CoggingTableSize = NonVolatileMemory::ClosedLoopCoggingTableSize;
+	static constexpr unsigned int CoggingPhasesPerEntry = 4096/CoggingTableSize;
+	static_assert(4096 % CoggingTableSize == 0);
+	static constexpr float CoggingNvmScaling = 2.0;				// the NVM stores the cogging table in units of 1/2 of the PID control signal
+	static constexpr StepTimer::Ticks MaxLatencyCallInterval = StepTimer::StepClockRate/1000;	// control loop call intervals longer than this are not used to estimate the control latency
 
 	// Methods used only by closed loop and by the tuning module
 	void SetMotorPhase(uint16_t phase, float magnitude) noexcept;
@@ -124,6 +160,7 @@ private:
 																// call this when we have stopped basic tuning movement and are ready to switch to closed loop control
 	void ReadyToCalibrate(bool store) noexcept;					// call this when encoder calibration has finished collecting data
 	void AdjustTargetMotorSteps(float amount) noexcept;			// called by tuning to execute a step
+	void FinishedCoggingCalibration(bool succeeded) noexcept;	// call this when the cogging calibration manoeuvre has finished collecting data
 	void ExitTorqueMode() noexcept;
 
 	// Methods in the tuning module
@@ -135,7 +172,15 @@ private:
 		None = 0,			// not collecting data
 		Immediate,			// collecting data now
 		OnNextMove,			// collect data when the next movement command starts executing
-		SendingData			// finished collecting data but still sending it to the main board
+		SendingData,		// finished collecting data but still sending it to the main board
+		Continuous			// collecting data until told to stop, dropping samples if the buffer is full
+	};
+
+	// Record of samples dropped during continuous data collection
+	struct SampleGap
+	{
+		uint32_t numDropped;								// how many samples were dropped
+		uint16_t samplesBefore;								// the value of samplesCollected when the next sample was stored after the gap
 	};
 
 	static ClosedLoop *closedLoopInstances[NumDrivers];
@@ -157,6 +202,21 @@ private:
 	float	Ka = 0.0;											// The acceleration feedforward constant
 
 	float 	errorThresholds[2];									// The error thresholds. [0] is pre-stall, [1] is stall
+	float	stallDetectionTime = DefaultStallDetectionTime;		// the integrated excess error at which we report a stall, in seconds at full current and the threshold error
+	float	feedForwardLookAhead = -1.0;						// Extra time in step clocks to look ahead for the V and A terms, in addition to the control latency. Negative disables look-ahead.
+
+	// Gain scheduling. The P and D gains are multiplied by factors that depend on the commanded speed, and by a further factor when accelerating or decelerating.
+	// So that the control loop doesn't need to search the schedule, we build a table of gains at equally spaced speeds from it and interpolate in that.
+	size_t	numGainSchedulePoints = 0;							// the number of speeds in the gain schedule, zero if gain scheduling is not in use
+	float	gainScheduleSpeeds[MaxGainSchedulePoints];			// the speeds in the gain schedule in full steps/sec, in increasing order
+	float	gainScheduleKpFactors[MaxGainSchedulePoints];		// the factors that Kp is multiplied by at those speeds
+	float	gainScheduleKdFactors[MaxGainSchedulePoints];		// the factors that Kd is multiplied by at those speeds
+	float	accelerationGainFactor = 1.0;						// the factor that the P and D gains are multiplied by when accelerating or decelerating
+	float	scheduledKp[GainScheduleTableSize];					// Kp at equally-spaced speeds
+	float	scheduledKd[GainScheduleTableSize];					// Kd at equally-spaced speeds
+	float	gainScheduleIndexPerSpeed = 0.0;					// multiply the speed in full steps per step clock by this to get the index into the scheduled gain tables
+	float	currentKp;											// the P gain used in the most recent iteration of the control loop
+	float	currentKd;											// the D gain used in the most recent iteration of the control loop
 
 	float torqueModeCommandedCurrentFraction = 0.0;		// when in torque mode, the requested torque
 	float torqueModeMaxSpeed = 0.0;						// when in torque mode, the maximum speed. Zero or negative means no limit.
@@ -164,6 +224,9 @@ private:
 	// Working variables
 	// These variables are all used to calculate the required motor currents. They are declared here so they can be reported on by the data collection task
 	MotionParameters mParams;							// the target position, speed and acceleration
+	MotionParameters feedForwardParams;					// the speed and acceleration used to calculate the V and A terms, which may be ahead of mParams
+	float averageControlLatency = 0.0;					// average time in step clocks from taking an encoder reading to the resulting motor currents taking effect
+	float averageCallInterval = 0.0;					// average control loop call interval in step clocks, used to calculate the filter coefficients
 	float currentPositionError;							// the current position error in full steps
 	float periodMaxAbsPositionError = 0.0;				// the maximum value of the absolute position error
 	float periodSumOfPositionErrorSquares = 0.0;		// used to calculate the RMS error
@@ -176,6 +239,7 @@ private:
 	float 	PIDDTerm;									// Derivative term
 	float	PIDVTerm;									// Velocity feedforward term
 	float	PIDATerm;									// Acceleration feedforward term
+	float	PIDCTerm = 0.0;								// Cogging compensation term
 	float	PIDControlSignal;							// The overall signal from the PID controller
 
 
@@ -190,6 +254,34 @@ private:
 	bool 	stall = false;								// Has the closed loop error threshold been exceeded?
 	bool 	preStall = false;							// Has the closed loop warning threshold been exceeded?
 
+	// Stall and collision detection
+	float	stallEnergy = 0.0;							// the integrated excess of the position error over the error threshold
+	float	preStallEnergy = 0.0;						// the integrated excess of the position error over the warning threshold
+	float	maxStallEnergy = 0.0;						// the maximum value of stallEnergy since the last diagnostics report
+	unsigned int numStalls = 0;							// the number of stalls detected that were not collisions
+	unsigned int numCollisions = 0;						// the number of collisions detected
+	uint32_t stallEventTime;							// when the most recent stall was detected, in main board step clocks
+	float	stallEventPosition;							// the measured position in full steps when the most recent stall was detected
+	float	stallEventError;							// the position error in full steps when the most recent stall was detected
+	bool	stallEventIsCollision;
+	volatile bool stallEventPending = false;			// true if we have detected a stall and not sent the event yet
+
+	// Fallback to open loop control using the sensorless position estimate when the encoder can't be read
+	bool	usingSensorlessEstimate = false;			// true if the most recent encoder reading failed and we are using the estimate instead
+	StepTimer::Ticks sensorlessStartTime;				// when we started using the estimate
+	StepTimer::Ticks maxSensorlessTicks = 0;			// the longest time we have used the estimate for since the last diagnostics report
+	unsigned int numEncoderErrors = 0;					// the number of failed encoder readings since the last diagnostics report
+	unsigned int numSensorlessFallbacks = 0;			// the number of times we have fallen back to the estimate since the last diagnostics report
+
+	// Thermal headroom management. The configured current is the peak current allowed in short bursts, e.g. when accelerating.
+	// We model the heating of the motor and the driver and reduce the maximum current as either approaches its limit, so that the average stays within limits.
+	bool	thermalLimitingEnabled = false;				// true if we are limiting the current to keep within the thermal budget
+	float	motorThermalTimeConstant = DefaultMotorThermalTimeConstant;	// the thermal time constant of the motor in seconds
+	float	thermalCurrentLimit = 1.0;					// the maximum current fraction we may apply now
+	float	minThermalCurrentLimit = 1.0;				// the lowest value of thermalCurrentLimit since the last diagnostics report
+	ThermalModel motorThermalModel;						// heating of the motor, continuous current and time constant are set by the user
+	ThermalModel driverThermalModel;					// heating of the driver, continuous current is DriverContinuousCurrent
+
 	// Basic tuning synchronisation
 	volatile bool basicTuningDataReady = false;
 
@@ -197,8 +289,17 @@ private:
 	enum class CalibrationState : uint8_t { notReady = 0, dataReady, complete };
 	volatile CalibrationState calibrationState = CalibrationState::notReady;
 	volatile bool calibrateNotCheck = false;
+	uint8_t calibrationPasses = 1;						// how many forward and reverse passes to make when calibrating the encoder
 	volatile TuningErrors calibrationErrors;
 
+	// Cogging compensation
+	enum class CoggingCalibrationState : uint8_t { notReady = 0, dataReady, failed };
+	volatile CoggingCalibrationState coggingCalibrationState = CoggingCalibrationState::notReady;
+	bool	coggingCompensationEnabled = false;			// true if we have a valid cogging table and we are not recalibrating it
+	float	coggingTable[CoggingTableSize];				// the PID control signal needed to hold position, indexed by electrical phase
+	float	coggingSums[2][CoggingTableSize];			// accumulated control signal during cogging calibration, forwards [0] and backwards [1]
+	uint16_t coggingCounts[2][CoggingTableSize];		// number of readings accumulated into coggingSums
+
 	StepTimer::Ticks whenLastTuningStepTaken;			// when the control loop last called the tuning code
 
 	// Monitoring variables
@@ -217,15 +318,52 @@ private:
 	volatile uint16_t samplesRequested;							// The number of samples requested
 
 	// Derived variables
-	volatile uint16_t samplesCollected = 0;
+	volatile uint16_t samplesCollected = 0;						// in continuous mode this and samplesSent may wrap round
 	volatile uint16_t samplesSent = 0;
+	uint32_t totalSamplesCollected = 0;							// used to report throughput
 	bool sampleBufferOverflowed = false;						// set if the buffer is full when we need to store a sample
 	StepTimer::Ticks dataCollectionStartTicks;					// At what tick did data collection start?
 	StepTimer::Ticks dataCollectionIntervalTicks;				// the requested interval between samples
 	StepTimer::Ticks whenNextSampleDue;							// when it will be time to take the next sample
+	StepTimer::Ticks whenLastSampleTaken;						// when we took the most recent sample, used to report the sample rate achieved
+
+	// Continuous data collection variables
+	static constexpr size_t MaxSampleGaps = 8;					// must be a power of 2
+	static constexpr StepTimer::Ticks StreamingWindowTicks = StepTimer::StepClockRate;	// the window over which we compute statistics when collecting continuously
+	SampleGap sampleGaps[MaxSampleGaps];						// gaps in the sample sequence that the sending task has yet to reach
+	volatile uint8_t sampleGapsWritten = 0;
+	volatile uint8_t sampleGapsRead = 0;
+	uint32_t pendingDroppedSamples = 0;							// samples dropped since the last one we stored, 32 bits so that it can't wrap round to zero during a long overrun
+	uint32_t totalDroppedSamples = 0;
+	StepTimer::Ticks streamingWindowStartTicks;
+	float streamingWindowSumOfErrorSquares;
+	float streamingWindowMaxCurrentFraction;
+	unsigned int streamingWindowNumSamples;
+	unsigned int streamingNumWindows = 0;
+	float lastWindowRmsError = 0.0;
+	float lastWindowMaxCurrentFraction = 0.0;
+	float worstWindowRmsError = 0.0;
+	float worstWindowMaxCurrentFraction = 0.0;
 
 	DerivativeAveragingFilter<DerivativeFilterSize> errorDerivativeFilter;	// An averaging filter to smooth the derivative of the error
 	DerivativeAveragingFilter<SpeedFilterSize> speedFilter;		// An averaging filter to smooth the actual speed
+	StateObserver positionObserver;								// An alternative to the above filters with less lag
+	bool useObserver = false;									// true to use positionObserver instead of the derivative averaging filters
+	PeriodSpeedEstimator periodSpeedEstimator;					// Speed estimation from the time between counts, for relative encoders at low speed
+	SensorlessEstimator sensorlessEstimator;					// position estimation for when the encoder can't be read
+	bool usePeriodSpeed = false;								// true if the encoder is a relative encoder, so we use periodSpeedEstimator at low speed
+
+	// Filters applied to the PID control signal to suppress mechanical resonances, notch filters first
+	BiquadFilter controlSignalFilters[MaxControlSignalFilters];
+	size_t numControlSignalFilters = 0;
+	float controlSignalFilterSampleRate = 0.0;					// the control loop frequency that the filter coefficients were calculated for
+
+	// Control signal filter benchmark, in CPU cycles
+	uint32_t filterMaxCycles = 0;
+	uint32_t filterTotalCycles = 0;
+	unsigned int filterNumCalls = 0;
+
+	LoopProfiler profiler;										// timing of each stage of the control loop
 	SampleBuffer sampleBuffer;									// buffer for collecting samples - declare this last because it is large
 
 	// Functions private to this module
@@ -237,11 +375,80 @@ private:
 	// Return true if we are currently collecting data or primed to collect data or finishing sending data
 	inline bool CollectingData() noexcept { return samplingMode != RecordingMode::None; }
 
+	// Return true if we are taking samples now
+	inline bool TakingSamples() noexcept { return samplingMode == RecordingMode::Immediate || samplingMode == RecordingMode::Continuous; }
+
+	// Return true if we should use the period speed estimate instead of the speed filter or the observer
+	inline bool UsingPeriodSpeed() const noexcept { return usePeriodSpeed && periodSpeedEstimator.IsLowSpeed(); }
+
+	// Get the measured speed in full steps per step clock
+	inline float GetMeasuredSpeed() const noexcept
+	{
+		return (UsingPeriodSpeed()) ? periodSpeedEstimator.GetSpeed() * encoder->GetStepsPerCount()
+				: (useObserver) ? positionObserver.GetVelocity()
+					: speedFilter.GetDerivative();
+	}
+
+	// Get the rate of change of the position error in full steps per step clock. The observer and the period estimator track the measured position only, so we use the commanded speed for the target.
+	inline float GetErrorDerivative() const noexcept
+	{
+		return (UsingPeriodSpeed() || useObserver) ? mParams.speed - GetMeasuredSpeed() : errorDerivativeFilter.GetDerivative();
+	}
+
+	// Take an encoder reading and record how long it took. Return true if error, false if success.
+	inline bool TakeEncoderReading() noexcept
+	{
+		const uint32_t startCycles = DWT->CYCCNT;
+		const bool err = encoder->TakeReading();
+		profiler.Record(LoopProfiler::Stage::encoderReading, DWT->CYCCNT - startCycles);
+		return err;
+	}
+
+	inline void ResetDerivativeEstimators() noexcept
+	{
+		errorDerivativeFilter.Reset();
+		speedFilter.Reset();
+		positionObserver.Reset();
+		periodSpeedEstimator.Reset();
+		for (BiquadFilter& f : controlSignalFilters)
+		{
+			f.Reset();									// the control signal filters hold history too
+		}
+	}
+
+	// Limit the current to keep within the thermal budget and update the thermal models with the current applied
+	inline float ApplyThermalLimit(float currentFraction, StepTimer::Ticks ticksSinceLastCall) noexcept
+	{
+		if (thermalLimitingEnabled)
+		{
+			currentFraction = min<float>(currentFraction, thermalCurrentLimit);
+			motorThermalModel.Update(currentFraction, ticksSinceLastCall);
+			driverThermalModel.Update(currentFraction, ticksSinceLastCall);
+			thermalCurrentLimit = min<float>(motorThermalModel.GetAllowedCurrentFraction(), driverThermalModel.GetAllowedCurrentFraction());
+			if (thermalCurrentLimit < minThermalCurrentLimit)
+			{
+				minThermalCurrentLimit = thermalCurrentLimit;
+			}
+		}
+		return currentFraction;
+	}
+
+	void BuildGainScheduleTable() noexcept;
+	void ControlSensorless(StepTimer::Ticks loopCallTime, StepTimer::Ticks timeElapsed) noexcept;
+	void UpdateStallDetection(float currentFraction, StepTimer::Ticks timeElapsed, StepTimer::Ticks loopCallTime) noexcept;
+	static void RaiseEvent(EventType type, uint16_t param, uint8_t device, const char *format, ...) noexcept __attribute__ ((format (printf, 4, 5)));
+	void UpdateScheduledGains() noexcept;
 	void CollectSample() noexcept;
+	void StoreSample() noexcept;
+	void StoreCompressedSample() noexcept;
+	void UpdateStreamingStatistics(float positionError, float currentFraction, StepTimer::Ticks now) noexcept;
 	float ControlMotorCurrents(StepTimer::Ticks ticksSinceLastCall) noexcept;
 	void StartTuning(uint8_t tuningType) noexcept;
 	GCodeResult ProcessBasicTuningResult(const StringRef& reply) noexcept;
 	GCodeResult ProcessCalibrationResult(const StringRef& reply) noexcept;
+	GCodeResult ProcessCoggingCalibrationResult(const StringRef& reply) noexcept;
+	void LoadCoggingTable() noexcept;
+	float GetCoggingCompensation(uint32_t phase) const noexcept;
 	void ReportTuningErrors(TuningErrors tuningErrorBitmask, const StringRef& reply) noexcept;
 	void ResetMonitoringVariables() noexcept;
 	void SetTargetToCurrentPosition() noexcept;
@@ -251,6 +458,7 @@ private:
 	bool BasicTuning(bool firstIteration) noexcept;
 	bool EncoderCalibration(bool firstIteration) noexcept;
 	bool Step(bool firstIteration) noexcept;
+	bool CoggingCalibration(bool firstIteration) noexcept;
 };
 
 inline bool ClosedLoop::IsClosedLoopEnabled() const noexcept
@@ -169,6 +169,7 @@ void AS5047D::AppendDiagnostics(const StringRef &reply) noexcept
 	reply.catf(", full rotations %" PRIi32, fullRotations);
 	reply.catf(", last angle %" PRIu32, currentAngle);
 	reply.catf(", minCorrection=%.1f, maxCorrection=%.1f", (double)minLUTCorrection, (double)maxLUTCorrection);
+	AppendLUTBenchmark(reply);
 	DiagnosticRegisters regs;
 	if (GetDiagnosticRegisters(regs))
 	{
@@ -28,25 +28,12 @@ bool AbsoluteRotaryEncoder::TakeReading() noexcept
 		// Apply LUT correction (if the LUT is loaded)
 		if (LUTLoaded)
 		{
-			const size_t windowStartIndex = newAngle >> resolutionToLutShiftFactor;
-			if (resolutionToLutShiftFactor == 0)
-			{
-				newAngle = correctionLUT[windowStartIndex];
-			}
-			else
-			{
-				const uint32_t windowOffset = newAngle & ((1u << resolutionToLutShiftFactor) - 1);
-				if (windowOffset <= (1u << (resolutionToLutShiftFactor - 1)))
-				{
-					newAngle = correctionLUT[windowStartIndex] + windowOffset;
-				}
-				else
-				{
-					// Note that we store an duplicate of correctionLUT[0] at the end to avoid having to wrap when we add 1 to windowStartIndex
-					newAngle = correctionLUT[windowStartIndex + 1] - (1u << resolutionToLutShiftFactor) + windowOffset;
-				}
-				newAngle &= (GetMaxValue() - 1);
-			}
+			const uint32_t startCycles = DWT->CYCCNT;
+			newAngle = CorrectAngle(newAngle);
+			const uint32_t cycles = DWT->CYCCNT - startCycles;
+			lutMaxCycles = max<uint32_t>(lutMaxCycles, cycles);
+			lutTotalCycles += cycles;
+			++lutNumCorrections;
 		}
 
 		if (isBackwards)
@@ -80,6 +67,23 @@ bool AbsoluteRotaryEncoder::TakeReading() noexcept
 	return err;
 }
 
+// Apply the LUT correction to a raw angle. The LUT must be loaded.
+// We interpolate linearly between the corrected angles at the start and end of the LUT window that the raw angle falls in.
+// Note that we store a duplicate of correctionLUT[0] at the end to avoid having to wrap when we add 1 to windowStartIndex.
+uint32_t AbsoluteRotaryEncoder::CorrectAngle(uint32_t angle) const noexcept
+{
+	const size_t windowStartIndex = angle >> resolutionToLutShiftFactor;
+	if (resolutionToLutShiftFactor == 0)
+	{
+		return correctionLUT[windowStartIndex];
+	}
+
+	const uint32_t windowOffset = angle & ((1u << resolutionToLutShiftFactor) - 1);
+	const uint32_t windowSpan = ((uint32_t)correctionLUT[windowStartIndex + 1] - (uint32_t)correctionLUT[windowStartIndex]) & (GetMaxValue() - 1);
+	const uint32_t interpolatedOffset = (windowSpan * windowOffset + (1u << (resolutionToLutShiftFactor - 1))) >> resolutionToLutShiftFactor;
+	return (correctionLUT[windowStartIndex] + interpolatedOffset) & (GetMaxValue() - 1);
+}
+
 // Clear the accumulated full rotations so as to get the count back to a smaller number
 void AbsoluteRotaryEncoder::ClearFullRevs() noexcept
 {
@@ -116,16 +120,17 @@ void AbsoluteRotaryEncoder::PopulateLUT(NonVolatileMemory& mem) noexcept
 {
 	// Read back the table of harmonics from NVRAM and construct the lookup table.
 	// The table maps actual position to encoder reading using the following mapping:
-	//  angleRead = angleExpected + sum[i = 0 to (NumHarmonics - 1)](Si * sin(angleExpected * i) + Ci * cos(angleExpected * i))
+	//  angleRead = angleExpected + sum[i = 1 to numHarmonics](Si * sin(angleExpected * i) + Ci * cos(angleExpected * i))
 	// which we can represent as:
 	//  angleRead = f(angleExpected)
 	// We want the inverse mapping, i.e. angleExpected = g(angleRead) where g is the inverse of f
-	// Start by using the approximation: angleExpected = angleRead - sum[i = 0 to (NumHarmonics - 1)](Si * sin(angleExpected * i) + Ci * cos(angleExpected * i))
+	// Start by using the approximation: angleExpected = angleRead - sum[i = 1 to numHarmonics](Si * sin(angleExpected * i) + Ci * cos(angleExpected * i))
 	// Then iterate until the correction converges or the maximum number of iterations is reached. In tests
 	const size_t LUTLength = GetNumLUTEntries();
 	constexpr unsigned int MaxIterations = 5;
 	unsigned int actualMaxIterationNumber = 0;
-	const NonVolatileMemory::HarmonicDataElement *harmonicData = mem.GetClosedLoopHarmonicValues();
+	float harmonicSines[MaxNumHarmonics - 1], harmonicCosines[MaxNumHarmonics - 1];
+	numStoredHarmonics = mem.GetClosedLoopHarmonics(harmonicSines, harmonicCosines, MaxNumHarmonics - 1, qualityScore);
 	minLUTCorrection = std::numeric_limits<float>::infinity();
 	maxLUTCorrection = -std::numeric_limits<float>::infinity();
 	rmsCorrection = 0.0;
@@ -144,10 +149,10 @@ void AbsoluteRotaryEncoder::PopulateLUT(NonVolatileMemory& mem) noexcept
 			}
 			const float correctionAngle = lastCorrection * TwoPi/GetMaxValue();
 			float correction = 0.0;
-			for (size_t harmonic = 1; harmonic < NumHarmonics; harmonic++)
+			for (size_t harmonic = 1; harmonic <= numStoredHarmonics; harmonic++)
 			{
-				const float sineCoefficient = harmonicData[2 * harmonic - 2].f;
-				const float cosineCoefficient = harmonicData[2 * harmonic - 1].f;
+				const float sineCoefficient = harmonicSines[harmonic - 1];
+				const float cosineCoefficient = harmonicCosines[harmonic - 1];
 				const float angle = harmonic * basicAngle;
 				correction += sineCoefficient * sinf(angle + correctionAngle) + cosineCoefficient * cosf(angle + correctionAngle);
 			}
@@ -187,12 +192,20 @@ void AbsoluteRotaryEncoder::PopulateLUT(NonVolatileMemory& mem) noexcept
 void AbsoluteRotaryEncoder::ClearLUT() noexcept
 {
 	LUTLoaded = false;
+	residualErrorsValid = false;
 }
 
 void AbsoluteRotaryEncoder::ClearDataCollection(size_t p_numDataPoints) noexcept
 {
 	numDataPoints = p_numDataPoints;
-	hysteresisSum = dataSum = dataBias = 0;
+	calibrationPass = 0;
+	forwardSum = reverseSum = 0;
+	halfHysteresis = 0.0;
+	firstPassHysteresisSum = 0;
+	firstPassNumReverseReadings = 0;
+	sumOfDeviationSquares = sumOfRepeatabilitySquares = 0.0;
+	numDeviations = numRepeatabilityReadings = 0;
+	numOutlierReadings = numOutlierPoints = 0;
 	minCalibrationError = std::numeric_limits<float>::infinity();
 	maxCalibrationError = -std::numeric_limits<float>::infinity();
 	calibrationPhase = 0;
@@ -206,47 +219,205 @@ void AbsoluteRotaryEncoder::ScrubLUT() noexcept
 	mem.EnsureWritten();
 }
 
-// Record a data point. The first forwards data point must be index zero, and the first backwards data point must be index (numDataPoints - 1).
+// Record a data point. The first forwards data point of each pass must be index zero, and the first backwards data point must be index (numDataPoints - 1).
+// We may make several passes, in which case we accumulate the readings at each point.
 void AbsoluteRotaryEncoder::RecordDataPoint(size_t index, int32_t data, bool backwards) noexcept
 {
+	if (!backwards && index == 0)
+	{
+		// Starting a new pass
+		if (calibrationPass == 0)
+		{
+			initialCount = data;
+		}
+		else
+		{
+			halfHysteresis = 0.5 * (float)(reverseSum - forwardSum)/(float)(numDataPoints * calibrationPass);
+		}
+		++calibrationPass;
+	}
+
+	data = RejectOutlierReading(index, data - initialCount, backwards);
 	if (backwards)
 	{
-		if (index + 1 == numDataPoints)
+		if (calibrationPass == 1)
 		{
-			// This is the first data point collected during reverse motion.
-			// It sometimes happens that the encoder appears to travel slightly more than a full rotation.
-			// When using a 14-bit encoder and storing signed 16-bit values with two readings per point, this causes the data to overflow.
-			// To avoid this, after collecting the first set of data points we bias the data by subtracting the average value.
-			dataBias = dataSum/(int32_t)numDataPoints;
+			firstPassHysteresisSum += data - calibrationData[index];
+			++firstPassNumReverseReadings;
 		}
-		data -= initialCount;
-		hysteresisSum += data - calibrationData[index];
-		calibrationData[index] = (int16_t)((int32_t)calibrationData[index] + data - dataBias);
+		reverseSum += data;
+		calibrationData[index] += data;
 	}
 	else
 	{
-		if (index == 0)
+		forwardSum += data;
+		calibrationData[index] = (calibrationPass == 1) ? data : calibrationData[index] + data;
+		lastForwardData = data;
+	}
+}
+
+// Check a reading against what we expect it to be. If it is too far out then count it as an outlier and return the expected reading instead.
+// On the first pass we predict each reading from the previous one going forwards, and from the forward reading at the same point going backwards.
+// On later passes we predict each reading from the average of the readings at the same point in the previous passes.
+int32_t AbsoluteRotaryEncoder::RejectOutlierReading(size_t index, int32_t data, bool backwards) noexcept
+{
+	float predicted;
+	if (calibrationPass > 1)
+	{
+		// The readings at this point so far include one more forward reading than reverse readings if we are going backwards
+		const unsigned int readingsSoFar = 2 * (calibrationPass - 1) + ((backwards) ? 1 : 0);
+		const float mean = ((float)calibrationData[index] + ((backwards) ? halfHysteresis : 0.0))/(float)readingsSoFar;
+		predicted = (backwards) ? mean + halfHysteresis : mean - halfHysteresis;
+	}
+	else if (backwards)
+	{
+		if (firstPassNumReverseReadings < MinReadingsForPrediction)
 		{
-			initialCount = data;
+			return data;
 		}
-		data -= initialCount;
-		calibrationData[index] = (int16_t)data;
+		predicted = (float)calibrationData[index] + (float)firstPassHysteresisSum/(float)firstPassNumReverseReadings;
+	}
+	else
+	{
+		if (index < MinReadingsForPrediction)
+		{
+			return data;
+		}
+		predicted = (float)lastForwardData * (float)index/(float)(index - 1);
+	}
+
+	const float deviation = (float)data - predicted;
+	const float rmsDeviation = (numDeviations < MinReadingsForPrediction) ? 0.0 : sqrtf(sumOfDeviationSquares/(float)numDeviations);
+	if (fabsf(deviation) > max<float>(countsPerStep * OutlierReadingThreshold, OutlierReadingFactor * rmsDeviation))
+	{
+		++numOutlierReadings;
+		return lrintf(predicted);
+	}
+
+	sumOfDeviationSquares += fsquare(deviation);
+	++numDeviations;
+	if (calibrationPass > 1)
+	{
+		sumOfRepeatabilitySquares += fsquare(deviation);
+		++numRepeatabilityReadings;
 	}
-	dataSum += data;
+	return data;
 }
 
-// Analyse the calibration data and optionally store it. We have the specified number of data points but we read each point twice, once while rotating forwards and once backwards.
+// Get the average of the readings at a data point, relative to the normalised initial count
+float AbsoluteRotaryEncoder::GetAverageReading(size_t index) const noexcept
+{
+	const int32_t readingsPerPoint = 2 * (int32_t)calibrationPass;
+	return (float)(calibrationData[index] + readingsPerPoint * initialCount)/(float)readingsPerPoint;
+}
+
+// Get the fraction of a revolution that a perfect encoder would report at a data point. The harmonics are functions of this angle, as in PopulateLUT.
+float AbsoluteRotaryEncoder::GetExpectedRevFraction(size_t index, float correctionRevFraction, float rotationDirection) const noexcept
+{
+	return ((float)index/(float)numDataPoints + correctionRevFraction) * rotationDirection;
+}
+
+// Get the reading we would expect at a data point if the encoder were perfect
+float AbsoluteRotaryEncoder::GetExpectedReading(size_t index, float correctionRevFraction, float rotationDirection) const noexcept
+{
+	return GetExpectedRevFraction(index, correctionRevFraction, rotationDirection) * (float)GetMaxValue();
+}
+
+// Fit harmonics 0 to (MaxNumHarmonics - 1) to the calibration errors. Return the mean square error.
+float AbsoluteRotaryEncoder::FitHarmonics(float correctionRevFraction, float rotationDirection, float *sines, float *cosines) noexcept
+{
+	for (size_t i = 0; i < MaxNumHarmonics; ++i)
+	{
+		sines[i] = cosines[i] = 0.0;
+	}
+
+	float minError = std::numeric_limits<float>::infinity();
+	float maxError = -std::numeric_limits<float>::infinity();
+	float sumOfErrorSquares = 0.0;
+	for (size_t i = 0; i < numDataPoints; ++i)
+	{
+		const float revFraction = GetExpectedRevFraction(i, correctionRevFraction, rotationDirection);
+		const float angle = TwoPi * revFraction;
+		const float error = revFraction * (float)GetMaxValue() - GetAverageReading(i);
+		if (error < minError) { minError = error; }
+		if (error > maxError) { maxError = error; }
+		sumOfErrorSquares += fsquare(error);
+
+		for (size_t j = 0; j < MaxNumHarmonics; ++j)
+		{
+			sines[j] += error * sinf(angle * j);
+			cosines[j] += error * cosf(angle * j);
+		}
+	}
+
+	minCalibrationError = minError;
+	maxCalibrationError = maxError;
+	const float meanSquareError = sumOfErrorSquares/(float)numDataPoints;
+	rmsCalibrationError = sqrtf(meanSquareError);
+
+	// Scale the sums to get the coefficients
+	for (size_t harmonic = 0; harmonic < MaxNumHarmonics; harmonic++)
+	{
+		const float scale = (harmonic == 0) ? 1.0/(float)numDataPoints : 2.0/(float)numDataPoints;
+		sines[harmonic] *= scale;
+		cosines[harmonic] *= scale;
+	}
+	return meanSquareError;
+}
+
+// Replace any data points that are too far from the fitted curve by the fitted value and return the number replaced
+unsigned int AbsoluteRotaryEncoder::RejectOutlierPoints(float correctionRevFraction, float rotationDirection, const float *sines, const float *cosines) noexcept
+{
+	// Find the RMS residual
+	float sumOfResidualSquares = 0.0;
+	for (size_t i = 0; i < numDataPoints; ++i)
+	{
+		const float revFraction = GetExpectedRevFraction(i, correctionRevFraction, rotationDirection);
+		const float error = revFraction * (float)GetMaxValue() - GetAverageReading(i);
+		sumOfResidualSquares += fsquare(error - EvaluateHarmonics(TwoPi * revFraction, MaxNumHarmonics, sines, cosines));
+	}
+	const float threshold = max<float>(OutlierPointFactor * sqrtf(sumOfResidualSquares/(float)numDataPoints), MinOutlierPointThreshold);
+
+	unsigned int numRejected = 0;
+	const int32_t readingsPerPoint = 2 * (int32_t)calibrationPass;
+	for (size_t i = 0; i < numDataPoints; ++i)
+	{
+		const float revFraction = GetExpectedRevFraction(i, correctionRevFraction, rotationDirection);
+		const float expected = revFraction * (float)GetMaxValue();
+		const float fitted = EvaluateHarmonics(TwoPi * revFraction, MaxNumHarmonics, sines, cosines);
+		if (fabsf(expected - GetAverageReading(i) - fitted) > threshold)
+		{
+			calibrationData[i] = lrintf((expected - fitted) * (float)readingsPerPoint) - readingsPerPoint * initialCount;
+			++numRejected;
+		}
+	}
+	return numRejected;
+}
+
+// Evaluate the sum of the first numHarmonics harmonics at an expected encoder angle
+float AbsoluteRotaryEncoder::EvaluateHarmonics(float angle, unsigned int numHarmonics, const float *sines, const float *cosines) const noexcept
+{
+	float result = cosines[0];
+	for (size_t harmonic = 1; harmonic < numHarmonics; ++harmonic)
+	{
+		result += sines[harmonic] * sinf(angle * harmonic) + cosines[harmonic] * cosf(angle * harmonic);
+	}
+	return result;
+}
+
+// Analyse the calibration data and optionally store it. We have the specified number of data points but we read each point twice on each pass, once while rotating forwards and once backwards.
 // This takes a long time so it must be called by a low priority task
 TuningErrors AbsoluteRotaryEncoder::Calibrate(bool store) noexcept
 {
-	// dataSum is the sum of all the readings. If it is negative then the encoder is running backwards.
-	const float twiceExpectedMidPointDifference = (float)dataSum/(float)numDataPoints;
+	// The sum of all the readings is negative if the encoder is running backwards
+	const int64_t dataSum = forwardSum + reverseSum;
+	const float twiceExpectedMidPointDifference = (float)dataSum/(float)(numDataPoints * calibrationPass);
 
 	// expectedMidPointDifference should be close to half the encoder counts/rev
 	const float ratio = twiceExpectedMidPointDifference/GetMaxValue();
 	const float rotationDirection = (ratio < 0.0) ? -1.0 : 1.0;
 	measuredCountsPerStep = (twiceExpectedMidPointDifference * rotationDirection)/stepsPerRev;
-	measuredHysteresis = ((float)hysteresisSum * rotationDirection)/((float)numDataPoints * countsPerStep);
+	measuredHysteresis = ((float)(reverseSum - forwardSum) * rotationDirection)/((float)(numDataPoints * calibrationPass) * countsPerStep);
 
 	if (fabsf(ratio) > 1.05)
 	{
@@ -257,14 +428,21 @@ TuningErrors AbsoluteRotaryEncoder::Calibrate(bool store) noexcept
 		return TuningError::TooLittleMotion;
 	}
 
-	// Normalise initialCount to be within -GetMaxValue()..GetMaxValue()
+	// Normalise initialCount to be within -GetMaxValue()..GetMaxValue(). The data is relative to initialCount so we must adjust it too.
+	const int32_t readingsPerPoint = 2 * (int32_t)calibrationPass;
+	const int32_t oldInitialCount = initialCount;
 	initialCount %= (int32_t)GetMaxValue();
 
 	// Further normalise initialCount to keep the angles small, preferably we want the count to cross zero and back.
 	if (dataSum > 0 && initialCount > 0) { initialCount -= (int32_t)GetMaxValue(); }
 	else if (dataSum < 0 && initialCount < 0) { initialCount += (int32_t)GetMaxValue(); }
+	const int32_t dataAdjustment = readingsPerPoint * (oldInitialCount - initialCount);
+	for (size_t i = 0; i < numDataPoints; ++i)
+	{
+		calibrationData[i] += dataAdjustment;
+	}
 
-	const float expectedMidPointReading = twiceExpectedMidPointDifference * 0.5 + (float)initialCount;
+	const float expectedMidPointReading = twiceExpectedMidPointDifference * 0.5 + (float)oldInitialCount;
 	const float revFractionAtMidPoint = (float)(numDataPoints - 1)/(float)(2 * numDataPoints);
 	const float correctionRevFraction = (expectedMidPointReading * rotationDirection)/(float)GetMaxValue() - revFractionAtMidPoint;
 	const float phaseCorrection = correctionRevFraction * (float)GetPhasePositionsPerRev();
@@ -272,79 +450,59 @@ TuningErrors AbsoluteRotaryEncoder::Calibrate(bool store) noexcept
 	if (expectedZeroReadingPhase < 0) { expectedZeroReadingPhase += 4096; }
 
 #ifdef DEBUG
-	debugPrintf("dataSum %" PRIi32 ", empr %.5f, init count %" PRIi32 ", crf %.5f, phase corr %.1f, bias %" PRIi32 ", zrp %" PRIu32 "\n",
-					dataSum, (double)expectedMidPointReading, initialCount, (double)correctionRevFraction, (double)phaseCorrection, dataBias, expectedZeroReadingPhase);
+	debugPrintf("passes %u, empr %.5f, init count %" PRIi32 ", crf %.5f, phase corr %.1f, zrp %" PRIu32 "\n",
+					calibrationPass, (double)expectedMidPointReading, initialCount, (double)correctionRevFraction, (double)phaseCorrection, expectedZeroReadingPhase);
 #endif
 
-	// Now Fourier analyse the data, using the expected zero reading phase to set the angle origin
-	float minError = std::numeric_limits<float>::infinity();
-	float maxError = -std::numeric_limits<float>::infinity();
+	// Now Fourier analyse the data, using the expected zero reading phase to set the angle origin.
+	// Then replace any data points that are a long way from the fitted curve and do it again.
+	float sines[MaxNumHarmonics], cosines[MaxNumHarmonics];
+	float meanSquareError = FitHarmonics(correctionRevFraction, rotationDirection, sines, cosines);
+	numOutlierPoints = RejectOutlierPoints(correctionRevFraction, rotationDirection, sines, cosines);
+	if (numOutlierPoints != 0)
+	{
+		meanSquareError = FitHarmonics(correctionRevFraction, rotationDirection, sines, cosines);
+	}
 
-	// Do a Fourier analysis of the data
-	float sines[NumHarmonics], cosines[NumHarmonics];
-	for (size_t i = 0; i < NumHarmonics; ++i)
+	// Decide how many harmonics to use. The data points are equally spaced, so we can find the residual error using Parseval's theorem.
+	float residualMeanSquare = meanSquareError - fsquare(cosines[0]);
+	for (size_t harmonic = 1; harmonic < DefaultNumHarmonics; ++harmonic)
 	{
-		sines[i] = cosines[i] = 0.0;
+		residualMeanSquare -= 0.5 * (fsquare(sines[harmonic]) + fsquare(cosines[harmonic]));
 	}
-	float rmsErrorAcc = 0.0;
-	float sinSteps = 0.0;
-	float cosSteps = 0.0;
-	for (size_t i = 0; i < numDataPoints; ++i)
+	const float defaultResidual = sqrtf(max<float>(residualMeanSquare, 0.0));
+	numHarmonicsUsed = DefaultNumHarmonics;
+	if (defaultResidual > MinResidualForExtraHarmonics)
 	{
-		const float revFraction = ((float)i/(float)numDataPoints + correctionRevFraction) * rotationDirection;
-		const float angle = TwoPi * revFraction;
-		const float expectedValue = revFraction * (float)(GetMaxValue() * 2);		// *2 because we stored 2 values for each data point
-		const int32_t actualValue = (int32_t)calibrationData[i] + dataBias + (2 * initialCount);
-		const float error = expectedValue - (float)actualValue;
-
-#if 0
-		if ((i & 127) == 0 /*|| fabsf(error) > (float)GetMaxValue()*/)
-		{
-			debugPrintf("exp %.1f calib %" PRIi32 " err %.1f\n", (double)expectedValue, actualValue, (double)error);
-		}
-#endif
-		if (error < minError) { minError = error; }
-		if (error > maxError) { maxError = error; }
-		rmsErrorAcc += fsquare(error);
-
-		for (size_t j = 0; j < NumHarmonics; ++j)
+		const float minAmplitude = max<float>(MinExtraHarmonicAmplitude, ExtraHarmonicResidualFraction * defaultResidual);
+		for (size_t harmonic = DefaultNumHarmonics; harmonic < MaxNumHarmonics; ++harmonic)
 		{
-			sines[j] += error * sinf(angle * j);
-			cosines[j] += error * cosf(angle * j);
+			if (sqrtf(fsquare(sines[harmonic]) + fsquare(cosines[harmonic])) >= minAmplitude)
+			{
+				numHarmonicsUsed = harmonic + 1;
+			}
 		}
-
-		sinSteps += error * sinf(TwoPi * (float)(i * stepsPerRev)/(float)numDataPoints);
-		cosSteps += error * cosf(TwoPi * (float)(i * stepsPerRev)/(float)numDataPoints);
 	}
+	for (size_t harmonic = DefaultNumHarmonics; harmonic < numHarmonicsUsed; ++harmonic)
+	{
+		residualMeanSquare -= 0.5 * (fsquare(sines[harmonic]) + fsquare(cosines[harmonic]));
+	}
+	const float fittedResidual = sqrtf(max<float>(residualMeanSquare, 0.0));
 
-	// We took 2 samples per point, so halve the errors
-	minCalibrationError = 0.5 * minError;
-	maxCalibrationError = 0.5 * maxError;
-
-	// Calculate the RMS error
-	rmsCalibrationError = 0.5 * sqrtf(rmsErrorAcc/numDataPoints);
+	// Calculate the quality score from the residual error, the repeatability between passes and the proportion of outliers
+	const float repeatability = (numRepeatabilityReadings == 0) ? 0.0 : sqrtf(sumOfRepeatabilitySquares/(float)numRepeatabilityReadings);
+	const float outlierFraction = (float)numOutlierReadings/(float)(numDataPoints * readingsPerPoint) + (float)numOutlierPoints/(float)numDataPoints;
+	const float score = 100.0 * (1.0 - min<float>((fittedResidual + repeatability)/(countsPerStep * QualityZeroErrorSteps), 1.0)) * (1.0 - min<float>(outlierFraction * QualityOutlierFactor, 1.0));
+	calibrationQualityScore = (uint8_t)lrintf(score);
 
 #ifdef DEBUG
-	debugPrintf("min/max/rms errors [%.1f %.1f %.1f] sin/cos steps [%.2f %.2f]\nSin/cos coefficients:",
-				(double)minCalibrationError, (double)maxCalibrationError, (double)rmsCalibrationError, (double)(sinSteps/numDataPoints), (double)(cosSteps/numDataPoints));
-#endif
-
-	for (size_t harmonic = 0; harmonic < NumHarmonics; harmonic++)
+	debugPrintf("min/max/rms errors [%.1f %.1f %.1f], residual %.2f with %u harmonics, repeatability %.2f, outliers %u/%u, quality %u\nSin/cos coefficients:",
+				(double)minCalibrationError, (double)maxCalibrationError, (double)rmsCalibrationError, (double)fittedResidual, numHarmonicsUsed,
+				(double)repeatability, numOutlierReadings, numOutlierPoints, calibrationQualityScore);
+	for (size_t harmonic = 0; harmonic < numHarmonicsUsed; harmonic++)
 	{
-		sines[harmonic] /= numDataPoints;
-		if (harmonic == 0)
-		{
-			cosines[harmonic] = 0.5 * cosines[harmonic]/numDataPoints;
-		}
-		else
-		{
-			cosines[harmonic] /= numDataPoints;
-		}
-#ifdef DEBUG
 		debugPrintf(" [%.3f %.3f]", (double)sines[harmonic], (double)cosines[harmonic]);
-#endif
 	}
-#ifdef DEBUG
 	debugPrintf("\n");
 #endif
 
@@ -353,29 +511,85 @@ TuningErrors AbsoluteRotaryEncoder::Calibrate(bool store) noexcept
 		SetCalibrationBackwards(rotationDirection < 0.0);
 
 		// Store the table of harmonics to nonvolatile memory
+		static_assert(MaxNumHarmonics - 1 <= NonVolatileMemory::MaxClosedLoopHarmonics);
 		NonVolatileMemory mem(NvmPage::closedLoop);
-		for (size_t harmonic = 1; harmonic < NumHarmonics; harmonic++)
-		{
-			mem.SetClosedLoopHarmonicValue(harmonic * 2 - 2, sines[harmonic]);
-			mem.SetClosedLoopHarmonicValue(harmonic * 2 - 1, cosines[harmonic]);
-		}
+		mem.SetClosedLoopHarmonics(sines + 1, cosines + 1, numHarmonicsUsed - 1, calibrationQualityScore);
 		mem.SetClosedLoopZeroCountPhaseAndDirection((uint32_t)expectedZeroReadingPhase, (rotationDirection < 0.0));		// this also flags the NVM data as valid
 		mem.EnsureWritten();
 
 		// Populate the LUT from the coefficients
 		PopulateLUT(mem);
+		CalculateResidualErrors(correctionRevFraction, rotationDirection);
 	}
 	return 0;
 }
 
+// Calculate the errors that would remain if the calibration data were corrected using the LUT. Call this after the LUT has been populated from the calibration data.
+// The constant part of the error is taken up by the zero count phase, so we report the errors relative to their mean.
+void AbsoluteRotaryEncoder::CalculateResidualErrors(float correctionRevFraction, float rotationDirection) noexcept
+{
+	float sumOfErrors = 0.0, sumOfErrorSquares = 0.0;
+	float minError = std::numeric_limits<float>::infinity();
+	float maxError = -std::numeric_limits<float>::infinity();
+	for (size_t i = 0; i < numDataPoints; ++i)
+	{
+		const float expectedValue = GetExpectedReading(i, correctionRevFraction, rotationDirection);
+		const float actualValue = GetAverageReading(i);
+		const int32_t actualCount = (int32_t)floorf(actualValue);
+		const uint32_t actualAngle = (uint32_t)actualCount & (GetMaxValue() - 1);
+		int32_t correction = (int32_t)CorrectAngle(actualAngle) - (int32_t)actualAngle;
+		if (correction > (int32_t)(GetMaxValue()/2)) { correction -= (int32_t)GetMaxValue(); }
+		else if (correction < -(int32_t)(GetMaxValue()/2)) { correction += (int32_t)GetMaxValue(); }
+		const float error = expectedValue - (actualValue + (float)correction);
+		if (error < minError) { minError = error; }
+		if (error > maxError) { maxError = error; }
+		sumOfErrors += error;
+		sumOfErrorSquares += fsquare(error);
+	}
+
+	const float meanError = sumOfErrors/(float)numDataPoints;
+	minResidualError = minError - meanError;
+	maxResidualError = maxError - meanError;
+	rmsResidualError = sqrtf(max<float>(sumOfErrorSquares/(float)numDataPoints - fsquare(meanError), 0.0));
+	residualErrorsValid = true;
+}
+
 void AbsoluteRotaryEncoder::AppendLUTCorrections(const StringRef& reply) const noexcept
 {
-	reply.catf("min %.1f, max %.1f, rms %.1f", (double)minLUTCorrection, (double)maxLUTCorrection, (double)rmsCorrection);
+	reply.catf("min %.1f, max %.1f, rms %.1f, %u harmonics", (double)minLUTCorrection, (double)maxLUTCorrection, (double)rmsCorrection, numStoredHarmonics);
+	if (qualityScore != NonVolatileMemory::ClosedLoopQualityUnknown)
+	{
+		reply.catf(", quality score %u", qualityScore);
+	}
+	if (residualErrorsValid)
+	{
+		reply.lcatf("Residual errors after correction: min %.1f, max %.1f, rms %.1f", (double)minResidualError, (double)maxResidualError, (double)rmsResidualError);
+	}
+}
+
+// Append the LUT correction benchmark to a string and reset it
+void AbsoluteRotaryEncoder::AppendLUTBenchmark(const StringRef& reply) noexcept
+{
+	if (lutNumCorrections != 0)
+	{
+		reply.catf(", LUT correction cycles avg=%" PRIu32 " max=%" PRIu32, lutTotalCycles/lutNumCorrections, lutMaxCycles);
+		lutMaxCycles = lutTotalCycles = 0;
+		lutNumCorrections = 0;
+	}
 }
 
 void AbsoluteRotaryEncoder::AppendCalibrationErrors(const StringRef& reply) const noexcept
 {
 	reply.catf("min %.1f, max %.1f, rms %.1f", (double)minCalibrationError, (double)maxCalibrationError, (double)rmsCalibrationError);
+	if (calibrationPass > 1)
+	{
+		reply.catf(", %u passes, repeatability rms %.1f",
+					calibrationPass, (double)((numRepeatabilityReadings == 0) ? 0.0 : sqrtf(sumOfRepeatabilitySquares/(float)numRepeatabilityReadings)));
+	}
+	if (numOutlierReadings != 0 || numOutlierPoints != 0)
+	{
+		reply.catf(", rejected %u outlier readings and %u outlier points", numOutlierReadings, numOutlierPoints);
+	}
 }
 
 #endif
@@ -115,18 +115,49 @@ protected:
 	int32_t fullRotations = 0;				// the number of full rotations counted
 	uint32_t zeroCountPhasePosition = 0;
 
+	// Append the LUT correction benchmark to a string and reset it
+	void AppendLUTBenchmark(const StringRef& reply) noexcept;
+
 	// For diagnostics
 	float minLUTCorrection = 0.0, maxLUTCorrection = 0.0;			// min and max corrections, for reporting in diagnostics
 	float rmsCorrection = 0.0;
 
 private:
-	static constexpr unsigned int NumHarmonics = 10;				// store harmonics 0-9
+	static constexpr unsigned int DefaultNumHarmonics = 10;			// normally use harmonics 0-9
+	static constexpr unsigned int MaxNumHarmonics = 20;				// use up to harmonics 0-19 if the higher ones are significant
 	static constexpr unsigned int LutResolutionBits = 10;
 	static constexpr size_t NumLutEntries = 1ul << LutResolutionBits;
 
+	// Calibration outlier rejection and harmonic selection constants
+	static constexpr unsigned int MinReadingsForPrediction = 16;	// the number of readings needed before we can predict the next one
+	static constexpr float OutlierReadingThreshold = 1.0/16.0;		// a reading is never treated as an outlier if it is within this many full steps of the prediction
+	static constexpr float OutlierReadingFactor = 5.0;				// otherwise it is an outlier if it is further than this multiple of the RMS deviation from the prediction
+	static constexpr float OutlierPointFactor = 4.0;				// a data point is an outlier if it is further than this multiple of the RMS residual from the fitted curve...
+	static constexpr float MinOutlierPointThreshold = 2.0;			// ...and further than this number of counts
+	static constexpr float MinResidualForExtraHarmonics = 1.0;		// only consider using extra harmonics if the RMS residual using the default number is greater than this
+	static constexpr float MinExtraHarmonicAmplitude = 0.5;			// an extra harmonic must have at least this amplitude in counts to be used...
+	static constexpr float ExtraHarmonicResidualFraction = 0.2;		// ...and at least this fraction of the RMS residual using the default number of harmonics
+	static constexpr float QualityZeroErrorSteps = 1.0/8.0;			// the quality score is zero if the residual plus repeatability error is this fraction of a full step
+	static constexpr float QualityOutlierFactor = 10.0;				// the quality score is zero if the proportion of outliers is the reciprocal of this
+
 	// Populate the LUT when we already have the nonvolatile data
 	void PopulateLUT(NonVolatileMemory& mem) noexcept;
 
+	// Apply the LUT correction to a raw angle
+	uint32_t CorrectAngle(uint32_t angle) const noexcept;
+
+	// Calculate the errors remaining after applying the LUT to the calibration data
+	void CalculateResidualErrors(float correctionRevFraction, float rotationDirection) noexcept;
+
+	// Calibration helper functions
+	int32_t RejectOutlierReading(size_t index, int32_t data, bool backwards) noexcept;
+	float GetAverageReading(size_t index) const noexcept;
+	float GetExpectedRevFraction(size_t index, float correctionRevFraction, float rotationDirection) const noexcept;
+	float GetExpectedReading(size_t index, float correctionRevFraction, float rotationDirection) const noexcept;
+	float FitHarmonics(float correctionRevFraction, float rotationDirection, float *sines, float *cosines) noexcept;
+	unsigned int RejectOutlierPoints(float correctionRevFraction, float rotationDirection, const float *sines, const float *cosines) noexcept;
+	float EvaluateHarmonics(float angle, unsigned int numHarmonics, const float *sines, const float *cosines) const noexcept;
+
 	// General variables
 	const unsigned int resolutionBits;								// encoder has (2 ** resolutionShiftFactor) counts/revolution
 	const unsigned int resolutionToLutShiftFactor;					// shift the resolution right by this number of bits to get the LUT resolution
@@ -135,16 +166,39 @@ private:
 	uint16_t correctionLUT[NumLutEntries + 1];						// mapping from raw encoder reading to corrected reading. The extra entry is a duplicate of the first entry.
 	bool LUTLoaded = false;
 	bool isBackwards = false;
+	unsigned int numStoredHarmonics = 0;							// the number of harmonics (excluding harmonic 0) the LUT was built from
+	uint8_t qualityScore = 0xFF;									// the quality score of the calibration the LUT was built from, 0xFF if not known
 
 	// Calibration variables
 	float minCalibrationError = 0.0, maxCalibrationError = 0.0, rmsCalibrationError = 0.0;	// min, max and RMS corrections, for reporting in diagnostics
-	int32_t dataSum;
-	int32_t hysteresisSum;
+	float minResidualError = 0.0, maxResidualError = 0.0, rmsResidualError = 0.0;			// min, max and RMS errors remaining after correction
+	bool residualErrorsValid = false;
+	unsigned int numHarmonicsUsed = DefaultNumHarmonics;			// the number of harmonics (including harmonic 0) found by the most recent calibration
+	uint8_t calibrationQualityScore = 0;							// the quality score of the most recent calibration
+
+	// LUT correction benchmark, in CPU cycles
+	uint32_t lutMaxCycles = 0;
+	uint32_t lutTotalCycles = 0;
+	unsigned int lutNumCorrections = 0;
+
+	// Calibration data collection
+	int64_t forwardSum;												// sum of all readings taken while moving forwards, relative to initialCount
+	int64_t reverseSum;												// sum of all readings taken while moving backwards, relative to initialCount
 	int32_t initialCount;
-	int32_t dataBias;
+	int32_t lastForwardData;										// the most recent forwards reading, used to predict the next one in the first pass
+	int32_t firstPassHysteresisSum;									// sum of the differences between the reverse and forward readings in the first pass
+	unsigned int firstPassNumReverseReadings;
+	float halfHysteresis;											// half the average hysteresis in counts measured in the completed passes
+	float sumOfDeviationSquares;									// sum of the squares of the deviations of accepted readings from their predicted values
+	float sumOfRepeatabilitySquares;								// as above but only for passes after the first
+	unsigned int numDeviations;
+	unsigned int numRepeatabilityReadings;
+	unsigned int numOutlierReadings;								// the number of readings we replaced by their predicted values
+	unsigned int numOutlierPoints;									// the number of data points we replaced by the fitted value
 	size_t numDataPoints;
 	unsigned int calibrationPhase;
-	int16_t calibrationData[MaxCalibrationDataPoints];
+	unsigned int calibrationPass;									// the number of the current pass, starting at 1
+	int32_t calibrationData[MaxCalibrationDataPoints];				// sum of the readings at each point, relative to initialCount
 };
 
 # endif
@@ -125,7 +125,9 @@ public:
 	float GetMeasuredHysteresis() const noexcept { return measuredHysteresis; }
 
 	// Define the maximum number of calibration data points we can store. Currently this is the same for all encoders that support calibration.
-	static constexpr size_t MaxCalibrationDataPoints = 200 * 64;				// support up to 64 data points per full step, uses about 25K RAM
+	// Each point holds the sum of two readings per calibration pass, which can overflow 16 bits, so the points are 32 bits wide. That halves the number we can store in the same RAM,
+	// but 32 points per full step is still far more than we need to fit 20 harmonics per revolution.
+	static constexpr size_t MaxCalibrationDataPoints = 200 * 32;				// support up to 32 data points per full step, uses about 25K RAM
 
 protected:
 	uint32_t stepsPerRev;
@@ -45,6 +45,7 @@ void TLI5012B::AppendDiagnostics(const StringRef &reply) noexcept
 {
 	//TODO
 	reply.cat("TLI5012B diagnostics not implemented");
+	AppendLUTBenchmark(reply);
 }
 
 void TLI5012B::AppendStatus(const StringRef& reply) noexcept
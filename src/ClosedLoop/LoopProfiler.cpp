@@ -0,0 +1,74 @@
+/*
+ * LoopProfiler.cpp
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#include "LoopProfiler.h"
+
+#if SUPPORT_CLOSED_LOOP
+
+#include <cstring>
+
+static constexpr const char *_ecv_array StageNames[] = { "encoder", "motion", "estimation", "control", "set phase", "sampling" };
+static_assert(ARRAY_SIZE(StageNames) == (size_t)LoopProfiler::Stage::numStages);
+
+void LoopProfiler::Reset() noexcept
+{
+	memset(stages, 0, sizeof(stages));
+}
+
+// Append the average and maximum time of each stage on a single line
+void LoopProfiler::AppendSummary(const StringRef& reply) const noexcept
+{
+	const char *_ecv_array separator = "\nControl loop stages avg/max (cycles): ";
+	for (size_t i = 0; i < NumStages; ++i)
+	{
+		const StageData& sd = stages[i];
+		if (sd.numCalls != 0)
+		{
+			reply.catf("%s%s %" PRIu32 "/%" PRIu32, separator, StageNames[i], (uint32_t)(sd.totalCycles/sd.numCalls), sd.maxCycles);
+			separator = ", ";
+		}
+	}
+}
+
+// Append the histogram of each stage, one line per stage.
+// Large counts are rounded to thousands or millions so that the report for a driver always fits in a 500-character reply. Small counts are exact so that rare overruns show up.
+void LoopProfiler::AppendHistograms(const StringRef& reply) const noexcept
+{
+	reply.catf("control loop stage histograms (cycles) <%u", 2u << SmallestBucketBits);
+	for (size_t i = 1; i < NumBuckets - 1; ++i)
+	{
+		reply.catf(" <%u", 2u << (SmallestBucketBits + i));
+	}
+	reply.catf(" >=%u", 1u << (SmallestBucketBits + NumBuckets - 1));
+
+	for (size_t i = 0; i < NumStages; ++i)
+	{
+		const StageData& sd = stages[i];
+		if (sd.numCalls != 0)
+		{
+			reply.lcatf("%s:", StageNames[i]);
+			for (uint32_t count : sd.histogram)
+			{
+				if (count < 10'000)
+				{
+					reply.catf(" %" PRIu32, count);
+				}
+				else if (count < 10'000'000)
+				{
+					reply.catf(" %" PRIu32 "k", count/1000);
+				}
+				else
+				{
+					reply.catf(" %" PRIu32 "M", count/1'000'000);
+				}
+			}
+		}
+	}
+}
+
+#endif
+
+// End
@@ -0,0 +1,70 @@
+/*
+ * LoopProfiler.h
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#ifndef SRC_CLOSEDLOOP_LOOPPROFILER_H_
+#define SRC_CLOSEDLOOP_LOOPPROFILER_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_CLOSED_LOOP
+
+// Class to record the time taken by each stage of the closed loop control loop, in CPU cycles.
+// For each stage we keep the average, the maximum and a histogram with power-of-two bucket sizes.
+// The data is kept until Reset is called, so that rare overruns are not lost between diagnostic reports.
+class LoopProfiler
+{
+public:
+	enum class Stage : uint8_t
+	{
+		encoderReading = 0,		// Encoder::TakeReading, including any LUT correction
+		motion,					// Move::GetCurrentMotion and any feedforward look-ahead
+		estimation,				// the derivative filters or the state observer
+		control,				// ControlMotorCurrents excluding SetMotorPhase
+		setPhase,				// SetMotorPhase
+		sampling,				// CollectSample
+		numStages
+	};
+
+	LoopProfiler() noexcept { Reset(); }
+
+	void Reset() noexcept;
+
+	// Record the number of cycles taken by a stage. This is called from the control loop so it must be fast.
+	void Record(Stage stage, uint32_t cycles) noexcept
+	{
+		StageData& sd = stages[(size_t)stage];
+		if (cycles > sd.maxCycles)
+		{
+			sd.maxCycles = cycles;
+		}
+		sd.totalCycles += cycles;
+		++sd.numCalls;
+		const int bucket = (int)(31 - __builtin_clz(cycles | 1)) - (int)SmallestBucketBits;
+		++sd.histogram[(bucket <= 0) ? 0 : (bucket >= (int)NumBuckets) ? NumBuckets - 1 : bucket];
+	}
+
+	void AppendSummary(const StringRef& reply) const noexcept;
+	void AppendHistograms(const StringRef& reply) const noexcept;
+
+private:
+	static constexpr size_t NumStages = (size_t)Stage::numStages;
+	static constexpr size_t NumBuckets = 8;
+	static constexpr unsigned int SmallestBucketBits = 6;		// the first bucket is for times below (2 << SmallestBucketBits) cycles, the last for times of at least (1 << (SmallestBucketBits + NumBuckets - 1)) cycles
+
+	struct StageData
+	{
+		uint64_t totalCycles;
+		uint32_t maxCycles;
+		uint32_t numCalls;
+		uint32_t histogram[NumBuckets];
+	};
+
+	StageData stages[NumStages];
+};
+
+#endif
+
+#endif /* SRC_CLOSEDLOOP_LOOPPROFILER_H_ */
@@ -0,0 +1,91 @@
+/*
+ * PeriodSpeedEstimator.h
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#ifndef SRC_CLOSEDLOOP_PERIODSPEEDESTIMATOR_H_
+#define SRC_CLOSEDLOOP_PERIODSPEEDESTIMATOR_H_
+
+#include "RepRapFirmware.h"
+#include <Movement/StepTimer.h>
+
+// Class that estimates speed from the time between changes in the count of a relative encoder.
+// At low speeds there are only a few counts in the averaging window of DerivativeAveragingFilter, so its estimate is coarse and often zero.
+// Measuring the time between counts instead gives a useful estimate down to very low speeds.
+// We don't have hardware to timestamp the encoder edges, so we assume that each change happened half way between the readings before and after it.
+// While the count isn't changing, we limit the speed to one count in the time since the last change, so that the estimate decays towards zero when the motor stops.
+// The low speed flag has hysteresis, so that the control loop doesn't keep switching between this estimate and the averaging filter when running at around one count per reading.
+// Speeds are in counts per step clock tick.
+class PeriodSpeedEstimator
+{
+public:
+	PeriodSpeedEstimator() noexcept { Reset(); }
+
+	void Reset() noexcept { initialised = lowSpeed = false; speed = 0.0; }
+
+	// Call this to put a new reading into the estimator
+	void ProcessReading(int32_t count, uint32_t timestamp) noexcept
+	{
+		if (!initialised)
+		{
+			lastCount = count;
+			lastChangeTime = lastReadingTime = timestamp;
+			initialised = true;
+			return;
+		}
+
+		const int32_t countsMoved = count - lastCount;
+		if (countsMoved != 0)
+		{
+			const uint32_t changeTime = lastReadingTime + (timestamp - lastReadingTime)/2;
+			const uint32_t period = changeTime - lastChangeTime;
+			speed = (period == 0 || period > MaxPeriod) ? 0.0 : (float)countsMoved/(float)period;
+			lastChangeTime = changeTime;
+			lastCount = count;
+		}
+		else
+		{
+			const uint32_t timeSinceChange = timestamp - lastChangeTime;
+			if (timeSinceChange > MaxPeriod)
+			{
+				speed = 0.0;
+				lastChangeTime = timestamp - MaxPeriod;						// stop the time since the change overflowing
+			}
+			else if (fabsf(speed) * (float)timeSinceChange > 1.0)
+			{
+				speed = copysignf(1.0/(float)timeSinceChange, speed);
+			}
+		}
+
+		const float countsPerReading = fabsf(speed) * (float)(timestamp - lastReadingTime);
+		if (countsPerReading < EnterLowSpeedCounts)
+		{
+			lowSpeed = true;
+		}
+		else if (countsPerReading > LeaveLowSpeedCounts)
+		{
+			lowSpeed = false;
+		}
+		lastReadingTime = timestamp;
+	}
+
+	// Return true if the speed is low enough that this estimate is better than differencing the counts
+	bool IsLowSpeed() const noexcept { return lowSpeed; }
+
+	float GetSpeed() const noexcept { return speed; }
+
+private:
+	static constexpr uint32_t MaxPeriod = StepTimer::StepClockRate/4;	// if the count hasn't changed for this long then we take the speed to be zero
+	static constexpr float EnterLowSpeedCounts = 0.5;					// we switch to this estimate when the speed falls below this many counts per reading
+	static constexpr float LeaveLowSpeedCounts = 2.0;					// we switch back to the averaging filter when the speed rises above this many counts per reading
+
+	float speed;
+	int32_t lastCount;
+	uint32_t lastChangeTime;
+	uint32_t lastReadingTime;
+	bool initialised;
+	bool lowSpeed;
+};
+
+#endif /* SRC_CLOSEDLOOP_PERIODSPEEDESTIMATOR_H_ */
@@ -20,11 +20,58 @@ void SampleBuffer::Init(size_t p_bytesPerSample) noexcept
 	writePointer = 0;
 	readPointer = 0;
 	tempWritePointer = 0;
+	bytesStored = 0;
 	full = false;
+	compressed = false;
+}
+
+// Initialise the buffer to store variable-length compressed samples.
+// Each sample is stored as a length byte followed by the encoded data. We never split a record across the end of the buffer.
+// Instead, if there may not be room for the largest possible record after the one just written, the next one goes at the start.
+// The reader applies the same rule, so no wrap marker is needed.
+void SampleBuffer::InitCompressed(size_t p_minBytesPerSample, size_t p_maxBytesPerSample) noexcept
+{
+	numBytesPerSample = p_minBytesPerSample;
+	maxRecordLength = p_maxBytesPerSample + 1;
+	limit = sizeof(data);
+	writePointer = 0;
+	readPointer = 0;
+	tempWritePointer = 1;									// leave room for the length byte
+	fieldIndex = 0;
+	recordsWritten = recordsRead = 0;
+	bytesStored = 0;
+	memset(lastValues, 0, sizeof(lastValues));
+	full = badSample = false;
+	compressed = true;
+}
+
+// Return true if there is room to store a compressed sample of the maximum length.
+// This is called by the sampling task, which may preempt the sending task. The sending task only ever frees up space, so it is safe to work on a snapshot.
+bool SampleBuffer::HasRoomForCompressedSample() const noexcept
+{
+	const size_t locReadPointer = readPointer;
+	const size_t locWritePointer = writePointer;
+	return (locWritePointer > locReadPointer) ? true
+			: (locWritePointer < locReadPointer) ? locWritePointer + maxRecordLength <= locReadPointer
+				: recordsWritten == recordsRead;
 }
 
 size_t SampleBuffer::GetSample(uint8_t *dest) noexcept
 {
+	if (compressed)
+	{
+		const size_t length = data[readPointer];
+		memcpy(dest, data + readPointer + 1, length);
+		size_t newReadPointer = readPointer + length + 1;
+		if (newReadPointer + maxRecordLength > limit)
+		{
+			newReadPointer = 0;
+		}
+		readPointer = newReadPointer;
+		++recordsRead;										// update this after readPointer, so that a snapshot taken in between errs on the safe side
+		return length;
+	}
+
 	memcpy(dest, data + readPointer, numBytesPerSample);
 	readPointer += roundedUpBytesPerSample;
 	if (readPointer == limit)
@@ -38,8 +85,26 @@ size_t SampleBuffer::GetSample(uint8_t *dest) noexcept
 // Call this when all the data for a sample has been put to the buffer
 bool SampleBuffer::FinishSample() noexcept
 {
+	if (compressed)
+	{
+		const size_t length = tempWritePointer - writePointer - 1;
+		data[writePointer] = (uint8_t)length;
+		bytesStored += length;
+		fieldIndex = 0;
+		size_t newWritePointer = tempWritePointer;
+		if (newWritePointer + maxRecordLength > limit)
+		{
+			newWritePointer = 0;
+		}
+		writePointer = newWritePointer;
+		tempWritePointer = newWritePointer + 1;
+		++recordsWritten;
+		return true;
+	}
+
 	if (tempWritePointer == writePointer + numBytesPerSample)
 	{
+		bytesStored += numBytesPerSample;
 		tempWritePointer = writePointer + roundedUpBytesPerSample;
 		if (tempWritePointer == limit)
 		{
@@ -24,18 +24,27 @@ public:
 	void PutU32(uint32_t val) noexcept;
 	void PutF16(float val) noexcept;
 	void PutF32(float val) noexcept;
+	void PutDelta(int32_t val) noexcept;
 
 	void Init(size_t p_bytesPerSample) noexcept;
-	bool HasSample() const noexcept { return readPointer != writePointer || full; }
+	void InitCompressed(size_t p_minBytesPerSample, size_t p_maxBytesPerSample) noexcept;
+	bool HasSample() const noexcept { return (compressed) ? recordsWritten != recordsRead : (readPointer != writePointer || full); }
 	size_t GetSample(uint8_t *dest) noexcept;
-	bool IsFull() const noexcept { return full; }
+	size_t GetNextSampleLength() const noexcept;
+	bool IsFull() const noexcept { return (compressed) ? !HasRoomForCompressedSample() : full; }
+	bool IsCompressed() const noexcept { return compressed; }
 	bool HadBadSample() const noexcept { return badSample; }
-	size_t GetBytesPerSample() const noexcept { return numBytesPerSample; }
+	size_t GetBytesPerSample() const noexcept { return numBytesPerSample; }		// in compressed mode this is the minimum
+	uint32_t GetBytesStored() const noexcept { return bytesStored; }
 	bool FinishSample() noexcept;
 
+	static constexpr size_t MaxCompressedFields = 16;								// the timestamp plus one for each CL_RECORD_xxx bit
+
 private:
 	static constexpr size_t DataBufferSize = 2000 * RoundUpToDword(MaxClosedLoopSampleLength);	// When collecting data we can accommodate 2000 samples with up to 38 bytes per sample
 
+	bool HasRoomForCompressedSample() const noexcept;
+
 	alignas(4) uint8_t data[DataBufferSize];	// Ring buffer to store the samples in
 	size_t numBytesPerSample;
 	size_t roundedUpBytesPerSample;
@@ -45,6 +54,15 @@ private:
 	size_t limit;								// the limit for the read/write pointers, to avoid wrapping within a single set of sampled variables
 	bool full = false;
 	bool badSample = false;						// true if we collected data faster than we could send it
+
+	// Additional variables used when storing compressed samples
+	bool compressed = false;					// true if samples are stored as variable-length delta-encoded records
+	size_t maxRecordLength;						// the maximum length of a compressed record including its length byte
+	size_t fieldIndex = 0;						// which field of the current sample we are storing
+	volatile uint32_t recordsWritten = 0;		// only written by the sampling task
+	volatile uint32_t recordsRead = 0;			// only written by the sending task
+	uint32_t bytesStored = 0;					// total number of sample bytes stored since Init, for throughput reporting
+	int32_t lastValues[MaxCompressedFields];	// the values in the previous sample, which the next one is encoded relative to
 };
 
 // All values we put are multiples of 2 bytes long, so it's safe to store 16-bit values directly
@@ -84,4 +102,26 @@ inline void SampleBuffer::PutF32(float val) noexcept
 	tempWritePointer += sizeof(float);
 }
 
+// Store the difference between this value and the same field in the previous sample, as a zigzag-encoded base 128 varint.
+// Each byte holds 7 bits of the value, least significant first, with the top bit set if more bytes follow.
+// Small changes in either direction therefore occupy a single byte.
+inline void SampleBuffer::PutDelta(int32_t val) noexcept
+{
+	const uint32_t delta = (uint32_t)val - (uint32_t)lastValues[fieldIndex];
+	lastValues[fieldIndex++] = val;
+	uint32_t zigzag = (delta << 1) ^ (uint32_t)((int32_t)delta >> 31);
+	while (zigzag >= 0x80)
+	{
+		data[tempWritePointer++] = (uint8_t)(zigzag | 0x80);
+		zigzag >>= 7;
+	}
+	data[tempWritePointer++] = (uint8_t)zigzag;
+}
+
+// Return the length of the next sample. Only valid if there is a sample available.
+inline size_t SampleBuffer::GetNextSampleLength() const noexcept
+{
+	return (compressed) ? data[readPointer] : numBytesPerSample;
+}
+
 #endif /* SRC_CLOSEDLOOP_SAMPLEBUFFER_H_ */
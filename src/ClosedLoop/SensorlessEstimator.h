@@ -0,0 +1,79 @@
+/*
+ * SensorlessEstimator.h
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#ifndef SRC_CLOSEDLOOP_SENSORLESSESTIMATOR_H_
+#define SRC_CLOSEDLOOP_SENSORLESSESTIMATOR_H_
+
+#include "RepRapFirmware.h"
+#include <Movement/StepTimer.h>
+
+// Class to estimate the motor position when the encoder can't be read, so that the axis can keep moving in open loop mode until the encoder recovers or the move finishes.
+// The TMC2160 doesn't measure back EMF in direct mode, so the only driver data available to us is the phase and magnitude of the coil currents, which we command ourselves.
+// A stepper motor driven with sufficient current follows the field with a lag that depends on the load, so while the encoder is working we learn
+// the average lag of the measured position behind the commanded position and the relationship between the motor position and the electrical phase.
+// When the encoder fails we drive the field to the commanded position and estimate that the motor lags it by the learned amount.
+// Positions are in full steps.
+class SensorlessEstimator
+{
+public:
+	SensorlessEstimator() noexcept { Reset(); ResetStatistics(); }
+
+	void Reset() noexcept { valid = false; lag = 0.0; phaseOffset = 0; }
+
+	// Call this with each good encoder reading
+	void ProcessReading(float commandedPosition, float measuredPosition, uint32_t measuredPhase, StepTimer::Ticks ticks) noexcept
+	{
+		const float positionError = commandedPosition - measuredPosition;
+		if (valid)
+		{
+			// Measure how far the estimate we would have made from the lag learned so far is from the measured position
+			const float divergence = fabsf(positionError - lag);
+			if (divergence > maxDivergence)
+			{
+				maxDivergence = divergence;
+			}
+			sumOfDivergenceSquares += fsquare(divergence);
+			++numDivergenceSamples;
+			lag = constrain<float>(lag + (positionError - lag) * min<float>((float)ticks * (1.0/(float)LagTimeConstantTicks), 1.0), -MaxLag, MaxLag);
+		}
+		else
+		{
+			lag = constrain<float>(positionError, -MaxLag, MaxLag);
+			valid = true;
+		}
+		phaseOffset = (uint16_t)(measuredPhase - (uint32_t)llrintf(measuredPosition * 1024.0)) % 4096u;
+	}
+
+	// Return true if we have had at least one good encoder reading, so that we can make estimates
+	bool IsValid() const noexcept { return valid; }
+
+	// Return the estimated motor position when the field is at the commanded position
+	float GetEstimatedPosition(float commandedPosition) const noexcept { return commandedPosition - lag; }
+
+	// Return the electrical phase corresponding to the commanded position
+	uint16_t GetFieldPhase(float commandedPosition) const noexcept { return (uint16_t)((uint32_t)llrintf(commandedPosition * 1024.0) + phaseOffset) % 4096u; }
+
+	float GetLag() const noexcept { return lag; }
+
+	// Return the divergence between the estimated and measured positions since the statistics were last reset
+	float GetMaxDivergence() const noexcept { return maxDivergence; }
+	float GetRmsDivergence() const noexcept { return (numDivergenceSamples == 0) ? 0.0 : sqrtf(sumOfDivergenceSquares/(float)numDivergenceSamples); }
+	void ResetStatistics() noexcept { maxDivergence = sumOfDivergenceSquares = 0.0; numDivergenceSamples = 0; }
+
+private:
+	static constexpr StepTimer::Ticks LagTimeConstantTicks = StepTimer::StepClockRate/20;	// the time constant of the lag filter
+	static constexpr float MaxLag = 1.0;									// if a stepper motor lags the field by more than this many full steps then it loses position
+
+	float lag;																// the filtered position error
+	uint16_t phaseOffset;													// the electrical phase when the motor position is zero
+	bool valid;
+
+	float maxDivergence;													// the largest difference between the estimated and measured positions
+	float sumOfDivergenceSquares;
+	unsigned int numDivergenceSamples;
+};
+
+#endif /* SRC_CLOSEDLOOP_SENSORLESSESTIMATOR_H_ */
@@ -0,0 +1,77 @@
+/*
+ * StateObserver.h
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#ifndef SRC_CLOSEDLOOP_STATEOBSERVER_H_
+#define SRC_CLOSEDLOOP_STATEOBSERVER_H_
+
+#include "RepRapFirmware.h"
+
+// Class that estimates position, velocity and acceleration from timestamped position readings.
+// This is a fading-memory alpha-beta-gamma filter (also known as a g-h-k filter). Unlike DerivativeAveragingFilter it predicts
+// the state forward to each new reading, so its velocity estimate does not lag by half the averaging window.
+// All three gains are derived from a single memory factor theta in the range 0 to 1. Larger values give more smoothing and more lag.
+// Velocity and acceleration are per step clock tick and per step clock tick squared, to match DerivativeAveragingFilter.
+class StateObserver
+{
+public:
+	StateObserver() noexcept { SetMemoryFactor(DefaultMemoryFactor); Reset(); }
+
+	void Reset() noexcept { initialised = false; position = velocity = acceleration = 0.0; }
+
+	void SetMemoryFactor(float theta) noexcept
+	{
+		memoryFactor = theta;
+		const float oneMinusTheta = 1.0 - theta;
+		g = 1.0 - theta * theta * theta;
+		h = 1.5 * oneMinusTheta * oneMinusTheta * (1.0 + theta);
+		k = 0.5 * oneMinusTheta * oneMinusTheta * oneMinusTheta;
+	}
+
+	// Call this to put a new reading into the observer
+	void ProcessReading(float reading, uint32_t timestamp) noexcept
+	{
+		if (!initialised)
+		{
+			position = reading;
+			velocity = acceleration = 0.0;
+			lastTimestamp = timestamp;
+			initialised = true;
+			return;
+		}
+
+		const uint32_t timestampDelta = timestamp - lastTimestamp;
+		if (timestampDelta == 0)
+		{
+			return;
+		}
+		lastTimestamp = timestamp;
+
+		const float dt = (float)timestampDelta;
+		const float predictedPosition = position + (velocity + 0.5 * acceleration * dt) * dt;
+		const float residualPerTick = (reading - predictedPosition)/dt;
+		position = predictedPosition + g * residualPerTick * dt;
+		velocity += acceleration * dt + h * residualPerTick;
+		acceleration += 2.0 * k * residualPerTick/dt;
+	}
+
+	float GetMemoryFactor() const noexcept { return memoryFactor; }
+	float GetPosition() const noexcept { return position; }
+	float GetVelocity() const noexcept { return velocity; }
+	float GetAcceleration() const noexcept { return acceleration; }
+
+	static constexpr float DefaultMemoryFactor = 0.8;
+
+private:
+	float position;
+	float velocity;
+	float acceleration;
+	float memoryFactor;
+	float g, h, k;
+	uint32_t lastTimestamp;
+	bool initialised;
+};
+
+#endif /* SRC_CLOSEDLOOP_STATEOBSERVER_H_ */
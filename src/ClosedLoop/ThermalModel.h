@@ -0,0 +1,75 @@
+/*
+ * ThermalModel.h
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#ifndef SRC_CLOSEDLOOP_THERMALMODEL_H_
+#define SRC_CLOSEDLOOP_THERMALMODEL_H_
+
+#include "RepRapFirmware.h"
+#include <Movement/StepTimer.h>
+
+// Class to estimate the heating of a motor or driver from the current applied to it, using a first order thermal model.
+// The input is the square of the current as a fraction of the configured current, so the steady state heat is the mean square current fraction.
+// The limit is the square of the current fraction that can be applied continuously. Short bursts above that current are allowed until the heat approaches the limit,
+// after which we reduce the current that may be applied until it is down to the continuous current when the limit is reached.
+class ThermalModel
+{
+public:
+	ThermalModel() noexcept { Configure(1.0, 1.0); Reset(); }
+
+	// Set the time constant in seconds and the continuous current as a fraction of the configured current. The estimated heat is retained.
+	void Configure(float timeConstant, float continuousFraction) noexcept
+	{
+		recipTimeConstantTicks = 1.0/(timeConstant * (float)StepTimer::StepClockRate);
+		continuousCurrentFraction = continuousFraction;
+		limit = fsquare(continuousFraction);
+		recipLimit = 1.0/limit;
+	}
+
+	void Reset() noexcept { heat = 0.0; peakUsage = 0.0; }
+
+	// Update the model with the current fraction that was applied for the specified time
+	void Update(float currentFraction, StepTimer::Ticks ticks) noexcept
+	{
+		heat += (fsquare(currentFraction) - heat) * min<float>((float)ticks * recipTimeConstantTicks, 1.0);
+		const float usage = GetUsage();
+		if (usage > peakUsage)
+		{
+			peakUsage = usage;
+		}
+	}
+
+	// Return the fraction of the thermal budget that has been used
+	float GetUsage() const noexcept { return heat * recipLimit; }
+
+	// Return the highest current fraction that may be applied now. This reduces linearly from 1.0 to the continuous current as the usage rises from ThrottleStart to 1.0.
+	float GetAllowedCurrentFraction() const noexcept
+	{
+		const float throttle = constrain<float>((GetUsage() - ThrottleStart) * (1.0/(1.0 - ThrottleStart)), 0.0, 1.0);
+		return 1.0 - (1.0 - continuousCurrentFraction) * throttle;
+	}
+
+	float GetContinuousCurrentFraction() const noexcept { return continuousCurrentFraction; }
+
+	// Return the peak usage since this was last called
+	float GetAndClearPeakUsage() noexcept
+	{
+		const float ret = peakUsage;
+		peakUsage = GetUsage();
+		return ret;
+	}
+
+private:
+	static constexpr float ThrottleStart = 0.8;				// the fraction of the thermal budget at which we start to reduce the allowed current
+
+	float heat;												// the estimated mean square current fraction, which is proportional to the temperature rise
+	float peakUsage;										// the highest value of GetUsage since the last diagnostics report
+	float limit;											// the mean square current fraction that may be sustained indefinitely
+	float recipLimit;
+	float continuousCurrentFraction;						// the square root of limit
+	float recipTimeConstantTicks;							// the reciprocal of the time constant in step clocks
+};
+
+#endif /* SRC_CLOSEDLOOP_THERMALMODEL_H_ */
@@ -4,6 +4,7 @@
 #if SUPPORT_CLOSED_LOOP
 
 #include "Encoders/Encoder.h"
+#include <cstring>
 
 # if SUPPORT_TMC2160
 #  include "Movement/StepperDrivers/TMC51xx.h"
@@ -214,18 +215,23 @@ bool ClosedLoop::BasicTuning(bool firstIteration) noexcept
  * Absolute:
  * 	- Move forwards somewhat (to counter any backlash) and then to the next full step position (to give (hopefully) consistent results)
  * 	- Move forwards at a constant rate. At each position, take the current encoder reading and update the Fourier coefficients
+ * 	- If more than one pass was requested, move back past the start position and forwards again (to counter backlash) and repeat
  * 	- Store the Fourier coefficients in the encoder LUT
  */
 
 bool ClosedLoop::EncoderCalibration(bool firstIteration) noexcept
 {
-	enum class EncoderCalibrationState { setup = 0, forwards, backwards };
+	enum class EncoderCalibrationState { setup = 0, forwards, backwards, turnaround };
 
 	static EncoderCalibrationState state = EncoderCalibrationState::setup;
 	static uint32_t positionsPerRev;			// this gets set to 1024 * the number of full steps per revolution, i.e. 204800 or 409600
 	static uint32_t positionsTillStart;			// the position we advance to before we start tuning proper
-	static unsigned int phaseIncrementShift;	// we increase the phase position by one << this value for each sample
+	static unsigned int phaseIncrementShift;	// we increase the phase position by one << this value for each tuning step
+	static unsigned int recordShift;			// we record a data point every time the phase position increases by one << this value
 	static uint32_t positionCounter;			// how many positions we have moved
+	static unsigned int passesDone;				// how many forward and reverse passes we have completed
+
+	const uint32_t TurnaroundPositions = 256;	// how far we move back past the start position between passes
 
 	if (!encoder->UsesCalibration())
 	{
@@ -239,14 +245,17 @@ bool ClosedLoop::EncoderCalibration(bool firstIteration) noexcept
 		// Set up some variables
 		positionsPerRev = ClosedLoop::encoder->GetPhasePositionsPerRev();
 
-		// Decide how many phase positions to advance at a time. This is down to the steps/rev ands the size of our calibration data storage array.
-		phaseIncrementShift = 0;
-		while ((positionsPerRev >> phaseIncrementShift) > Encoder::MaxCalibrationDataPoints)
+		// Decide how many phase positions to advance between data points. This is down to the steps/rev ands the size of our calibration data storage array.
+		// We move the motor in steps of half this size, to avoid moving it too fast.
+		recordShift = 1;
+		while ((positionsPerRev >> recordShift) > Encoder::MaxCalibrationDataPoints)
 		{
-			++phaseIncrementShift;
+			++recordShift;
 		}
+		phaseIncrementShift = recordShift - 1;
 
-		ClosedLoop::encoder->ClearDataCollection(positionsPerRev >> phaseIncrementShift);
+		ClosedLoop::encoder->ClearDataCollection(positionsPerRev >> recordShift);
+		passesDone = 0;
 
 		// If calibrating (not checking), clear the mapping table
 		if (ClosedLoop::tuning & ClosedLoop::ENCODER_CALIBRATION_MANOEUVRE)
@@ -266,6 +275,7 @@ bool ClosedLoop::EncoderCalibration(bool firstIteration) noexcept
 	}
 
 	const int32_t currentCount = ClosedLoop::encoder->GetCurrentShaftCount();
+	const uint32_t recordMask = (1u << recordShift) - 1;
 
 	switch (state)
 	{
@@ -285,9 +295,9 @@ bool ClosedLoop::EncoderCalibration(bool firstIteration) noexcept
 
 	case EncoderCalibrationState::forwards:
 		// Advancing slowly and recording positions
-		if (positionCounter < positionsPerRev)
+		if (positionCounter < positionsPerRev && (positionCounter & recordMask) == 0)
 		{
-			ClosedLoop::encoder->RecordDataPoint(positionCounter >> phaseIncrementShift, currentCount, false);
+			ClosedLoop::encoder->RecordDataPoint(positionCounter >> recordShift, currentCount, false);
 		}
 
 		// Move to the next position. After a complete revolution we continue another 256 positions without recording data, ready for the reverse pass.
@@ -300,15 +310,23 @@ bool ClosedLoop::EncoderCalibration(bool firstIteration) noexcept
 		break;
 
 	case EncoderCalibrationState::backwards:
-		if (positionCounter < positionsPerRev)
+		if (positionCounter < positionsPerRev && (positionCounter & recordMask) == 0)
 		{
-			ClosedLoop::encoder->RecordDataPoint(positionCounter >> phaseIncrementShift, currentCount, true);
+			ClosedLoop::encoder->RecordDataPoint(positionCounter >> recordShift, currentCount, true);
 
 			if (positionCounter == 0)
 			{
-				// We are finished
-				ClosedLoop::ReadyToCalibrate(ClosedLoop::tuning & ClosedLoop::ENCODER_CALIBRATION_MANOEUVRE);
-				return true;
+				++passesDone;
+				if (passesDone >= calibrationPasses)
+				{
+					// We are finished
+					ClosedLoop::ReadyToCalibrate(ClosedLoop::tuning & ClosedLoop::ENCODER_CALIBRATION_MANOEUVRE);
+					return true;
+				}
+
+				// Go round again
+				state = EncoderCalibrationState::turnaround;
+				break;
 			}
 		}
 
@@ -316,6 +334,24 @@ bool ClosedLoop::EncoderCalibration(bool firstIteration) noexcept
 		ClosedLoop::SetMotorPhase(currentPosition - (1u << phaseIncrementShift), 1.0);
 		positionCounter -= 1u << phaseIncrementShift;
 		break;
+
+	case EncoderCalibrationState::turnaround:
+		// Move back past the start position and then forwards to it again, so that backlash affects the next forward pass in the same way as the first one
+		if (positionCounter < TurnaroundPositions)
+		{
+			ClosedLoop::SetMotorPhase(currentPosition - (1u << phaseIncrementShift), 1.0);
+		}
+		else
+		{
+			ClosedLoop::SetMotorPhase(currentPosition + (1u << phaseIncrementShift), 1.0);
+		}
+		positionCounter += 1u << phaseIncrementShift;
+		if (positionCounter == 2 * TurnaroundPositions)
+		{
+			positionCounter = 0;
+			state = EncoderCalibrationState::forwards;
+		}
+		break;
 	}
 	return false;
 }
@@ -357,6 +393,91 @@ bool ClosedLoop::Step(bool firstIteration) noexcept
 }
 
 
+/*
+ * Cogging Calibration
+ * -------------
+ *
+ * Absolute:
+ * Relative:
+ *  - With closed loop control running, move the target position slowly forwards by a whole number of electrical cycles and back again
+ *  - ignore the readings taken during the first full step in each direction, to allow the position error and the I term to settle
+ *  - accumulate the PID control signal needed to hold the target position into bins indexed by the measured electrical phase, separately on the forward and the reverse movements
+ *  - when the movement is complete, ClosedLoop::ProcessCoggingCalibrationResult builds the compensation table from the bins and saves it
+ *
+ *  We index by electrical phase rather than by mechanical position because that is where the cogging torque of a hybrid stepper motor comes from,
+ *  and because it means the table remains valid with relative encoders after the next basic tuning.
+ */
+
+bool ClosedLoop::CoggingCalibration(bool firstIteration) noexcept
+{
+	enum class CoggingCalibrationManoeuvreState { forwardInitial = 0, forwards, reverseInitial, reverse };
+
+	static CoggingCalibrationManoeuvreState state;					// state machine control
+	static unsigned int stepCounter;								// a counter to use within a state
+
+	const float StepIncrement = 1.0/128.0;							// how far we move the target on each tuning step, in full steps
+	const unsigned int NumSettlingSteps = 128;						// move 1 full step before we start collecting data
+	const unsigned int NumSamplingSteps = 128 * 4 * 16;				// collect data over 16 electrical cycles
+	const float MaxPositionError = 0.5;								// abandon calibration if the position error exceeds this number of full steps
+
+	if (firstIteration)
+	{
+		state = CoggingCalibrationManoeuvreState::forwardInitial;
+		stepCounter = 0;
+		coggingCompensationEnabled = false;							// we need to measure the raw cogging
+		memset(coggingSums, 0, sizeof(coggingSums));
+		memset(coggingCounts, 0, sizeof(coggingCounts));
+		coggingCalibrationState = CoggingCalibrationState::notReady;
+	}
+
+	if (fabsf(currentPositionError) > MaxPositionError)
+	{
+		FinishedCoggingCalibration(false);
+		return true;
+	}
+
+	switch (state)
+	{
+	case CoggingCalibrationManoeuvreState::forwardInitial:
+	case CoggingCalibrationManoeuvreState::reverseInitial:
+		// In these states we move a little to allow the motor to settle down
+		AdjustTargetMotorSteps((state == CoggingCalibrationManoeuvreState::forwardInitial) ? StepIncrement : -StepIncrement);
+		++stepCounter;
+		if (stepCounter == NumSettlingSteps)
+		{
+			stepCounter = 0;
+			state = (state == CoggingCalibrationManoeuvreState::forwardInitial) ? CoggingCalibrationManoeuvreState::forwards : CoggingCalibrationManoeuvreState::reverse;
+		}
+		break;
+
+	case CoggingCalibrationManoeuvreState::forwards:
+	case CoggingCalibrationManoeuvreState::reverse:
+		{
+			// Record the control signal produced by the most recent reading, then move on
+			const bool backwards = (state == CoggingCalibrationManoeuvreState::reverse);
+			const size_t index = (encoder->GetCurrentPhasePosition() % 4096u)/CoggingPhasesPerEntry;
+			coggingSums[backwards][index] += PIDControlSignal;
+			++coggingCounts[backwards][index];
+
+			AdjustTargetMotorSteps((backwards) ? -StepIncrement : StepIncrement);
+			++stepCounter;
+			if (stepCounter == NumSamplingSteps)
+			{
+				if (backwards)
+				{
+					FinishedCoggingCalibration(true);
+					return true;
+				}
+				stepCounter = 0;
+				state = CoggingCalibrationManoeuvreState::reverseInitial;
+			}
+		}
+		break;
+	}
+	return false;
+}
+
+
 /*
  * Ziegler Nichols Manoeuvre
  * -------------
@@ -547,6 +668,14 @@ void ClosedLoop::PerformTune() noexcept
 			}
 		}
 	}
+	else if (tuning & COGGING_CALIBRATION_MANOEUVRE)
+	{
+		newTuningMove = CoggingCalibration(newTuningMove);
+		if (newTuningMove)
+		{
+			tuning = 0;
+		}
+	}
 	else if (tuning & STEP_MANOEUVRE)
 	{
 		newTuningMove = Step(newTuningMove);
@@ -7,6 +7,7 @@
 
 #include "CommandProcessor.h"
 #include <CAN/CanInterface.h>
+#include <CAN/CanTrafficProfiler.h>
 #include <CanMessageBuffer.h>
 #include <Heating/Heat.h>
 #include <Fans/FansManager.h>
@@ -594,7 +595,8 @@ static GCodeResult HandleSetDriverStates(const CanMessageMultipleDrivesRequest<D
 {
 	//TODO check message is long enough for the number of drivers specified
 	const auto drivers = Bitmap<uint16_t>::MakeFromRaw(msg.driversToUpdate);
-	drivers.Iterate([&msg](unsigned int driver, unsigned int count) -> void
+	bool anyDisabled = false;
+	drivers.Iterate([&msg, &anyDisabled](unsigned int driver, unsigned int count) -> void
 		{
 			switch (msg.values[count].mode)
 			{
@@ -611,10 +613,15 @@ static GCodeResult HandleSetDriverStates(const CanMessageMultipleDrivesRequest<D
 				{
 					const uint16_t delay = msg.values[count].idlePercentOrDelayAfterBrakeOn;
 					Platform::DisableDrive(driver, (delay == 0) ? DefaultDelayAfterBrakeOn : delay);
+					anyDisabled = true;
 				}
 				break;
 			}
 		});
+	if (anyDisabled)
+	{
+		CanInterface::ResyncMoves();			// the main board has stopped movement, so the movement message sequence may restart
+	}
 	return GCodeResult::ok;
 }
 
@@ -727,7 +734,7 @@ static GCodeResult InitiateReset(const CanMessageReset& msg, const StringRef& re
 
 static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& reply, uint8_t& extra)
 {
-	static constexpr uint8_t LastDiagnosticsPart = 7;				// the last diagnostics part is typeDiagnosticsPart0 + 7
+	static constexpr uint8_t LastDiagnosticsPart = 12;				// the last diagnostics part is typeDiagnosticsPart0 + 12
 
 	switch (msg.type)
 	{
@@ -923,6 +930,35 @@ static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& rep
 #endif
 #if SUPPORT_DRIVERS
 		FilamentMonitor::GetDiagnostics(reply);
+#endif
+		break;
+
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + 8:
+		extra = LastDiagnosticsPart;
+		CanInterface::TrafficDiagnostics(reply);
+		break;
+
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + 9:
+		extra = LastDiagnosticsPart;
+		CanInterface::CommandQueueDiagnostics(reply);
+		break;
+
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + 10:
+		extra = LastDiagnosticsPart;
+		CanTrafficProfiler::Diagnostics(reply);
+		break;
+
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + 11:
+		extra = LastDiagnosticsPart;
+#if SUPPORT_CLOSED_LOOP
+		ClosedLoop::ControlDiagnostics(reply);
+#endif
+		break;
+
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + 12:
+		extra = LastDiagnosticsPart;
+#if SUPPORT_CLOSED_LOOP
+		ClosedLoop::MonitoringDiagnostics(reply);
 #endif
 		break;
 	}
@@ -10,6 +10,7 @@
 
 #include <RepRapFirmware.h>
 #include <Hardware/IoPorts.h>
+#include <CAN/StatusReportFilter.h>
 
 class GCodeBuffer;
 class CanMessageFanParameters;
@@ -39,6 +40,7 @@ public:
 
 	void SetPwm(float speed) noexcept;
 	bool HasMonitoredSensors() const noexcept { return !sensorsMonitored.IsEmpty(); }
+	StatusReportFilter& GetReportFilter() noexcept { return reportFilter; }	// get the record of what we last broadcast for this fan
 
 protected:
 	virtual void Refresh(bool checkSensors) noexcept = 0;
@@ -54,6 +56,7 @@ protected:
 	float triggerTemperatures[2];
 	uint32_t blipTime;										// in milliseconds
 	SensorsBitmap sensorsMonitored;
+	StatusReportFilter reportFilter;
 };
 
 #endif /* SRC_FAN_H_ */
@@ -165,8 +165,12 @@ void FansManager::Init()
 }
 
 // Construct a fan RPM report message. Returns the number of fans reported in it.
-unsigned int FansManager::PopulateFansReport(CanMessageFansReport& msg)
+// Add the fans whose PWM or RPM has changed since we last reported them to the fans report, or all fans if this is a full snapshot.
+// Return the number of fans reported and add the number not reported to numUnchanged.
+unsigned int FansManager::PopulateFansReport(CanMessageFansReport& msg, bool fullSnapshot, unsigned int& numUnchanged)
 {
+	constexpr float RpmReportDeadband = 50.0;				// we report a change in RPM only if it is at least this much
+
 	ReadLocker locker(fansLock);
 
 	msg.whichFans = 0;
@@ -175,10 +179,19 @@ unsigned int FansManager::PopulateFansReport(CanMessageFansReport& msg)
 	{
 		if (f != nullptr)
 		{
-			msg.fanReports[numReported].actualPwm = (uint16_t)(f->GetLastVal() * 65535);
-			msg.fanReports[numReported].rpm = f->GetRPM();
-			msg.whichFans |= (uint64_t)1 << f->GetNumber();
-			++numReported;
+			const float pwm = f->GetLastVal();
+			const int32_t rpm = f->GetRPM();
+			if (f->GetReportFilter().NeedsReport((float)rpm, RpmReportDeadband, (uint32_t)lrintf(pwm * 255.0), fullSnapshot))
+			{
+				msg.fanReports[numReported].actualPwm = (uint16_t)(pwm * 65535);
+				msg.fanReports[numReported].rpm = rpm;
+				msg.whichFans |= (uint64_t)1 << f->GetNumber();
+				++numReported;
+			}
+			else
+			{
+				++numUnchanged;
+			}
 		}
 	}
 	return numReported;
@@ -24,7 +24,7 @@ namespace FansManager
 	GCodeResult ConfigureFanPort(const CanMessageGeneric& msg, const StringRef& reply);
 	GCodeResult ConfigureFan(const CanMessageFanParameters& gb, const StringRef& reply);
 	GCodeResult SetFanSpeed(const CanMessageSetFanSpeed& msg, const StringRef& reply);
-	unsigned int PopulateFansReport(CanMessageFansReport& msg);
+	unsigned int PopulateFansReport(CanMessageFansReport& msg, bool fullSnapshot, unsigned int& numUnchanged);
 #if 0
 	void SetFanValue(uint32_t fanNum, float speed);
 #endif
@@ -40,7 +40,7 @@ void NonVolatileMemory::EnsureRead() noexcept
 #else
 # error Unsupported processor
 #endif
-		if (buffer.commonPage.magic != GetMagicValue())
+		if (buffer.commonPage.magic != GetMagicValue() && !(page == NvmPage::closedLoop && buffer.commonPage.magic == CompactClosedLoopMagic))
 		{
 //			debugPrintf("Invalid user area\n");
 			memset(&buffer, 0xFF, sizeof(buffer));
@@ -209,7 +209,8 @@ void NonVolatileMemory::SetClosedLoopCalibrationDataNotValid()
 		// Set the data to all 0xFF so that we will be able to write it without erasing again
 		buffer.closedLoopPage.calibrationNotValid = true;
 		buffer.closedLoopPage.quadratureDirectionNotValid = true;
-		buffer.closedLoopPage.unusedAllOnes = 0x3FFF;
+		buffer.closedLoopPage.harmonicsNotCompact = true;
+		buffer.closedLoopPage.unusedAllOnes = 0x0FFF;
 		buffer.closedLoopPage.magneticEncoderZeroCountPhase = 0xFFFFFFFF;
 		buffer.closedLoopPage.magneticEncoderBackwards = true;
 		buffer.closedLoopPage.quadratureEncoderBackwards = true;
@@ -222,25 +223,79 @@ void NonVolatileMemory::SetClosedLoopCalibrationDataNotValid()
 	}
 }
 
-const NonVolatileMemory::HarmonicDataElement *NonVolatileMemory::GetClosedLoopHarmonicValues() noexcept
+// Get the encoder calibration harmonics, starting at harmonic 1, and the calibration quality score. Return the number of harmonics retrieved.
+// Check that the data is flagged as valid before calling this.
+unsigned int NonVolatileMemory::GetClosedLoopHarmonics(float *sines, float *cosines, unsigned int maxHarmonics, uint8_t& qualityScore) noexcept
 {
 	EnsureRead();
-	return buffer.closedLoopPage.harmonicData;
+	if (buffer.closedLoopPage.harmonicsNotCompact)
+	{
+		// The data was stored by older firmware as pairs of floats
+		const unsigned int numHarmonics = min<unsigned int>(maxHarmonics, ClosedLoopPage::NumLegacyHarmonics);
+		for (size_t i = 0; i < numHarmonics; ++i)
+		{
+			sines[i] = buffer.closedLoopPage.harmonicData[2 * i].f;
+			cosines[i] = buffer.closedLoopPage.harmonicData[2 * i + 1].f;
+		}
+		qualityScore = ClosedLoopQualityUnknown;
+		return numHarmonics;
+	}
+
+	const CompactHarmonicData& data = buffer.closedLoopPage.compactHarmonicData;
+	const unsigned int numHarmonics = min<unsigned int>(maxHarmonics, min<unsigned int>(data.numHarmonics, MaxClosedLoopHarmonics));
+	for (size_t i = 0; i < numHarmonics; ++i)
+	{
+		sines[i] = (float)data.coefficients[2 * i] * data.scale;
+		cosines[i] = (float)data.coefficients[2 * i + 1] * data.scale;
+	}
+	qualityScore = data.qualityScore;
+	return numHarmonics;
 }
 
-void NonVolatileMemory::SetClosedLoopHarmonicValue(size_t index, float value) noexcept
+// Set the encoder calibration harmonics, starting at harmonic 1, and the calibration quality score.
+// This does not flag the data as valid, so call SetClosedLoopZeroCountPhaseAndDirection after calling this.
+void NonVolatileMemory::SetClosedLoopHarmonics(const float *sines, const float *cosines, unsigned int numHarmonics, uint8_t qualityScore) noexcept
 {
 	EnsureRead();
-	const float oldValue = buffer.closedLoopPage.harmonicData[index].f;
-	if (oldValue != value)
+
+	// Scale the coefficients so that the largest one uses the full range of an int16_t
+	float maxCoefficient = 0.0;
+	for (size_t i = 0; i < numHarmonics; ++i)
 	{
-		buffer.closedLoopPage.calibrationNotValid = 0;
-		const uint32_t oldBits = buffer.closedLoopPage.harmonicData[index].u;
-		buffer.closedLoopPage.harmonicData[index].f = value;
+		maxCoefficient = max<float>(maxCoefficient, max<float>(fabsf(sines[i]), fabsf(cosines[i])));
+	}
 
-		// If we are only changing 1s to 0s then we don't need to erase
-		const uint32_t newBits = buffer.closedLoopPage.harmonicData[index].u;
-		SetDirty((~oldBits & newBits) != 0);
+	CompactHarmonicData newData;
+	memset(&newData, 0xFF, sizeof(newData));
+	newData.scale = (maxCoefficient > 0.0) ? maxCoefficient/32767.0 : 1.0;
+	newData.numHarmonics = (uint8_t)numHarmonics;
+	newData.qualityScore = qualityScore;
+	for (size_t i = 0; i < numHarmonics; ++i)
+	{
+		newData.coefficients[2 * i] = (int16_t)lrintf(sines[i]/newData.scale);
+		newData.coefficients[2 * i + 1] = (int16_t)lrintf(cosines[i]/newData.scale);
+	}
+
+	// If we are only changing 1 bits to 0 then we don't need to erase
+	const uint8_t *const newBytes = reinterpret_cast<const uint8_t *>(&newData);
+	uint8_t *const oldBytes = reinterpret_cast<uint8_t *>(&buffer.closedLoopPage.compactHarmonicData);
+	for (size_t i = 0; i < sizeof(newData); ++i)
+	{
+		if (newBytes[i] != oldBytes[i])
+		{
+			SetDirty((newBytes[i] & ~oldBytes[i]) != 0);
+			oldBytes[i] = newBytes[i];
+		}
+	}
+	if (buffer.closedLoopPage.harmonicsNotCompact)
+	{
+		buffer.closedLoopPage.harmonicsNotCompact = false;
+		SetDirty(false);
+	}
+	if (buffer.closedLoopPage.closedLoopMagic != CompactClosedLoopMagic)
+	{
+		SetDirty((CompactClosedLoopMagic & ~buffer.closedLoopPage.closedLoopMagic) != 0);
+		buffer.closedLoopPage.closedLoopMagic = CompactClosedLoopMagic;
 	}
 }
 
@@ -302,6 +357,48 @@ void NonVolatileMemory::SetClosedLoopQuadratureDirection(bool backwards) noexcep
 	}
 }
 
+// Get the cogging compensation table, or nullptr if there isn't a valid one
+const int8_t *NonVolatileMemory::GetClosedLoopCoggingTable() noexcept
+{
+	EnsureRead();
+	return (buffer.closedLoopPage.coggingTableNotValid) ? nullptr : buffer.closedLoopPage.coggingTable;
+}
+
+// Set the cogging compensation table and mark it as valid. Call EnsureWritten after this to save it to NVM.
+void NonVolatileMemory::SetClosedLoopCoggingTable(const int8_t *values) noexcept
+{
+	EnsureRead();
+	for (size_t i = 0; i < ClosedLoopCoggingTableSize; ++i)
+	{
+		const uint8_t oldVal = (uint8_t)buffer.closedLoopPage.coggingTable[i];
+		const uint8_t newVal = (uint8_t)values[i];
+		if (newVal != oldVal)
+		{
+			// If we are only changing 1 bits to 0 then we don't need to erase
+			buffer.closedLoopPage.coggingTable[i] = values[i];
+			SetDirty((newVal & ~oldVal) != 0);
+		}
+	}
+	if (buffer.closedLoopPage.coggingTableNotValid)
+	{
+		buffer.closedLoopPage.coggingTableNotValid = false;
+		SetDirty(false);
+	}
+}
+
+// Flag the cogging compensation table as not valid. Call EnsureWritten after this to save it to NVM.
+void NonVolatileMemory::SetClosedLoopCoggingTableNotValid() noexcept
+{
+	EnsureRead();
+	if (!buffer.closedLoopPage.coggingTableNotValid)
+	{
+		// Set the data to all 0xFF so that we will be able to write it without erasing again
+		buffer.closedLoopPage.coggingTableNotValid = true;
+		memset(buffer.closedLoopPage.coggingTable, 0xFF, sizeof(buffer.closedLoopPage.coggingTable));
+		SetDirty(true);
+	}
+}
+
 #if RP2040
 	bool NonVolatileMemory::GetCanSettings(CanUserAreaData& canSettings) noexcept
 	{
@@ -33,6 +33,10 @@ public:
 	static_assert(sizeof(HarmonicDataElement) == sizeof(float));
 	static_assert(sizeof(HarmonicDataElement) == sizeof(uint32_t));
 
+	static constexpr unsigned int MaxClosedLoopHarmonics = 38;					// the maximum number of encoder calibration harmonics we can store, not counting harmonic 0
+	static constexpr uint8_t ClosedLoopQualityUnknown = 0xFF;					// quality score reported for calibrations stored by older firmware
+	static constexpr size_t ClosedLoopCoggingTableSize = 64;				// number of entries in the cogging compensation table, covering one electrical cycle
+
 	NonVolatileMemory(NvmPage whichPage) noexcept;
 
 	void *operator new(size_t, void *p) noexcept { return p; }			// for placement new
@@ -46,16 +50,20 @@ public:
 	void SetThermistorHighCalibration(unsigned int inputNumber, int8_t val) noexcept pre(page == NvmPage::common);
 
 	bool GetClosedLoopCalibrationDataValid() noexcept pre(page == NvmPage::closedLoop);
-	const HarmonicDataElement *GetClosedLoopHarmonicValues() noexcept pre(page == NvmPage::closedLoop);
+	unsigned int GetClosedLoopHarmonics(float *sines, float *cosines, unsigned int maxHarmonics, uint8_t& qualityScore) noexcept pre(page == NvmPage::closedLoop);
 	void GetClosedLoopZeroCountPhaseAndDirection(uint32_t& phase, bool& backwards) noexcept pre(page == NvmPage::closedLoop);
 
 	void SetClosedLoopCalibrationDataNotValid() noexcept pre(page == NvmPage::closedLoop);
-	void SetClosedLoopHarmonicValue(size_t index, float value) noexcept pre(page == NvmPage::closedLoop; index < MaxHarmonicDataSlots);
+	void SetClosedLoopHarmonics(const float *sines, const float *cosines, unsigned int numHarmonics, uint8_t qualityScore) noexcept pre(page == NvmPage::closedLoop; numHarmonics <= MaxClosedLoopHarmonics);
 	void SetClosedLoopZeroCountPhaseAndDirection(uint32_t phase, bool backwards) noexcept;
 
 	bool GetClosedLoopQuadratureDirection(bool& backwards) noexcept pre(page == NvmPage::closedLoop);
 	void SetClosedLoopQuadratureDirection(bool backwards) noexcept pre(page == NvmPage::closedLoop);
 
+	const int8_t *GetClosedLoopCoggingTable() noexcept pre(page == NvmPage::closedLoop);
+	void SetClosedLoopCoggingTable(const int8_t *values) noexcept pre(page == NvmPage::closedLoop);
+	void SetClosedLoopCoggingTableNotValid() noexcept pre(page == NvmPage::closedLoop);
+
 #if RP2040
 	bool GetCanSettings(CanUserAreaData& canSettings) noexcept pre(page == NvmPage::common);
 	void SetCanSettings(CanUserAreaData& canSettings) noexcept pre(page == NvmPage::common);
@@ -87,23 +95,41 @@ private:
 		SoftwareResetData resetData[NumberOfResetDataSlots];			// 3 slots of 152 bytes each
 	};
 
+	// Compact storage of the encoder calibration harmonics, which replaced storing them as floats
+	struct CompactHarmonicData
+	{
+		float scale;													// multiply the stored coefficients by this to get encoder counts
+		uint8_t numHarmonics;											// the number of harmonics stored, starting at harmonic 1
+		uint8_t qualityScore;											// 0 to 100
+		uint16_t unusedAllOnes;
+		int16_t coefficients[2 * MaxClosedLoopHarmonics];				// sine and cosine coefficient of each harmonic
+	};
+
 	struct ClosedLoopPage
 	{
 		static constexpr unsigned int MaxHarmonicDataSlots = 40;
+		static constexpr unsigned int NumLegacyHarmonics = 9;			// older firmware stored harmonics 1 to 9 as floats
 
 		uint16_t closedLoopMagic;
 		// define your data here and pad it out to 510 bytes
 		// start with 2 bytes of padding if you will be using 32-bit quantities, so as to 4-byte align them
 		uint16_t calibrationNotValid : 1,								// will be 1 if no magnetic encoder calibration values are present
 				 quadratureDirectionNotValid : 1,						// will be 1 if the direction of the quadrature encoder has not been set
-				 unusedAllOnes : 14;
+				 coggingTableNotValid : 1,								// will be 1 if no cogging compensation table is present
+				 harmonicsNotCompact : 1,								// will be 1 if the harmonics were stored as floats by older firmware
+				 unusedAllOnes : 12;
 		uint32_t magneticEncoderZeroCountPhase;
 		uint32_t magneticEncoderBackwards : 1,
 				 quadratureEncoderBackwards : 1,
 				 unusedAllOnes2 : 30;
-		HarmonicDataElement harmonicData[MaxHarmonicDataSlots];
-
-		uint8_t spare[512 - 4 - 8 - sizeof(harmonicData)];
+		union
+		{
+			HarmonicDataElement harmonicData[MaxHarmonicDataSlots];		// used if harmonicsNotCompact is set
+			CompactHarmonicData compactHarmonicData;					// used if harmonicsNotCompact is clear
+		};
+		int8_t coggingTable[ClosedLoopCoggingTableSize];				// cogging compensation in units of 1/2 of the PID control signal, indexed by electrical phase
+
+		uint8_t spare[512 - 4 - 8 - sizeof(harmonicData) - sizeof(coggingTable)];
 	};
 
 	union NVM
@@ -113,9 +139,14 @@ private:
 	};
 
 	static_assert(sizeof(NVM) == 512);
+	static_assert(sizeof(CompactHarmonicData) <= sizeof(HarmonicDataElement) * ClosedLoopPage::MaxHarmonicDataSlots);
 
 	uint32_t GetMagicValue() const noexcept { return 0x41E5 + (unsigned int)page + ((unsigned int)page << 8); }
 
+	// Once the closed loop page holds compact harmonics we change its magic value, so that older firmware treats the page as blank instead of reading the compact data as floats.
+	// This value can be written over the original closed loop magic value without erasing.
+	static constexpr uint16_t CompactClosedLoopMagic = 0x42A4;
+
 	enum class NvmState : uint8_t { notRead, clean, writeNeeded, eraseAndWriteNeeded };
 
 	alignas(4) NVM buffer;
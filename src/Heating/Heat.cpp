@@ -50,6 +50,10 @@ Licence: GPL
 
 #include <Platform/Tasks.h>
 
+#if SUPPORT_CLOSED_LOOP
+# include <ClosedLoop/ClosedLoop.h>
+#endif
+
 // The task stack size must be large enough for calls to debugPrintf when a heater fault occurs.
 constexpr uint32_t HeaterTaskStackWords = 230;					// task stack size in dwords
 
@@ -79,6 +83,15 @@ namespace Heat
 	static uint8_t newDriverFaultState = 0;
 	static uint8_t newHeaterFaultState = 0;
 
+	// Delta reporting of sensor, heater and fan status. Between full snapshots we broadcast only the items that have changed.
+	// TemperatureSensor considers a reading older than 2 seconds to be stale, so we send a full snapshot well within that.
+	constexpr uint32_t FullStatusSnapshotIntervalMillis = 1000;
+	constexpr float TemperatureReportDeadband = 0.1;			// we report a change in temperature only if it is at least this much
+	static uint32_t lastFullStatusSnapshotTime = 0;
+	static unsigned int statusItemsSent = 0;					// for diagnostics
+	static unsigned int statusItemsUnchanged = 0;				// for diagnostics
+	static unsigned int statusMessagesSkipped = 0;				// for diagnostics
+
 	static ReadLockedPointer<Heater> FindHeater(int heater)
 	{
 		return ReadLockedPointer<Heater>(heatersLock, (heater < 0 || heater >= (int)MaxHeaters) ? nullptr : heaters[heater]);
@@ -144,12 +157,12 @@ namespace Heat
 		return GCodeResult::error;
 	}
 
-	// Broadcast our heater statuses
-	static void SendHeatersStatus(CanMessageBuffer& buf)
+	// Broadcast the status of our heaters that have changed, or all of them if this is a full snapshot
+	static void SendHeatersStatus(CanMessageBuffer& buf, bool fullSnapshot)
 	{
 		CanMessageHeatersStatus * const msg = buf.SetupStatusMessage<CanMessageHeatersStatus>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress());
 		msg->whichHeaters = 0;
-		unsigned int heatersFound = 0;
+		unsigned int heatersFound = 0, heatersUnchanged = 0;
 
 		{
 			ReadLocker lock(heatersLock);
@@ -159,11 +172,21 @@ namespace Heat
 				Heater * const h = heaters[heater];
 				if (h != nullptr)
 				{
-					msg->whichHeaters |= (uint64_t)1u << heater;
-					msg->reports[heatersFound].mode = h->GetModeByte();
-					msg->reports[heatersFound].averagePwm = (uint8_t)(h->GetAveragePWM() * 255.0);
-					msg->reports[heatersFound].SetTemperature(h->GetTemperature());
-					++heatersFound;
+					const uint8_t mode = h->GetModeByte();
+					const uint8_t averagePwm = (uint8_t)(h->GetAveragePWM() * 255.0);
+					const float temperature = h->GetTemperature();
+					if (h->GetReportFilter().NeedsReport(temperature, TemperatureReportDeadband, ((uint32_t)(averagePwm >> 2) << 8) | mode, fullSnapshot))
+					{
+						msg->whichHeaters |= (uint64_t)1u << heater;
+						msg->reports[heatersFound].mode = mode;
+						msg->reports[heatersFound].averagePwm = averagePwm;
+						msg->reports[heatersFound].SetTemperature(temperature);
+						++heatersFound;
+					}
+					else
+					{
+						++heatersUnchanged;
+					}
 				}
 			}
 		}
@@ -172,7 +195,13 @@ namespace Heat
 		{
 			buf.dataLength = msg->GetActualDataLength(heatersFound);
 			CanInterface::Send(&buf);
+			statusItemsSent += heatersFound;
 		}
+		else if (heatersUnchanged != 0)
+		{
+			++statusMessagesSkipped;
+		}
+		statusItemsUnchanged += heatersUnchanged;
 	}
 }
 
@@ -250,6 +279,9 @@ void Heat::Exit()
 		{
 			newDriverFaultState = 2;
 			Platform::SendDriversStatus(buf);
+# if SUPPORT_CLOSED_LOOP
+			ClosedLoop::SendPendingEvents();
+# endif
 		}
 #endif
 
@@ -257,19 +289,25 @@ void Heat::Exit()
 		if (newHeaterFaultState == 1)
 		{
 			newHeaterFaultState = 2;
-			SendHeatersStatus(buf);
+			SendHeatersStatus(buf, true);
 		}
 
 		// Check whether it is time to poll sensors and PIDs and send regular messages
 		const uint32_t startTime = millis();
 		if ((int32_t)(startTime - nextWakeTime) >= 0)
 		{
+			const bool fullSnapshot = startTime - lastFullStatusSnapshotTime >= FullStatusSnapshotIntervalMillis;
+			if (fullSnapshot)
+			{
+				lastFullStatusSnapshotTime = startTime;
+			}
+
 			{
 				// Walk the sensor list and poll all sensors
 				// Also prepare to broadcast our sensor temperatures
 				CanMessageSensorTemperatures * const sensorTempsMsg = buf.SetupBroadcastMessage<CanMessageSensorTemperatures>(CanInterface::GetCanAddress());
 				sensorTempsMsg->whichSensors = 0;
-				unsigned int sensorsFound = 0;
+				unsigned int sensorsFound = 0, sensorsUnchanged = 0;
 				{
 					unsigned int nextUnreportedSensor = 0;
 					ReadLocker lock(sensorsLock);
@@ -281,11 +319,19 @@ void Heat::Exit()
 							const unsigned int sn = currentSensor->GetSensorNumber();
 							if (sn >= nextUnreportedSensor && sn < 64)
 							{
-								sensorTempsMsg->whichSensors |= (uint64_t)1u << sn;
 								float temperature;
-								sensorTempsMsg->temperatureReports[sensorsFound].errorCode = (uint8_t)(currentSensor->GetLatestTemperature(temperature).ToBaseType());
-								sensorTempsMsg->temperatureReports[sensorsFound].SetTemperature(temperature);
-								++sensorsFound;
+								const uint8_t errorCode = (uint8_t)(currentSensor->GetLatestTemperature(temperature).ToBaseType());
+								if (currentSensor->GetReportFilter().NeedsReport(temperature, TemperatureReportDeadband, errorCode, fullSnapshot))
+								{
+									sensorTempsMsg->whichSensors |= (uint64_t)1u << sn;
+									sensorTempsMsg->temperatureReports[sensorsFound].errorCode = errorCode;
+									sensorTempsMsg->temperatureReports[sensorsFound].SetTemperature(temperature);
+									++sensorsFound;
+								}
+								else
+								{
+									++sensorsUnchanged;
+								}
 								nextUnreportedSensor = sn + 1;
 							}
 							else
@@ -318,7 +364,13 @@ void Heat::Exit()
 				{
 					buf.dataLength = sensorTempsMsg->GetActualDataLength(sensorsFound);
 					CanInterface::Send(&buf);
+					statusItemsSent += sensorsFound;
+				}
+				else if (sensorsUnchanged != 0)
+				{
+					++statusMessagesSkipped;
 				}
+				statusItemsUnchanged += sensorsUnchanged;
 			}
 
 			// See if we are tuning a heater, or have finished tuning one
@@ -342,7 +394,7 @@ void Heat::Exit()
 
 			if (newHeaterFaultState == 0)
 			{
-				SendHeatersStatus(buf);						// send the status of our heaters
+				SendHeatersStatus(buf, fullSnapshot);		// send the status of our heaters
 			}
 			else
 			{
@@ -352,11 +404,18 @@ void Heat::Exit()
 			// Broadcast our fan RPMs
 			{
 				CanMessageFansReport * const msg = buf.SetupStatusMessage<CanMessageFansReport>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress());
-				const unsigned int numReported = FansManager::PopulateFansReport(*msg);
+				unsigned int numUnchanged = 0;
+				const unsigned int numReported = FansManager::PopulateFansReport(*msg, fullSnapshot, numUnchanged);
+				statusItemsUnchanged += numUnchanged;
 				if (numReported != 0)
 				{
 					buf.dataLength = msg->GetActualDataLength(numReported);
 					CanInterface::Send(&buf);
+					statusItemsSent += numReported;
+				}
+				else if (numUnchanged != 0)
+				{
+					++statusMessagesSkipped;
 				}
 			}
 
@@ -700,6 +759,8 @@ void Heat::Diagnostics(const StringRef& reply)
 	reply.lcatf("Last sensors broadcast 0x%08" PRIx64 " found %u %" PRIu32 " ticks ago, %u ordering errs, loop time %" PRIu32,
 					lastSensorsBroadcastWhich, lastSensorsFound, millis() - lastSensorsBroadcastWhen, sensorOrderingErrors, heatTaskLoopTime);
 	sensorOrderingErrors = 0;
+	reply.lcatf("Status broadcasts: %u items sent, %u unchanged items and %u messages skipped", statusItemsSent, statusItemsUnchanged, statusMessagesSkipped);
+	statusItemsSent = statusItemsUnchanged = statusMessagesSkipped = 0;
 #if 0	// temporary to debug a board that reports bad Vssa
 	reply.catf(", Vref %u Vssa %u",
 		(unsigned int)(Platform::GetVrefFilter(0)->GetSum()/ThermistorAveragingFilter::NumAveraged()),
@@ -13,6 +13,7 @@
 #include "FOPDT.h"
 
 #include <CanId.h>
+#include <CAN/StatusReportFilter.h>
 
 class HeaterMonitor;
 class CanMessageGenericParser;
@@ -61,6 +62,8 @@ public:
 	bool IsTuning() const { return GetMode() >= HeaterMode::firstTuningMode; }
 	uint8_t GetModeByte() const { return (uint8_t)GetMode(); }
 
+	StatusReportFilter& GetReportFilter() noexcept { return reportFilter; }	// get the record of what we last broadcast for this heater
+
 protected:
 	virtual void ResetHeater() noexcept = 0;
 	virtual HeaterMode GetMode() const noexcept = 0;
@@ -87,6 +90,7 @@ private:
 	float maxHeatingFaultTime;						// how long a heater fault is permitted to persist before a heater fault is raised
 	uint32_t maxBadTemperatureCount;				// the number of consecutive bad sensor readings we allow before raising a fault
 	bool isBedOrChamber;							// true if this was a bed or chamber heater when it was switched on
+	StatusReportFilter reportFilter;				// what we last broadcast for this heater
 };
 
 #endif /* SRC_HEATING_HEATER_H_ */
@@ -5,6 +5,7 @@
 #include <TemperatureError.h>		// for result codes
 #include <Hardware/IoPorts.h>
 #include <CanId.h>
+#include <CAN/StatusReportFilter.h>
 
 class CanMessageGenericParser;
 class CanSensorReport;
@@ -59,6 +60,9 @@ public:
 	// Get the time of the last reading
 	uint32_t GetLastReadingTime() const noexcept { return whenLastRead; }
 
+	// Get the record of what we last broadcast for this sensor
+	StatusReportFilter& GetReportFilter() noexcept { return reportFilter; }
+
 	// Factory method
 	static TemperatureSensor *Create(unsigned int sensorNum, const char *typeName, const StringRef& reply);
 
@@ -83,6 +87,7 @@ private:
 	float offsetAdjustment = 0.0;
 	float slopeAdjustment = 0.0;
 	volatile TemperatureError lastResult, lastRealError;
+	StatusReportFilter reportFilter;
 };
 
 #endif // TEMPERATURESENSOR_H
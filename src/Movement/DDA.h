@@ -122,6 +122,7 @@ public:
 
 #if SUPPORT_CLOSED_LOOP
 	void GetCurrentMotion(size_t driver, uint32_t ticksSinceStart, MotionParameters& mParams) noexcept;	// get the current desired position, speed and acceleration
+	bool GetFutureSpeedAndAcceleration(size_t driver, uint32_t ticksSinceStart, MotionParameters& mParams) const noexcept;	// get the desired speed and acceleration at a later time
 	uint32_t GetStartTime() const noexcept { return afterPrepare.moveStartTime; }
 	void SetCompleted() noexcept { state = completed; }
 	float GetFullDistance(size_t drive) const noexcept { return directionVector[drive]; }
@@ -328,6 +329,13 @@ inline void DDA::GetCurrentMotion(size_t driver, uint32_t ticksSinceStart, Motio
 	return ddms[driver].GetCurrentMotion(*this, ticksSinceStart, mParams);
 }
 
+// Get the speed and acceleration at a time that may be later than the current one. Units are microsteps and step clocks.
+// Return false if that time is after the end of this move. Interrupts are disabled on entry and must remain disabled.
+inline bool DDA::GetFutureSpeedAndAcceleration(size_t driver, uint32_t ticksSinceStart, MotionParameters& mParams) const noexcept
+{
+	return ddms[driver].GetFutureSpeedAndAcceleration(*this, ticksSinceStart, mParams);
+}
+
 #endif
 
 #endif	// SUPPORT_DRIVERS
@@ -807,6 +807,55 @@ void DriveMovement::GetCurrentMotion(const DDA& dda, uint32_t ticksSinceStart, M
 	}
 }
 
+// Get the speed and acceleration at a time that may be later than the current one, without changing the current segment. Units are microsteps and step clocks.
+// This is used to calculate feedforward terms that anticipate changes in acceleration.
+// If the time is after the end of the move then return the speed and acceleration at the end of the move, and return false.
+// Interrupts are disabled on entry and must remain disabled.
+bool DriveMovement::GetFutureSpeedAndAcceleration(const DDA& dda, uint32_t ticksSinceStart, MotionParameters& mParams) const noexcept
+{
+	const MoveSegment *ms = currentSegment;
+	if (ms == nullptr)
+	{
+		// Drive was not commanded to move
+		mParams.speed = mParams.acceleration = 0.0;
+		return true;
+	}
+
+	// timeSoFar is the time at which the current segment ends
+	float timeSinceMoveStart = (float)ticksSinceStart;
+	float segEndTime = timeSoFar;
+	float segStartTime = timeSoFar - ms->GetSegmentTime();
+	bool inMove = true;
+	while (timeSinceMoveStart > segEndTime)
+	{
+		if (ms->GetNext() == nullptr)
+		{
+			timeSinceMoveStart = segEndTime;
+			inMove = false;
+			break;
+		}
+		ms = ms->GetNext();
+		segStartTime = segEndTime;
+		segEndTime += ms->GetSegmentTime();
+	}
+
+	const float multiplier = (direction != directionReversed) ? mp.cart.effectiveStepsPerMm : -mp.cart.effectiveStepsPerMm;
+	if (ms->IsLinear())
+	{
+		mParams.speed = dda.topSpeed * multiplier;
+		mParams.acceleration = 0.0;
+	}
+	else
+	{
+		// Calculate B in the same way as NewExtruderSegment, NewDeltaSegment and NewCartesianSegment would when starting this segment
+		const float pBAtSegStart = (isExtruder) ? ms->CalcNonlinearB(segStartTime, mp.cart.pressureAdvanceK) : ms->CalcNonlinearB(segStartTime);
+		const float effectiveAcceleration = ms->GetAcceleration() * multiplier;
+		mParams.speed = effectiveAcceleration * (timeSinceMoveStart - pBAtSegStart);
+		mParams.acceleration = effectiveAcceleration;
+	}
+	return inMove;
+}
+
 #endif
 
 #endif	// SUPPORT_DRIVERS
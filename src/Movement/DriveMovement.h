@@ -77,6 +77,10 @@ public:
 	// Interrupts are disabled on entry and must remain disabled. Segments are advanced as necessary.
 	void GetCurrentMotion(const DDA& dda, uint32_t ticksSinceStart, MotionParameters& mParams) noexcept;
 
+	// This is like GetCurrentMotion but it returns only the speed and acceleration, it doesn't start new segments, and the time may be ahead of the current segment.
+	// If the time is after the end of the move then return the values at the end of the move, and return false.
+	bool GetFutureSpeedAndAcceleration(const DDA& dda, uint32_t ticksSinceStart, MotionParameters& mParams) const noexcept;
+
 	// This is like getCurrentMotion but it just returns the distance and doesn't start new segments
 	int32_t GetNetStepsTakenClosedLoop(float topSpeed, int32_t ticksSinceStart) const noexcept;
 #endif
@@ -261,7 +261,7 @@ void Move::StartNextMove(DDA *cdda, uint32_t startTime) noexcept
 			break;
 		}
 
-		CanMessageBuffer::Free(buf);
+		CanInterface::FreeCanMove(buf);
 
 		// See whether we need to kick off a move
 		if (currentDda == nullptr)
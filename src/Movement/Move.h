@@ -89,6 +89,8 @@ public:
 #if SUPPORT_CLOSED_LOOP
 	bool GetCurrentMotion(size_t driver, uint32_t when, bool closedLoopEnabled, MotionParameters& mParams) noexcept;
 																					// get the net full steps taken, including in the current move so far, also speed and acceleration; return true if moving
+	bool GetFutureSpeedAndAcceleration(size_t driver, uint32_t when, MotionParameters& mParams) noexcept;
+																					// get the speed and acceleration commanded at a later time, looking into the next move if necessary
 	void SetCurrentMotorSteps(size_t driver, float fullSteps) noexcept;
 	void InvertCurrentMotorSteps(size_t driver) noexcept;
 #endif
@@ -214,6 +216,45 @@ inline bool Move::GetCurrentMotion(size_t driver, uint32_t when, bool closedLoop
 	return false;
 }
 
+// Get the full step speed and acceleration that will be commanded at time 'when', which is normally a little in the future.
+// Unlike GetCurrentMotion this doesn't advance segments or moves, so it can look ahead into the next move if that move is ready.
+// If that time is after the end of the current move and the next move isn't ready, return the values at the end of the current move.
+// Return false if there is no current move or it starts after that time, in which case mParams is not changed.
+inline bool Move::GetFutureSpeedAndAcceleration(size_t driver, uint32_t when, MotionParameters& mParams) noexcept
+{
+	const float multiplier = ldexpf((Platform::GetDirectionValueNoCheck(driver)) ? -1.0 : 1.0, -(int)SmartDrivers::GetMicrostepShift(driver));
+	AtomicCriticalSectionLocker lock;				// we don't want an interrupt changing currentDda while we execute this
+	const DDA *cdda = currentDda;					// capture volatile variable
+	bool found = false;
+	while (cdda != nullptr)
+	{
+		const int32_t clocksSinceMoveStart = (int32_t)(when - cdda->GetStartTime());
+		if (clocksSinceMoveStart < 0)
+		{
+			break;									// the move hasn't started by that time
+		}
+		found = true;
+		if (cdda->GetFutureSpeedAndAcceleration(driver, (uint32_t)clocksSinceMoveStart, mParams))
+		{
+			break;
+		}
+
+		// That time is after the end of this move and mParams holds the values at the end of it. Look at the next move if it is ready.
+		cdda = cdda->GetNext();
+		if (cdda->GetState() != DDA::frozen)
+		{
+			break;
+		}
+	}
+
+	if (found)
+	{
+		mParams.speed *= multiplier;
+		mParams.acceleration *= multiplier;
+	}
+	return found;
+}
+
 inline void Move::SetCurrentMotorSteps(size_t driver, float fullSteps) noexcept
 {
 	const float multiplier = ldexpf((Platform::GetDirectionValueNoCheck(driver)) ? -1.0 : 1.0, (int)SmartDrivers::GetMicrostepShift(driver));
@@ -15,6 +15,7 @@
 #include "Movement/StepperDrivers/TMC22xx.h"
 #include "Movement/StepTimer.h"
 #include <CAN/CanInterface.h>
+#include <CAN/CanTrafficProfiler.h>
 #include <CanMessageBuffer.h>
 #include "Tasks.h"
 #include "Heating/Heat.h"
@@ -1103,6 +1104,7 @@ void Platform::Spin()
 	}
 
 	SpinMinimal();				// update the activity LED and currentVin
+	CanTrafficProfiler::Spin();	// send the CAN traffic summary if it is turned on
 
 #if HAS_VOLTAGE_MONITOR
 	const float voltsVin = GetCurrentVinVoltage();
@@ -2246,6 +2248,9 @@ void Platform::StartReset()
 
 void Platform::EmergencyStop()
 {
+#if SUPPORT_DRIVERS
+	CanInterface::ResyncMoves();					// don't execute any movement messages that we are holding while we wait to reset
+#endif
 	whenDeferredCommandRequested = millis();
 	deferredCommand = DeferredCommand::reset;
 }
@@ -2339,6 +2344,16 @@ GCodeResult Platform::DoDiagnosticTest(const CanMessageDiagnosticTest& msg, cons
 #endif
 		return GCodeResult::ok;
 
+#if SUPPORT_CLOSED_LOOP
+	case 110:												// report the closed loop control stage timings and reset them
+		ClosedLoop::ReportAndResetProfiles(reply);
+		return GCodeResult::ok;
+#endif
+
+	case 111:												// turn the once-per-second CAN traffic summary on or off
+		reply.printf("CAN traffic summary %s", (CanTrafficProfiler::ToggleStreaming()) ? "on" : "off");
+		return GCodeResult::ok;
+
 #if SAME5x
 	case 500:												// report write buffer
 		reply.printf("Write buffer is %s", (SCnSCB->ACTLR & SCnSCB_ACTLR_DISDEFWBUF_Msk) ? "disabled" : "enabled");
@@ -46,6 +46,8 @@ constexpr uint32_t FlashBlockSize = 0x00004000;					// the erase size we assume
 #elif RP2040
 constexpr uint32_t FlashBlockSize = 0x00001000;					// the erase size we assume for flash, and the bootloader size (4K)
 constexpr uint32_t MaxFirmwareSize = 200*1024;					// Max size of firmware we can flash
+constexpr uint32_t FirmwareWindowSize = 16*1024;				// how much of the firmware file we ask for in each request
+constexpr unsigned int MaxBadUf2Blocks = 3;						// how many corrupt UF2 blocks we tolerate before we give up
 struct UF2_Block
 {
 	// 32 byte header
@@ -336,27 +338,39 @@ static void RequestFirmwareBlock(uint32_t fileOffset, uint32_t numBytes, CanMess
 	CanInterface::Send(&buf);
 }
 
-// Get a buffer of data from the host
-static FirmwareFlashErrorCode GetBlock(uint32_t startingOffset, uint32_t& fileSize, uint8_t *blockBuffer)
+// Return true if a UF2 block is valid and is the one that should be at the specified offset in the file
+static bool IsValidUf2Block(const UF2_Block& block, uint32_t fileOffset) noexcept
 {
-	CanMessageBuffer buf;
-//debugPrintf("ask for block %d\n", startingOffset);
-	RequestFirmwareBlock(startingOffset, FlashBlockSize, buf);	// ask for 4K from the starting offset
-//debugPrintf("After request\n");
+	return block.magicStart0 == UF2_Block::MagicStart0Val
+		&& block.magicStart1 == UF2_Block::MagicStart1Val
+		&& block.magicEnd == UF2_Block::MagicEndVal
+		&& block.payloadSize <= 256
+		&& block.blockNo == fileOffset/sizeof(UF2_Block);
+}
+
+// Fetch the firmware file from the host and unpack it into firmwareBuffer, returning the firmware size in bytes.
+// We ask for the file in windows of FirmwareWindowSize bytes. When we have received half of a window we ask for the next one, so that the host has the request
+// waiting when it finishes sending the current window. We unpack each UF2 block as soon as it is complete, so we only need to buffer one block.
+// If the data stops arriving, or a block is corrupt, we resume the transfer from the start of the block that we were assembling.
+static FirmwareFlashErrorCode GetFirmware(uint32_t *firmwareBuffer, UF2_Block& block, uint32_t& firmwareSize)
+{
+	CanMessageBuffer rxBuf, txBuf;
+	uint32_t blockStartOffset = 0;								// the file offset of the block we are assembling
+	uint32_t bytesInBlock = 0;
+	uint32_t fileSize = 0;										// zero until we have received the first response
+	unsigned int badBlocks = 0;
+
+	RequestFirmwareBlock(0, FirmwareWindowSize, txBuf);
+	uint32_t requestedUpTo = FirmwareWindowSize;				// the file offset of the end of the last window we asked for
 	uint32_t whenStartedWaiting = millis();
-	uint32_t bytesReceived = 0;
-	bool done = false;
-	do
+	for (;;)
 	{
-		Platform::SpinMinimal();									// check if it's time to turn the LED off
-		const bool ok = CanInterface::GetCanMessage(&buf);
-		if (ok)
+		Platform::SpinMinimal();								// check if it's time to turn the LED off
+		if (CanInterface::GetCanMessage(&rxBuf))
 		{
-			//debugPrintf("Got reply %d\n", buf.id.MsgType());
-			if (buf.id.MsgType() == CanMessageType::firmwareBlockResponse)
+			if (rxBuf.id.MsgType() == CanMessageType::firmwareBlockResponse)
 			{
-				const CanMessageFirmwareUpdateResponse& response = buf.msg.firmwareUpdateResponse;
-				//debugPrintf("Response err %x offset %d len %d\n", response.err, response.fileOffset, response.dataLength);
+				const CanMessageFirmwareUpdateResponse& response = rxBuf.msg.firmwareUpdateResponse;
 				switch (response.err)
 				{
 				case CanMessageFirmwareUpdateResponse::ErrNoFile:
@@ -369,41 +383,86 @@ static FirmwareFlashErrorCode GetBlock(uint32_t startingOffset, uint32_t& fileSi
 					return FirmwareFlashErrorCode::hostOther;
 
 				case CanMessageFirmwareUpdateResponse::ErrNone:
-					if (response.fileOffset >= startingOffset && response.fileOffset <= startingOffset + bytesReceived)
 					{
-						const uint32_t bufferOffset = response.fileOffset - startingOffset;
-						const uint32_t bytesToCopy = min<uint32_t>(FlashBlockSize - bufferOffset, response.dataLength);
-						//debugPrintf("About to store response off %d start %d %d bytes to offset %d\n", response.fileOffset, startingOffset, bytesToCopy, bufferOffset);
-						memcpy(blockBuffer + bufferOffset, response.data, bytesToCopy);
-						if (response.fileOffset + bytesToCopy > startingOffset + bytesReceived)
+						// Use the data only if it continues from the end of the data we already have. We may receive data that we already have if we resumed the transfer.
+						uint32_t received = blockStartOffset + bytesInBlock;
+						if (response.fileOffset > received || response.fileOffset + response.dataLength <= received)
 						{
-							bytesReceived = response.fileOffset - startingOffset + bytesToCopy;
+							break;
 						}
-						if (bytesReceived == FlashBlockSize || bytesReceived >= response.fileLength - startingOffset)
+
+						if (fileSize == 0)
 						{
-							//debugPrintf("Received %d bytes flock full or eof\n", bytesReceived);
-							// Reached the end of the file
-							memset(blockBuffer + bytesReceived, 0xFF, FlashBlockSize - bytesReceived);
 							fileSize = response.fileLength;
-							done = true;
+							if (fileSize/2 > MaxFirmwareSize)				// using UF2 format with 256 data bytes per 512b block
+							{
+								return FirmwareFlashErrorCode::noMemory;
+							}
 						}
+
+						uint32_t dataOffset = received - response.fileOffset;
+						while (dataOffset < response.dataLength)
+						{
+							const uint32_t bytesToCopy = min<uint32_t>(response.dataLength - dataOffset, sizeof(UF2_Block) - bytesInBlock);
+							memcpy(reinterpret_cast<uint8_t*>(&block) + bytesInBlock, response.data + dataOffset, bytesToCopy);
+							dataOffset += bytesToCopy;
+							bytesInBlock += bytesToCopy;
+							if (bytesInBlock == sizeof(UF2_Block))
+							{
+								bytesInBlock = 0;
+								if (!IsValidUf2Block(block, blockStartOffset))
+								{
+									debugPrintf("Bad UF2 file block %" PRIu32 "\n", blockStartOffset/sizeof(UF2_Block));
+									if (++badBlocks > MaxBadUf2Blocks)
+									{
+										return FirmwareFlashErrorCode::invalidFirmware;
+									}
+
+									// Ask for the file again from the start of this block
+									RequestFirmwareBlock(blockStartOffset, FirmwareWindowSize, txBuf);
+									requestedUpTo = blockStartOffset + FirmwareWindowSize;
+									break;
+								}
+
+								// If we have both red and green LEDs, the green one indicates CAN activity. Use the red one to indicate that we are storing firmware.
+								Platform::WriteLed(0, true);
+								memcpy(reinterpret_cast<uint8_t*>(firmwareBuffer) + blockStartOffset/2, block.data, 256);
+								blockStartOffset += sizeof(UF2_Block);
+							}
+						}
+
+						received = blockStartOffset + bytesInBlock;
+						if (received >= fileSize)
+						{
+							firmwareSize = fileSize/2;
+							return FirmwareFlashErrorCode::ok;
+						}
+
+						if (requestedUpTo < fileSize && received + FirmwareWindowSize/2 >= requestedUpTo)
+						{
+							RequestFirmwareBlock(requestedUpTo, FirmwareWindowSize, txBuf);
+							requestedUpTo += FirmwareWindowSize;
+						}
+						whenStartedWaiting = millis();
 					}
-					whenStartedWaiting = millis();
+					break;
 				}
 			}
 		}
 		else if (millis() - whenStartedWaiting > BlockReceiveTimeout)
 		{
-			//debugPrintf("Timeout\n");
-			if (bytesReceived == 0)
+			if (fileSize == 0)
 			{
 				return FirmwareFlashErrorCode::blockReceiveTimeout;
 			}
-			RequestFirmwareBlock(startingOffset + bytesReceived, FlashBlockSize - bytesReceived, buf);		// ask for 4K from the starting offset
+
+			// Resume the transfer from the start of the block we were assembling
+			bytesInBlock = 0;
+			RequestFirmwareBlock(blockStartOffset, FirmwareWindowSize, txBuf);
+			requestedUpTo = blockStartOffset + FirmwareWindowSize;
 			whenStartedWaiting = millis();
 		}
-	} while (!done);
-	return FirmwareFlashErrorCode::ok;
+	}
 }
 
 #else
@@ -578,22 +637,86 @@ constexpr uint32_t FlashSectorSize = 4096;									// the flash chip has 4K sect
 constexpr uint32_t FlashSize = 2 * 1024 * 1024;								// the flash chip size in bytes (2Mbytes = 16Mbits)
 constexpr uint32_t FlashStart = XIP_BASE;
 
-uint32_t eraseTime = 0;
+constexpr unsigned int MaxFlashWriteAttempts = 3;								// how many times we try to write a flash sector, and the whole image, before we give up
+
 uint32_t flashTime = 0;
-// Erase flash and write the firmware to it.
+
+// Return true if a flash sector already holds the required data.
+// NOTE: this is called with interrupts disabled while we are updating the flash, so it must not execute any code from flash.
+static bool RAMFUNC FlashSectorMatches(const uint32_t *firmware, uint32_t offset) noexcept
+{
+	const volatile uint32_t *flash = reinterpret_cast<const volatile uint32_t*>(FlashStart + offset);
+	const uint32_t *data = firmware + offset/4;
+	for (size_t i = 0; i < FlashSectorSize/4; ++i)
+	{
+		if (flash[i] != data[i])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Compute the CRC32 of a dword-aligned block of memory in software.
+// We can't use ComputeCRC32 to check the flash after we have written it, because that calls library functions that may be in flash.
+// NOTE: this is called with interrupts disabled while we are updating the flash, so it must not execute any code from flash.
+static uint32_t RAMFUNC ComputeCRC32InRam(const volatile uint32_t *start, const volatile uint32_t *end) noexcept
+{
+	uint32_t crc = 0xFFFFFFFF;
+	while (start < end)
+	{
+		crc ^= *start++;
+		for (unsigned int i = 0; i < 32; ++i)
+		{
+			crc = (crc >> 1) ^ ((crc & 1u) ? 0xEDB88320 : 0);
+		}
+	}
+	return ~crc;
+}
+
+// Return the number of flash sectors that differ from the new firmware
+static unsigned int CountChangedSectors(const uint32_t *firmware, uint32_t length) noexcept
+{
+	unsigned int numChanged = 0;
+	for (uint32_t offset = 0; offset < length; offset += FlashSectorSize)
+	{
+		if (!FlashSectorMatches(firmware, offset))
+		{
+			++numChanged;
+		}
+	}
+	return numChanged;
+}
+
+// Write the firmware to flash. Minor releases leave most of the image unchanged, so we only erase and write the sectors that differ from the new firmware.
+// We read back each sector that we write and write it again if it doesn't match. When all sectors have been written we check the CRC of the whole image in flash,
+// and if it doesn't match the CRC of the new firmware then we go round again. If we still can't get a good image then we erase the first sector, which holds the
+// second stage boot loader, so that the boot ROM starts its USB bootloader instead of running the corrupt firmware.
 // NOTE: during this operation we must not execute any code from flash.
-[[noreturn]] void RAMFUNC WriteFirmwareToFlash(uint32_t *firmware, uint32_t length)
+[[noreturn]] void RAMFUNC WriteFirmwareToFlash(uint32_t *firmware, uint32_t length, uint32_t expectedCRC)
 {
 	uint32_t start = StepTimer::GetTimerTicks();
 	// make sure that nothing runs from flash memory
 	IrqDisable();
 	// Reboot in 10 seconds no matter what happens (The flash operation usually takes less than 2 seconds)!
 	watchdog_reboot(0, 0, 10000);
-	// Erase the flash pages
-	flash_range_erase(0, length);
-	eraseTime = StepTimer::GetTimerTicks() - start;
-	// now write the flash data
-	flash_range_program(0, (uint8_t *)firmware, length);
+	bool imageGood = false;
+	for (unsigned int imageAttempt = 0; imageAttempt < MaxFlashWriteAttempts && !imageGood; ++imageAttempt)
+	{
+		for (uint32_t offset = 0; offset < length; offset += FlashSectorSize)
+		{
+			for (unsigned int attempt = 0; attempt < MaxFlashWriteAttempts && !FlashSectorMatches(firmware, offset); ++attempt)
+			{
+				flash_range_erase(offset, FlashSectorSize);
+				flash_range_program(offset, reinterpret_cast<const uint8_t*>(firmware) + offset, FlashSectorSize);
+			}
+		}
+		imageGood = ComputeCRC32InRam(reinterpret_cast<const volatile uint32_t*>(FlashStart), reinterpret_cast<const volatile uint32_t*>(FlashStart + length)) == expectedCRC;
+	}
+	if (!imageGood)
+	{
+		flash_range_erase(0, FlashSectorSize);
+	}
 	flashTime = StepTimer::GetTimerTicks() - start;
 	// Spin waiting for reboot
 	for(;;)
@@ -608,12 +731,10 @@ extern "C" [[noreturn]] void UpdateFirmwareTask(void *pvParameters) noexcept
 	Platform::InitMinimal();
 	delay(10000);
 	debugPrintf("Starting firmware update\n");
-	uint8_t * blockBuffer = (uint8_t *)(new uint32_t[FlashBlockSize/4]);		// if this fails then an OutOfMemory reset will occur;
-	debugPrintf("After memory allocation1\n");
 	uint32_t * firmwareBuffer = new uint32_t[MaxFirmwareSize/4];	// if this fails then an OutOfMemory reset will occur;
-	debugPrintf("After memory allocation2\n");
-	uint32_t bufferStartOffset = 0;
-	uint32_t roundedUpLength = 0;
+	debugPrintf("After memory allocation\n");
+	UF2_Block * const uf2Block = new UF2_Block;
+	uint32_t firmwareSize;
 	for (;;)
 	{
 		Platform::WriteLed(0, false);
@@ -623,61 +744,18 @@ extern "C" [[noreturn]] void UpdateFirmwareTask(void *pvParameters) noexcept
 			Platform::SpinMinimal();								// make sure the currentVin is up to date and the green LED gets turned off
 		} while (millis() - start < 100);
 
-		uint32_t fileSize;
-		const FirmwareFlashErrorCode err = GetBlock(bufferStartOffset, fileSize, reinterpret_cast<uint8_t*>(blockBuffer));
-		if (err != FirmwareFlashErrorCode::ok)
-		{
-			ReportFlashError(err);
-			continue;
-		}
-		if (bufferStartOffset == 0)
-		{
-			// First block received, so unlock and erase the firmware
-			const uint32_t firmwareSize = fileSize/2;			// using UF2 format with 256 data bytes per 512b block
-			roundedUpLength = ((firmwareSize + (FlashBlockSize - 1))/FlashBlockSize) * FlashBlockSize;
-			if (roundedUpLength > MaxFirmwareSize)
-			{
-				ReportFlashError(FirmwareFlashErrorCode::noMemory);
-				continue;
-			}
-		}
-
-		// If we have both red and green LEDs, the green one indicates CAN activity. Use the red one to indicate writing to flash.
-		Platform::WriteLed(0, true);
-
-		// The file being fetched is in .uf2 format, so extract the data from the buffer and write it
-		// On the SAME5x we fetch 64kb at a time, so we have up to 128 blocks in the buffer
-		for (unsigned int block = 0; block < FlashBlockSize/512 && bufferStartOffset + (512 * (block + 1)) <= fileSize; ++block)
-		{
-			const UF2_Block *const currentBlock = reinterpret_cast<const UF2_Block*>(blockBuffer + (512 * block));
-			if (   currentBlock->magicStart0 == UF2_Block::MagicStart0Val
-				&& currentBlock->magicStart1 == UF2_Block::MagicStart1Val
-				&& currentBlock->magicEnd == UF2_Block::MagicEndVal
-				&& currentBlock->payloadSize <= 256
-			   )
-			{
-				const uint32_t firmwareOffset = (bufferStartOffset/2) + (block * 256);
-				//debugPrintf("Write 256 bytes to %d payload size %d\n", firmwareOffset, currentBlock->payloadSize);
-				memcpy(((uint8_t *)firmwareBuffer) + firmwareOffset, currentBlock->data, 256);
-			}
-			else
-			{
-				debugPrintf("Bad UF2 file block %d size %u magic0 %x(%x) magic1 %x(%x) magice %x(%x)\n", block, (unsigned)currentBlock->payloadSize,
-								(unsigned)currentBlock->magicStart0, (unsigned)UF2_Block::MagicStart0Val, (unsigned)currentBlock->magicStart1, (unsigned)UF2_Block::MagicStart1Val,
-								(unsigned)currentBlock->magicEnd, (unsigned)UF2_Block::MagicEndVal );
-				ReportFlashError(FirmwareFlashErrorCode::invalidFirmware);
-				continue;
-			}
-		}
-		bufferStartOffset += FlashBlockSize;
-		if (bufferStartOffset >= fileSize)
+		const FirmwareFlashErrorCode err = GetFirmware(firmwareBuffer, *uf2Block, firmwareSize);
+		if (err == FirmwareFlashErrorCode::ok)
 		{
-			delay(100);
-			// Pad last block if needed
-			memset(((uint8_t *)firmwareBuffer) + fileSize/2, 0xff, roundedUpLength - fileSize/2);
 			break;
 		}
+		ReportFlashError(err);
 	}
+
+	// Pad the last flash block
+	const uint32_t roundedUpLength = ((firmwareSize + (FlashBlockSize - 1))/FlashBlockSize) * FlashBlockSize;
+	memset(reinterpret_cast<uint8_t*>(firmwareBuffer) + firmwareSize, 0xFF, roundedUpLength - firmwareSize);
+	delay(100);
 	debugPrintf("Download complete\n");
 #if 0
 String<StringLength256> reply;
@@ -696,10 +774,21 @@ for(uint32_t offset = 0; offset < roundedUpLength/4; offset++)
 debugPrintf("Verify 1 complete, writing to flash, wait for reboot in 10 seconds\n");
 delay(100);
 #endif
+
+	// Compare the new firmware with the installed firmware. If nothing has changed then we don't need to write to the flash at all.
+	// Otherwise compute the CRC of the new firmware so that we can check the flash after writing it.
+	const unsigned int numChangedSectors = CountChangedSectors(firmwareBuffer, roundedUpLength);
+	const uint32_t newFirmwareCRC = ComputeCRC32InRam(firmwareBuffer, firmwareBuffer + roundedUpLength/4);
+	debugPrintf("New firmware CRC %08" PRIx32 ", %u of %" PRIu32 " sectors changed\n", newFirmwareCRC, numChangedSectors, roundedUpLength/FlashSectorSize);
+	delay(100);
 	CanInterface::Shutdown();
-	WriteFirmwareToFlash(firmwareBuffer, roundedUpLength);
+	if (numChangedSectors == 0)
+	{
+		Platform::ResetProcessor();
+	}
+	WriteFirmwareToFlash(firmwareBuffer, roundedUpLength, newFirmwareCRC);
 #if 0
-debugPrintf("Flash write complete erase time %d flash time %d\n", (int)(eraseTime*StepTimer::StepClocksToMillis), (int)(flashTime*StepTimer::StepClocksToMillis));
+debugPrintf("Flash write complete flash time %d\n", (int)(flashTime*StepTimer::StepClocksToMillis));
 debugPrintf("Verifying\n");
 for(uint32_t offset = 0; offset < roundedUpLength/4; offset++)
 {